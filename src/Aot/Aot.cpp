@@ -0,0 +1,94 @@
+#include "Aot.h"
+#include "../CpuCore.h"
+#include "../Breakpoints.h"
+#include "../Hooks.h"
+#include "../Utilities/ExitHelper.h"
+
+#include <dlfcn.h>
+
+// Load the compiled ROM. Exits the emulator if it can't be loaded or doesn't match the ROM
+Aot::Aot(CPU& cpu, const char *filename) : cpu(cpu), ctx(), blocks(0x10000) {
+    handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) ExitHelper::error("Error: AOT file [%s] could not be loaded:\n%s\n", filename, dlerror());
+
+    auto module = static_cast<const aot::Module*>(dlsym(handle, aot::MODULE_SYMBOL));
+    if (module == nullptr) ExitHelper::error("Error: [%s] is not a compiled ROM\n", filename);
+    if (module->abi_version != aot::ABI_VERSION)
+        ExitHelper::error("Error: [%s] was compiled by a different version of the emulator\n", filename);
+
+    std::vector<uint16_t> rom_h(0x10000), rom_l(0x10000);
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        rom_h[addr] = cpu.rom.high(word(addr));
+        rom_l[addr] = cpu.rom.low(word(addr));
+    }
+    if (module->rom_hash != aot::hash_ROM(rom_h.data(), rom_l.data()))
+        ExitHelper::error("Error: [%s] was compiled from a different ROM\n", filename);
+
+    for (uint32_t i = 0; i < module->n_blocks; i++) {
+        const aot::Block& block = module->blocks[i];
+        // Breakpoints and exit points can only be reached at the start of a block, and hooked
+        // routines are replaced by the interpreter (see CPU::exec_hook)
+        bool has_breakpoint = false;
+        for (uint32_t addr = block.start + 1u; addr < uint32_t(block.start) + block.size; addr++)
+            if (Globals::breakpoints.flags(word(addr), false) != 0) has_breakpoint = true;
+        bool has_hook = false;
+        for (uint32_t addr = block.start; addr < uint32_t(block.start) + block.size; addr++)
+            if (Globals::hooks.is_hooked(word(addr))) has_hook = true;
+        if (!has_breakpoint && !has_hook) blocks[block.start] = &block;
+    }
+
+    ctx.cpu = &cpu;
+    ctx.read_RAM = &read_RAM;
+    ctx.write_RAM = &write_RAM;
+    ctx.read_ROM_L = &read_ROM_L;
+    ctx.read_ROM_H = &read_ROM_H;
+}
+
+Aot::~Aot() {
+    dlclose(handle);
+}
+
+
+// Run the compiled code starting at the current PC for at most max_cycles
+Aot::Result Aot::run(int32_t max_cycles) {
+    const aot::Block *block = blocks[cpu.PC];
+    if (block == nullptr || block->cycles > max_cycles) return {};
+
+    for (byte i = 0; i < 16; i++) ctx.regs[i] = cpu.regs[i];
+    cpu.materialize_flags();
+    ctx.flags = cpu.FLG;
+    ctx.cycles_left = max_cycles;
+    ctx.instructions = 0;
+
+    // Run blocks until one can't be entered, or until a breakpoint (checked by end_instruction)
+    do {
+        block->function(&ctx);
+        if (ctx.side_exit || Globals::breakpoints.flags(ctx.PC, false) != 0) break;
+        block = blocks[ctx.PC];
+    } while (block != nullptr && block->cycles <= ctx.cycles_left);
+
+    for (byte i = 1; i < 16; i++) cpu.regs.write(i, ctx.regs[i]);
+    cpu.FLG = ctx.flags;
+    cpu.PC = ctx.PC;
+    return { max_cycles - ctx.cycles_left, ctx.instructions };
+}
+
+
+
+// HELPER FUNCTIONS (called by the compiled code, the address is never MMIO)
+
+uint16_t Aot::read_RAM(void *cpu, uint16_t address) {
+    return static_cast<CPU*>(cpu)->ram.read(address);
+}
+
+void Aot::write_RAM(void *cpu, uint16_t address, uint16_t value) {
+    static_cast<CPU*>(cpu)->ram.write(address, value);
+}
+
+uint16_t Aot::read_ROM_L(void *cpu, uint16_t address) {
+    return static_cast<CPU*>(cpu)->rom.low(address);
+}
+
+uint16_t Aot::read_ROM_H(void *cpu, uint16_t address) {
+    return static_cast<CPU*>(cpu)->rom.high(address);
+}
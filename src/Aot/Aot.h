@@ -0,0 +1,47 @@
+#pragma once
+
+#include "../Globals.h"
+#include "AotRuntime.h"
+
+#include <vector>
+
+/*  Runs ROM code compiled ahead of time (see AotCompiler.h), loaded from a shared object.
+    Like the JIT, a block is only entered if it fits in the remaining cycle budget (which is also
+    limited by the timer), and blocks leave before instructions that access MMIO or would cause a
+    trap. RAM code, indirect jumps to addresses that aren't the start of a block and instructions
+    that can't be compiled are run by the interpreter.
+*/
+
+class CPU;
+
+class Aot {
+public:
+    // Clock cycles and instructions executed by run()
+    struct Result {
+        int32_t cycles = 0;
+        int32_t instructions = 0;
+    };
+
+    // Load the compiled ROM. Exits the emulator if it can't be loaded or doesn't match the ROM
+    Aot(CPU& cpu, const char *filename);
+    ~Aot();
+    Aot(const Aot&) = delete;
+    Aot& operator=(const Aot&) = delete;
+
+    // Run the compiled code starting at the current PC (the CPU must be in ROM) for at most
+    // max_cycles. If no block could be run, returns 0 cycles and the CPU is not modified
+    Result run(int32_t max_cycles);
+
+private:
+    CPU& cpu;
+    void *handle;
+    aot::Context ctx;
+    // Block that starts at each address (nullptr if none, or if it contains a breakpoint)
+    std::vector<const aot::Block*> blocks;
+
+    // Helper functions called by the compiled code (the address is never MMIO)
+    static uint16_t read_RAM(void *cpu, uint16_t address);
+    static void write_RAM(void *cpu, uint16_t address, uint16_t value);
+    static uint16_t read_ROM_L(void *cpu, uint16_t address);
+    static uint16_t read_ROM_H(void *cpu, uint16_t address);
+};
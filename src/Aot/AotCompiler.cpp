@@ -0,0 +1,303 @@
+#include "AotCompiler.h"
+#include "AotRuntime.h"
+#include "../Utilities/ExitHelper.h"
+
+#include <cstdarg>
+#include <fstream>
+
+using D = DecodedInstr;
+
+// printf-style formatting into a std::string
+static std::string format(const char *fmt, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return buffer;
+}
+
+// Value of a register (the zero register is a constant)
+static std::string reg(byte index) {
+    return (index == 0) ? "0" : format("r[%d]", index);
+}
+
+static std::string hex(word value) {
+    return format("0x%04X", value);
+}
+
+
+AotCompiler::AotCompiler(const std::vector<word>& rom_h, const std::vector<word>& rom_l) :
+    rom_h(rom_h), rom_l(rom_l), is_leader(0x10000) { }
+
+// Decode the instruction at an address of ROM
+AotCompiler::Instr AotCompiler::decode(word PC) const {
+    Instr instr;
+    instr.PC = PC;
+    instr.info = DECODE_TABLE[rom_h[PC]];
+    instr.argument = rom_l[PC];
+    instr.rB = instr.info.rB_is_rA ? instr.info.rA : byte(instr.argument & 0xF);
+    return instr;
+}
+
+// Returns true if an instruction can be compiled (the others are left to the interpreter)
+bool AotCompiler::is_compilable(const Instr& instr) {
+    auto op = instr.info.op;
+    if (op < D::OP_ALU_M_OP) return true;
+    if (op < D::OP_SHFT) return instr.info.mode != 0b00 || instr.argument < MMIO_START;
+    if (op < D::OP_MEM) return true;
+    if (op == D::OP_MEM) return false; // movb
+    if (op < D::OP_JMP) return true;
+    if (op < D::OP_CALL) return instr.info.funct <= 0b1110; // Valid jump condition
+    // syscall, enter, sysret and exit switch between ROM and RAM
+    return op == D::OP_CALL || op == D::OP_RET;
+}
+
+// Returns true if an instruction ends a block (jump, call or ret)
+bool AotCompiler::is_terminator(const Instr& instr) {
+    return instr.info.op >= D::OP_JMP;
+}
+
+// Find the addresses where a block starts
+void AotCompiler::find_leaders() {
+    // Only the part of the ROM that has been loaded (the rest is filled with zeros) is scanned
+    uint32_t size = 0x10000;
+    while (size > 0 && rom_h[size-1] == 0 && rom_l[size-1] == 0) size--;
+
+    // Reset vector, interrupt vectors (from RAM and from ROM)
+    is_leader[0x0000] = is_leader[0x0011] = is_leader[0x0013] = true;
+
+    for (uint32_t PC = 0; PC < size; PC++) {
+        Instr instr = decode(word(PC));
+        bool compilable = is_compilable(instr);
+        // Immediate jump and call targets
+        if (compilable && is_terminator(instr) && instr.info.op != D::OP_RET && instr.info.mode == 1)
+            is_leader[instr.argument] = true;
+        // Return addresses and instructions that follow the end of a block
+        if ((!compilable || is_terminator(instr)) && PC < 0xFFFF) is_leader[PC+1] = true;
+    }
+}
+
+// Collect the instructions of the block that starts at an address
+std::vector<AotCompiler::Instr> AotCompiler::collect_block(word start) const {
+    std::vector<Instr> block;
+    for (word PC = start; block.size() < MAX_BLOCK_INSTRS; PC++) {
+        if (PC == 0xFFFF) break; // Incrementing the PC would cause a trap
+        if (PC != start && is_leader[PC]) break;
+
+        Instr instr = decode(PC);
+        if (!is_compilable(instr)) break;
+        block.push_back(instr);
+        if (is_terminator(instr)) break;
+    }
+    return block;
+}
+
+
+
+// CODE GENERATION
+
+// Write the generated code into a file. Returns the number of compiled blocks
+int AotCompiler::write(const char *filename) {
+    find_leaders();
+
+    std::string code =
+        "// Generated by the CESC16 emulator (-c), compile with:\n"
+        "// g++ -O2 -shared -fPIC -I path/to/emulator/src/Aot FILE.cpp -o FILE.so\n\n"
+        "#include \"AotRuntime.h\"\n"
+        "#include <cstring>\n\n";
+    std::string table;
+    int n_blocks = 0;
+
+    for (uint32_t start = 0; start < 0x10000; start++) {
+        if (!is_leader[start]) continue;
+        std::vector<Instr> block = collect_block(word(start));
+        if (block.empty()) continue;
+
+        int cycles = 0;
+        for (const Instr& instr : block) cycles += instr.info.cycles;
+        code += emit_block(block);
+        table += format("    {0x%04X, %d, %d, &block_%04X},\n", start, int(block.size()), cycles, start);
+        n_blocks++;
+    }
+
+    code += "static const aot::Block BLOCKS[] = {\n" + table + "};\n\n";
+    code += format("extern \"C\" const aot::Module %s = {\n", aot::MODULE_SYMBOL);
+    code += format("    aot::ABI_VERSION, 0x%016llXULL, %d, BLOCKS\n};\n",
+        (unsigned long long)aot::hash_ROM(rom_h.data(), rom_l.data()), n_blocks);
+
+    std::ofstream file(filename);
+    if (!file) ExitHelper::error("Error: AOT output file [%s] could not be opened\n", filename);
+    file << code;
+    if (!file) ExitHelper::error("Error: AOT output file [%s] could not be written\n", filename);
+    return n_blocks;
+}
+
+// Generate the function of a block
+std::string AotCompiler::emit_block(const std::vector<Instr>& block) const {
+    int cycles = 0;
+    for (const Instr& instr : block) cycles += instr.info.cycles;
+
+    word start = block.front().PC;
+    std::string code = format("// 0x%04X: %d instructions, %d cycles\n", start, int(block.size()), cycles);
+    code += format("static void block_%04X(aot::Context *ctx) {\n", start);
+    code +=
+        "    uint16_t r[16];\n"
+        "    std::memcpy(r, ctx->regs, sizeof(r));\n"
+        "    uint8_t f = ctx->flags;\n"
+        "    // Continue at PC, after running the given number of instructions\n"
+        "    auto leave = [&](uint16_t PC, int32_t cycles, int32_t instructions, bool side_exit) {\n"
+        "        std::memcpy(ctx->regs, r, sizeof(r));\n"
+        "        ctx->flags = f;\n"
+        "        ctx->PC = PC;\n"
+        "        ctx->cycles_left -= cycles;\n"
+        "        ctx->instructions += instructions;\n"
+        "        ctx->side_exit = side_exit;\n"
+        "    };\n";
+
+    int cycles_before = 0;
+    for (size_t i = 0; i < block.size(); i++) {
+        const Instr& instr = block[i];
+        // Leave before the instruction, so that the interpreter runs it
+        std::string side_exit = format("return leave(0x%04X, %d, %d, true);", instr.PC, cycles_before, int(i));
+        cycles_before += instr.info.cycles;
+
+        std::string body = emit_instr(instr, side_exit);
+        if (is_terminator(instr)) {
+            // The destination is in dest
+            body += format(" return leave(dest, %d, %d, false);", cycles, int(block.size()));
+        }
+        code += format("    /* %04X */ { ", instr.PC) + body + " }\n";
+    }
+    // The block has been cut before another block or an instruction that can't be compiled
+    if (!is_terminator(block.back()))
+        code += format("    leave(0x%04X, %d, %d, false);\n", block.back().PC + 1, cycles, int(block.size()));
+    code += "}\n\n";
+    return code;
+}
+
+// Expression of an ALU operation (sets the flags in f)
+std::string AotCompiler::emit_ALU(byte funct, const std::string& A, const std::string& B) {
+    switch (funct) {
+    case 0b000: return B; // mov
+    case 0b001: return "aot::logic(" + A + ", " + B + ", uint16_t(" + A + " & " + B + "), f)";
+    case 0b010: return "aot::logic(" + A + ", " + B + ", uint16_t(" + A + " | " + B + "), f)";
+    case 0b011: return "aot::logic(" + A + ", " + B + ", uint16_t(" + A + " ^ " + B + "), f)";
+    case 0b100: return "aot::add(" + A + ", " + B + ", 0, f)";
+    case 0b101: return "aot::sub(" + A + ", " + B + ", 0, f)";
+    case 0b110: return "aot::add(" + A + ", " + B + ", (f >> 1) & 1, f)"; // addc
+    default: return "aot::sub(" + A + ", " + B + ", (f >> 1) & 1, f)";    // subb
+    }
+}
+
+// Expression of the address of a memory operand
+std::string AotCompiler::emit_address(const Instr& instr) {
+    const OpcodeInfo& info = instr.info;
+    switch (info.mode) {
+    case 0b00: return hex(instr.argument); // Direct addressing (checked by is_compilable)
+    case 0b01: return (info.op < D::OP_ALU_M_DEST) ? reg(instr.rB) : reg(info.rA); // Indirect addressing
+    case 0b10: return "uint16_t(" + reg(info.rA) + " + " + hex(instr.argument) + ")";
+    default: return "uint16_t(" + reg(info.rA) + " + " + reg(instr.rB) + ")";
+    }
+}
+
+// Generate the code of an instruction. side_exit leaves the block before running it
+std::string AotCompiler::emit_instr(const Instr& instr, const std::string& side_exit) {
+    const OpcodeInfo& info = instr.info;
+    auto op = info.op;
+    std::string mmio_check = "if (a >= " + hex(MMIO_START) + ") " + side_exit + " ";
+    std::string read = "ctx->read_RAM(ctx->cpu, a)";
+    // Store the result of an ALU operation in rD (the zero register only keeps the flags)
+    auto store = [&](const std::string& result) {
+        if (info.rD != 0) return "r[" + std::to_string(info.rD) + "] = " + result + ";";
+        return (info.funct == 0b000) ? std::string() : result + ";";
+    };
+
+    if (op < D::OP_ALU_M_OP) {
+        // ALU operation (operands in registers)
+        std::string B = info.mode ? hex(instr.argument) : reg(instr.rB);
+        return store(emit_ALU(info.funct, reg(info.rA), B));
+    }
+    if (op < D::OP_ALU_M_DEST) {
+        // ALU operation (operand in memory). Indexed modes use rD as the first operand
+        std::string code = "uint16_t a = " + emit_address(instr) + "; ";
+        if (info.mode != 0b00) code += mmio_check;
+        std::string A = (info.mode < 0b10) ? reg(info.rA) : reg(info.rD);
+        std::string result = store(emit_ALU(info.funct, A, "m"));
+        // mov into the zero register doesn't use the word (reading RAM below MMIO has no side effects),
+        // only the MMIO check is kept
+        if (result.empty()) return (info.mode != 0b00) ? code : std::string();
+        return code + "uint16_t m = " + read + "; " + result;
+    }
+    if (op < D::OP_SHFT) {
+        // ALU operation (destination in memory, register or immediate operand)
+        std::string B;
+        if (op < D::OP_ALU_MEM_IMM) B = (info.mode == 0b00) ? reg(info.rA) : (info.mode == 0b01) ? reg(instr.rB) : reg(info.rD);
+        else B = (info.mode == 0b01) ? hex(instr.argument) : std::to_string(info.rD);
+        std::string code = "uint16_t a = " + emit_address(instr) + "; ";
+        if (info.mode != 0b00) code += mmio_check;
+        // mov overwrites the word without reading it
+        if (info.funct == 0b000) return code + "ctx->write_RAM(ctx->cpu, a, " + B + ");";
+        return code + "uint16_t m = " + read + "; ctx->write_RAM(ctx->cpu, a, " + emit_ALU(info.funct, "m", B) + ");";
+    }
+    if (op < D::OP_MEM) {
+        // Bit shift
+        byte shamt = info.mode;
+        std::string result;
+        if (info.funct == 0b01) {
+            // sll: the flags are the ones of the last add (result+result)
+            if (shamt == 0) return (info.rD != 0) ? "r[" + std::to_string(info.rD) + "] = " + reg(info.rA) + ";" : "";
+            std::string code = format("uint16_t h = uint16_t(%s << %d); ", reg(info.rA).c_str(), shamt - 1);
+            if (info.rD != 0) return code + "r[" + std::to_string(info.rD) + "] = aot::add(h, h, 0, f);";
+            return code + "aot::add(h, h, 0, f);";
+        }
+        if (info.funct == 0b10) result = format("uint16_t(%s >> %d)", reg(info.rA).c_str(), shamt);
+        else result = format("uint16_t(int16_t(%s) >> %d)", reg(info.rA).c_str(), shamt);
+        // srl, sra: C and V are not modified
+        std::string code = "uint16_t v = " + result + "; f = uint8_t((f & (aot::FLAG_C | aot::FLAG_V)) | aot::ZS_flags(v));";
+        if (info.rD != 0) code += " r[" + std::to_string(info.rD) + "] = v;";
+        return code;
+    }
+
+    // Stack checks: the SP can't overflow and the accessed word can't be MMIO
+    std::string push_check = "if (r[1] == 0 || r[1] > " + hex(MMIO_START) + ") " + side_exit + " ";
+    std::string pop_check = "if (r[1] >= " + hex(MMIO_START) + ") " + side_exit + " ";
+    std::string push_value = "r[1]--; ctx->write_RAM(ctx->cpu, r[1], v);";
+    std::string rD_store = (info.rD != 0) ? " r[" + std::to_string(info.rD) + "] = v;" : "";
+
+    if (op < D::OP_JMP) {
+        switch (op - D::OP_MEM) {
+        case 0b00001: // swap
+            return "uint16_t a = uint16_t(" + reg(info.rA) + " + " + hex(instr.argument) + "); " + mmio_check +
+                "uint16_t t = " + reg(info.rD) + "; uint16_t v = " + read + ";" + rD_store + " ctx->write_RAM(ctx->cpu, a, t);";
+        case 0b00010: // peek (LSB/argument)
+        case 0b00011: { // peek (MSB/opcode)
+            if (info.rD == 0) return "";
+            const char *helper = (op - D::OP_MEM == 0b00010) ? "read_ROM_L" : "read_ROM_H";
+            return format("r[%d] = ctx->%s(ctx->cpu, uint16_t(%s + %s));", info.rD, helper, reg(info.rA).c_str(), hex(instr.argument).c_str());
+        }
+        case 0b00100: return push_check + "uint16_t v = " + reg(instr.rB) + "; " + push_value;       // push (reg)
+        case 0b00101: return push_check + "uint16_t v = " + hex(instr.argument) + "; " + push_value; // push (imm)
+        case 0b00110: return push_check + "uint16_t v = f; " + push_value;                            // pushf
+        case 0b00111: // pop
+            return pop_check + "uint16_t v = ctx->read_RAM(ctx->cpu, r[1]); r[1]++;" + rD_store;
+        default: // popf (the top bits of the flags must be 0, otherwise the interpreter reports it)
+            return pop_check + "uint16_t v = ctx->read_RAM(ctx->cpu, r[1]); if (v & 0xF0) " + side_exit + " r[1]++; f = uint8_t(v);";
+        }
+    }
+
+    word next_PC = instr.PC + 1;
+    if (op < D::OP_CALL) {
+        // Jump
+        std::string target = info.mode ? hex(instr.argument) : reg(info.rA);
+        if (info.funct == 0b0000) return "uint16_t dest = " + target + ";";
+        return format("uint16_t dest = aot::condition(%d, f) ? %s : %s;", info.funct, target.c_str(), hex(next_PC).c_str());
+    }
+    if (op == D::OP_CALL) {
+        // The destination is read before pushing the return address
+        std::string target = info.mode ? hex(instr.argument) : reg(instr.rB);
+        return push_check + "uint16_t dest = " + target + "; uint16_t v = " + hex(next_PC) + "; " + push_value;
+    }
+    // ret
+    return pop_check + "uint16_t dest = ctx->read_RAM(ctx->cpu, r[1]); r[1]++;";
+}
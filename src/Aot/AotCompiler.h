@@ -0,0 +1,56 @@
+#pragma once
+
+#include "../Globals.h"
+#include "../DecodeTable.h"
+
+#include <string>
+#include <vector>
+
+/*  Ahead-of-time compiler:
+    Translates a ROM image into C++ source code, with one function per basic block. Once compiled
+    into a shared object, it can be loaded with -a (see Aot.h) instead of interpreting ROM code.
+    Blocks start at the reset and interrupt vectors, at the targets of jumps and calls, after calls
+    (return addresses) and after any instruction that ends a block (usually the start of another
+    function). A block ends at a jump, call or ret, before an instruction that can't be compiled
+    (which is then interpreted), or before the start of another block.
+    Like in the JIT, instructions that would access MMIO or overflow the SP leave the block before
+    doing anything, so that the interpreter runs them.
+*/
+
+class AotCompiler {
+public:
+    // rom_h and rom_l contain the whole ROM (0x10000 words each)
+    AotCompiler(const std::vector<word>& rom_h, const std::vector<word>& rom_l);
+
+    // Write the generated code into a file. Returns the number of compiled blocks
+    int write(const char *filename);
+
+private:
+    // Instruction of a block
+    struct Instr {
+        word PC;
+        OpcodeInfo info;
+        word argument;
+        byte rB;
+    };
+
+    const std::vector<word>& rom_h;
+    const std::vector<word>& rom_l;
+    // Addresses where a block starts
+    std::vector<bool> is_leader;
+
+    static constexpr size_t MAX_BLOCK_INSTRS = 64;
+    static constexpr word MMIO_START = 0xFF00;
+
+    Instr decode(word PC) const;
+    static bool is_compilable(const Instr& instr);
+    static bool is_terminator(const Instr& instr);
+    void find_leaders();
+    std::vector<Instr> collect_block(word start) const;
+
+    // Code generation
+    std::string emit_block(const std::vector<Instr>& block) const;
+    static std::string emit_instr(const Instr& instr, const std::string& side_exit);
+    static std::string emit_ALU(byte funct, const std::string& A, const std::string& B);
+    static std::string emit_address(const Instr& instr);
+};
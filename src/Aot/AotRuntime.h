@@ -0,0 +1,118 @@
+#pragma once
+
+// Interface between the emulator and the C++ code generated by the AOT compiler (see AotCompiler.h).
+// The generated code only includes this header, so it can be compiled separately into a shared object
+
+#include <cstdint>
+#include <initializer_list>
+
+namespace aot {
+
+// Incremented whenever the interface changes
+constexpr uint32_t ABI_VERSION = 1;
+
+// State shared with the compiled blocks
+struct Context {
+    uint16_t regs[16];      // Register file
+    uint8_t flags;          // Same format as CPU::FLG
+    bool side_exit;         // Set if a block stopped before an instruction that must be interpreted
+    uint16_t PC;            // Address of the next instruction, when a block returns
+    int32_t cycles_left;    // Cycles that can still be run
+    int32_t instructions;   // Executed instructions
+
+    // Memory accesses (the address is never MMIO)
+    void *cpu;
+    uint16_t (*read_RAM)(void *cpu, uint16_t address);
+    void (*write_RAM)(void *cpu, uint16_t address, uint16_t value);
+    uint16_t (*read_ROM_L)(void *cpu, uint16_t address);
+    uint16_t (*read_ROM_H)(void *cpu, uint16_t address);
+};
+
+// Compiled basic block. It can only be called if cycles_left is at least its cost
+using BlockFunction = void (*)(Context *ctx);
+struct Block {
+    uint16_t start;         // Address of the first instruction
+    uint16_t size;          // Number of instructions
+    int32_t cycles;         // Clock cycles used by the whole block
+    BlockFunction function;
+};
+
+// Exported by the shared object as MODULE_SYMBOL
+struct Module {
+    uint32_t abi_version;
+    uint64_t rom_hash;      // The module can only be used with the ROM it was compiled from
+    uint32_t n_blocks;
+    const Block *blocks;
+};
+constexpr const char *MODULE_SYMBOL = "cesc16_aot_module";
+
+// FNV-1a hash of the whole ROM (upper and lower 16 bits of each address)
+inline uint64_t hash_ROM(const uint16_t *rom_h, const uint16_t *rom_l) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        for (uint16_t value : {rom_h[addr], rom_l[addr]}) {
+            hash = (hash ^ (value & 0xFF)) * 0x100000001B3;
+            hash = (hash ^ (value >> 8)) * 0x100000001B3;
+        }
+    }
+    return hash;
+}
+
+
+
+// ALU HELPERS (used by the generated code, they compute the flags like CPU::ALU_result)
+
+enum : uint8_t { FLAG_Z = 1, FLAG_C = 2, FLAG_V = 4, FLAG_S = 8 };
+
+inline uint8_t ZS_flags(uint16_t result) {
+    return uint8_t((result == 0 ? FLAG_Z : 0) | (result & 0x8000 ? FLAG_S : 0));
+}
+
+// add, addc
+inline uint16_t add(uint16_t A, uint16_t B, uint32_t carry_in, uint8_t& flags) {
+    uint32_t full = uint32_t(A) + B + carry_in;
+    auto result = uint16_t(full);
+    bool V = (~(A ^ B) & (A ^ result) & 0x8000) != 0;
+    flags = uint8_t(ZS_flags(result) | (full & 0x10000 ? FLAG_C : 0) | (V ? FLAG_V : 0));
+    return result;
+}
+
+// sub, subb
+inline uint16_t sub(uint16_t A, uint16_t B, uint32_t borrow_in, uint8_t& flags) {
+    uint32_t full = uint32_t(A) - B - borrow_in;
+    auto result = uint16_t(full);
+    bool V = ((A ^ B) & (A ^ result) & 0x8000) != 0;
+    flags = uint8_t(ZS_flags(result) | (full & 0x10000 ? FLAG_C : 0) | (V ? FLAG_V : 0));
+    return result;
+}
+
+// and, or, xor (the carry is set and the overflow is computed like in an addition)
+inline uint16_t logic(uint16_t A, uint16_t B, uint16_t result, uint8_t& flags) {
+    bool V = (~(A ^ B) & (A ^ result) & 0x8000) != 0;
+    flags = uint8_t(ZS_flags(result) | FLAG_C | (V ? FLAG_V : 0));
+    return result;
+}
+
+// Returns true if a jump condition (0..14) is met
+inline bool condition(uint8_t cond, uint8_t flags) {
+    bool Z = flags & FLAG_Z, C = flags & FLAG_C, V = flags & FLAG_V, S = flags & FLAG_S;
+    switch (cond) {
+    case 0b0000: return true;
+    case 0b0001: return Z;
+    case 0b0010: return !Z;
+    case 0b0011: return C;
+    case 0b0100: return !C;
+    case 0b0101: return V;
+    case 0b0110: return !V;
+    case 0b0111: return S;
+    case 0b1000: return !S;
+    case 0b1001: return C || Z;
+    case 0b1010: return !(C || Z);
+    case 0b1011: return V != S;
+    case 0b1100: return (V != S) || Z;
+    case 0b1101: return (V == S) && !Z;
+    default: return V == S;
+    }
+}
+
+} // namespace aot
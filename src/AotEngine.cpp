@@ -0,0 +1,46 @@
+#include "CpuCore.h"
+#include "Aot/Aot.h"
+#include "Aot/AotCompiler.h"
+
+#include <algorithm>
+
+/*  AOT engine:
+    ROM code is run by the blocks compiled ahead of time (see Aot/Aot.h), and everything else is
+    interpreted like in the default engine. As in the JIT engine, the compiled code only runs when
+    no event can happen in the middle of it, and the blocks are accounted at once.
+*/
+
+// Run CPU for a number of clock cycles, using the AOT engine.
+// Returns how many extra cycles were needed to finish the last instruction.
+int32_t CPU::execute_aot(int32_t cycles) {
+    if (!aot) aot = std::make_unique<Aot>(*this, Globals::aot_file);
+
+    while (cycles > 0) {
+        if (!user_mode && !IRQ && steps_left == 0 && !hook_call.active) {
+            Aot::Result result = aot->run(std::min(cycles, int32_t(events.max_tick())));
+            if (result.cycles > 0) {
+                cycles -= result.cycles;
+                if (end_instruction(result.cycles, result.instructions)) return 0;
+                continue;
+            }
+        }
+
+        int instructions;
+        int used_cycles = user_mode ? exec_next<true>(cycles, instructions) : exec_next<false>(cycles, instructions);
+        cycles -= used_cycles;
+        if (end_instruction(used_cycles, instructions)) return 0;
+    }
+
+    // If finishing an instruction took some extra cycles, return how many
+    return -cycles;
+}
+
+// Translate the ROM into C++ code (see Aot/AotCompiler.h). Returns the number of compiled blocks
+int CPU::compile_ROM(const char *filename) {
+    std::vector<word> high(0x10000), low(0x10000);
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        high[addr] = rom.high(word(addr));
+        low[addr] = rom.low(word(addr));
+    }
+    return AotCompiler(high, low).write(filename);
+}
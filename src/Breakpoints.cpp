@@ -0,0 +1,118 @@
+#include "Breakpoints.h"
+#include "Memory.h"
+
+#include <cstdlib>
+#include <cstring>
+
+// Parse a hex integer. Returns -1 if it's not valid
+static long parse_hex(const std::string& str) {
+    if (str.empty()) return -1;
+    char *endptr;
+    long value = strtol(str.c_str(), &endptr, 16);
+    if (*endptr != '\0') return -1;
+    return value;
+}
+
+// Parse a breakpoint with the format [rom:|ram:]address[,condition]...
+std::string Breakpoints::add(Kind kind, const std::string& spec) {
+    Entry entry;
+    entry.kind = kind;
+
+    // Address space
+    std::string str = spec;
+    if (str.compare(0, 4, "rom:") == 0) entry.ram = false;
+    else if (str.compare(0, 4, "ram:") == 0) entry.rom = false;
+    if (!entry.rom || !entry.ram) str = str.substr(4);
+
+    // Address
+    size_t comma = str.find(',');
+    long address = parse_hex(str.substr(0, comma));
+    if (address == -1) return "make sure it's a valid hex integer";
+    if (address < 0 || address >= 0xFFFF) return "make sure it's between 0 and 0xFFFF";
+
+    // Conditions
+    while (comma != std::string::npos) {
+        size_t next = str.find(',', comma+1);
+        std::string error = parse_condition(str.substr(comma+1, next-comma-1), entry);
+        if (!error.empty()) return error;
+        comma = next;
+    }
+
+    if (entry.rom) table[0][address] |= kind;
+    if (entry.ram) table[1][address] |= kind;
+    entry_map[word(address)].push_back(entry);
+    return "";
+}
+
+// Parse a condition (#hits, flag, !flag or operand OP hex_value) and add it to the entry
+std::string Breakpoints::parse_condition(const std::string& str, Entry& entry) {
+    // Hit count
+    if (!str.empty() && str[0] == '#') {
+        char *endptr;
+        long hits = strtol(str.c_str()+1, &endptr, 10);
+        if (*endptr != '\0' || hits < 1) return "invalid hit count [" + str + "]";
+        entry.hit_count = uint32_t(hits);
+        return "";
+    }
+
+    // Flag
+    const std::string FLAG_NAMES = "ZCVS"; // Same order as StatusFlags
+    bool negated = !str.empty() && str[0] == '!';
+    if (str.size() == 1u + negated && FLAG_NAMES.find(str.back()) != std::string::npos) {
+        Condition cond;
+        cond.type = Condition::FLAG;
+        cond.index = word(FLAG_NAMES.find(str.back()));
+        cond.compare = negated ? Condition::EQ : Condition::NE;
+        entry.conditions.push_back(cond);
+        return "";
+    }
+
+    // Comparison (the longest operators must be checked first)
+    const std::pair<const char*, Condition::Compare> OPERATORS[] = {
+        {"==", Condition::EQ}, {"!=", Condition::NE}, {"<=", Condition::LE},
+        {">=", Condition::GE}, {"<", Condition::LT}, {">", Condition::GT},
+    };
+    for (const auto& [op, compare] : OPERATORS) {
+        size_t pos = str.find(op);
+        if (pos == std::string::npos) continue;
+
+        std::string lhs = str.substr(0, pos);
+        long value = parse_hex(str.substr(pos + strlen(op)));
+        if (value < 0 || value > 0xFFFF) return "invalid value in condition [" + str + "]";
+
+        Condition cond;
+        cond.compare = compare;
+        cond.value = word(value);
+        if (lhs.size() >= 3 && lhs.front() == '[' && lhs.back() == ']') {
+            // Memory word (MMIO can't be read without side effects)
+            long address = parse_hex(lhs.substr(1, lhs.size()-2));
+            if (address < 0 || address >= 0xFF00) return "invalid memory address in condition [" + str + "]";
+            cond.type = Condition::MEM;
+            cond.index = word(address);
+        }
+        else {
+            // Register (ABI name or r0-r15)
+            cond.type = Condition::REG;
+            cond.index = 0xFFFF;
+            for (word i = 0; i < Regfile::ABI_names.size(); i++) {
+                if (lhs == Regfile::ABI_names[i] || lhs == "r" + std::to_string(i)) cond.index = i;
+            }
+            if (cond.index == 0xFFFF) return "unknown register in condition [" + str + "]";
+        }
+        entry.conditions.push_back(cond);
+        return "";
+    }
+    return "invalid condition [" + str + "]";
+}
+
+// Returns the result of comparing A and B
+bool Breakpoints::compare(Condition::Compare compare, word A, word B) {
+    switch (compare) {
+    case Condition::EQ: return A == B;
+    case Condition::NE: return A != B;
+    case Condition::LT: return A < B;
+    case Condition::GT: return A > B;
+    case Condition::LE: return A <= B;
+    default: return A >= B;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Globals.h"
+
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Breakpoints and exit points. Each address of ROM and RAM has a flag, so checking an address
+// without any breakpoint only takes a single load. Conditions and hit counts are only evaluated
+// for the addresses that are flagged (see CPU::check_breakpoints)
+class Breakpoints {
+public:
+    // What happens when a breakpoint is reached (used as flags)
+    enum Kind : byte {
+        BREAK = 1,  // Pause the emulator (-b)
+        EXIT = 2,   // Exit the emulator (-x)
+    };
+
+    // Predicate that must be true for the breakpoint to be reached
+    struct Condition {
+        enum Type : byte { REG, MEM, FLAG };
+        enum Compare : byte { EQ, NE, LT, GT, LE, GE };
+        Type type;
+        Compare compare = NE;
+        word index;     // Register index, RAM address or flag (bit of CPU::FLG)
+        word value = 0; // Compared to the register or memory word (flags are compared to 0)
+    };
+
+    struct Entry {
+        Kind kind;
+        bool rom = true;    // Set in ROM space
+        bool ram = true;    // Set in RAM space
+        std::vector<Condition> conditions;  // All of them must be true
+        uint32_t hit_count = 1; // Number of times the conditions must be met before the breakpoint is reached
+        uint32_t hits = 0;
+    };
+
+    // Parse a breakpoint with the format [rom:|ram:]address[,condition]... (see README.md).
+    // Returns an error message, or an empty string if the breakpoint was added
+    std::string add(Kind kind, const std::string& spec);
+
+    // Returns the kinds of the breakpoints set at an address (0 if none)
+    byte flags(word addr, bool user) const {
+        return table[user][addr];
+    }
+
+    // Returns the breakpoints set at a flagged address
+    std::vector<Entry>& entries(word addr) {
+        return entry_map[addr];
+    }
+
+    // Returns the result of comparing A and B
+    static bool compare(Condition::Compare compare, word A, word B);
+
+private:
+    // Flags of each address, in ROM space (0) and RAM space (1)
+    std::array<std::array<byte,0x10000>,2> table{};
+    std::unordered_map<word, std::vector<Entry>> entry_map;
+
+    static std::string parse_condition(const std::string& str, Entry& entry);
+};
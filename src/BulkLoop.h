@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Globals.h"
+
+#include <vector>
+
+// Loop that copies, fills or compares memory, translated into simple operations when its first
+// instruction is decoded (see BulkLoops.cpp)
+struct BulkLoop {
+    struct Op {
+        enum Kind : byte {
+            STEP,   // add/sub rD, rD, imm
+            TEST,   // sub/and zero, rA, rB/value (only sets the flags)
+            LOAD,   // mov rD, [rA+rB+imm]
+            STORE,  // mov [rA+rB+imm], rD/value
+            EXIT,   // Conditional jump out of the loop
+            BACK,   // Jump back to the first instruction (last operation)
+        };
+        Kind kind = STEP;
+        byte funct = 0;         // ALU funct (STEP, TEST) or jump condition (EXIT, BACK)
+        byte rD = 0;            // Written register (STEP, LOAD) or stored register (STORE)
+        byte rA = 0;            // Operands (TEST) or registers added to get the address (LOAD, STORE)
+        byte rB = 0;
+        bool has_value = false; // The second operand (TEST) or the stored data (STORE) is value instead of a register
+        word imm = 0;           // Step (STEP) or offset of the address (LOAD, STORE)
+        word value = 0;
+    };
+
+    std::vector<Op> ops;
+};
@@ -0,0 +1,285 @@
+#include "CpuCore.h"
+
+#include <algorithm>
+#include <array>
+
+/*  Bulk loops:
+    Buffers are copied, cleared and compared by small loops that step some registers by a constant,
+    load and store words at addresses computed from them, and test a counter or the loaded data.
+    When such a loop is decoded, its body is translated into a list of simple operations (BulkLoop),
+    and every time it's entered:
+    1. Its control flow is simulated on a copy of the registers, without writing memory, in order to
+       find how many iterations run before one leaves the loop (or before the time slice ends or the
+       next device event).
+    2. If the words read by those iterations aren't written by them and no MMIO is accessed, their
+       stores are done at once, by copying or filling whole ranges of RAM. The registers are set to
+       their values at the start of the next iteration, and the cycles of all the iterations are
+       accounted as if they had been run.
+    3. The next iteration is run normally, so the flags and the way the loop is left are exactly
+       those of the original code.
+*/
+
+using Op = BulkLoop::Op;
+
+// Translate an instruction of a loop body (see CPU::collect_loop) into an operation.
+// Returns false if it can't be run in bulk
+static bool make_op(const DecodedInstr& instr, Op& op) {
+    using D = DecodedInstr;
+    const bool is_mov = (instr.funct == 0b000);
+    op = Op();
+
+    if (instr.op < D::OP_ALU_M_OP) {
+        const bool imm = (instr.mode == 1);
+        op.funct = instr.funct;
+        if (instr.rD != 0) {
+            // add/sub rD, rD, imm
+            if (!imm || instr.rA != instr.rD || (instr.funct != 0b100 && instr.funct != 0b101)) return false;
+            op.kind = Op::STEP;
+            op.rD = instr.rD;
+            op.imm = instr.argument;
+        }
+        else {
+            // sub/and zero, rA, rB/imm
+            if (instr.funct != 0b101 && instr.funct != 0b001) return false;
+            op.kind = Op::TEST;
+            op.rA = instr.rA;
+            op.rB = instr.rB;
+            op.has_value = imm;
+            op.value = instr.argument;
+        }
+        return true;
+    }
+    if (instr.op < D::OP_ALU_M_DEST) {
+        // mov rD, [address]
+        if (!is_mov) return false;
+        op.kind = Op::LOAD;
+        op.rD = instr.rD;
+        switch (instr.mode) {
+        case 0b00: op.imm = instr.argument; break;                      // [imm]
+        case 0b01: op.rA = instr.rB; break;                             // [rB]
+        case 0b10: op.rA = instr.rA; op.imm = instr.argument; break;    // [rA+imm]
+        default: op.rA = instr.rA; op.rB = instr.rB; break;             // [rA+rB]
+        }
+        return true;
+    }
+    if (instr.op < D::OP_ALU_MEM_IMM) {
+        // mov [address], register
+        if (!is_mov) return false;
+        op.kind = Op::STORE;
+        switch (instr.mode) {
+        case 0b00: op.imm = instr.argument; op.rD = instr.rA; break;                    // [imm], rA
+        case 0b01: op.rA = instr.rA; op.rD = instr.rB; break;                           // [rA], rB
+        case 0b10: op.rA = instr.rA; op.imm = instr.argument; op.rD = instr.rD; break;  // [rA+imm], rB
+        default: op.rA = instr.rA; op.rB = instr.rB; op.rD = instr.rD; break;           // [rA+rC], rB
+        }
+        return true;
+    }
+    if (instr.op < D::OP_SHFT) {
+        // mov [address], immediate
+        if (!is_mov) return false;
+        op.kind = Op::STORE;
+        op.has_value = true;
+        op.value = instr.rD; // imm4
+        switch (instr.mode) {
+        case 0b00: op.imm = instr.argument; break;                      // [Addr16], imm4
+        case 0b01: op.rA = instr.rA; op.value = instr.argument; break;  // [rA], imm16
+        case 0b10: op.rA = instr.rA; op.imm = instr.argument; break;    // [rA+imm], imm4
+        default: op.rA = instr.rA; op.rB = instr.rB; break;             // [rA+rC], imm4
+        }
+        return true;
+    }
+    if (instr.op >= D::OP_JMP && instr.op < D::OP_JMP + 2*15) {
+        // Every jump but the last one leaves the loop
+        op.kind = Op::EXIT;
+        op.funct = instr.funct;
+        return true;
+    }
+    return false;
+}
+
+
+// Check if the loop that starts at the PC (see collect_loop) can be run in bulk. first is the instruction
+// at the PC, which has just been decoded. Returns true if it has been marked as the start of the loop
+bool CPU::find_bulk_loop(DecodedInstr& first, const DecodedInstr* members, int size) {
+    enum : byte { UNWRITTEN, STEPPED, LOADED };
+    std::array<byte,16> written{};      // How each register is written by the loop
+    std::array<int,16> load_index{};    // Operation that loads each register
+    bool has_step = false;
+    bool flags_set = false;
+
+    BulkLoop loop;
+    for (int i = 0; i < size; i++) {
+        Op op;
+        if (!make_op(members[i], op)) return false;
+        if (i == size-1) op.kind = Op::BACK;
+
+        switch (op.kind) {
+        case Op::STEP:
+        case Op::LOAD:
+            // Each register is written at most once (loads to zero are discarded)
+            if (op.rD == 0) break;
+            if (written[op.rD] != UNWRITTEN) return false;
+            written[op.rD] = (op.kind == Op::STEP) ? STEPPED : LOADED;
+            load_index[op.rD] = i;
+            if (op.kind == Op::STEP) has_step = true;
+            break;
+        case Op::EXIT:
+        case Op::BACK:
+            // The flags tested by the jumps are set in the same iteration
+            if (!flags_set) return false;
+            break;
+        default:
+            break;
+        }
+        if (op.kind == Op::STEP || op.kind == Op::TEST) flags_set = true;
+        loop.ops.push_back(op);
+    }
+    // Loops that don't step any register can't end (unless they are idle loops)
+    if (!has_step) return false;
+
+    for (int i = 0; i < size; i++) {
+        const Op& op = loop.ops[i];
+        if (op.kind != Op::LOAD && op.kind != Op::STORE) continue;
+        // The addresses change by a constant on every iteration
+        if (written[op.rA] == LOADED || written[op.rB] == LOADED) return false;
+        // The stored data is either the same on every iteration, or loaded before by the same iteration
+        if (op.kind == Op::STORE && !op.has_value) {
+            if (written[op.rD] == STEPPED) return false;
+            if (written[op.rD] == LOADED && load_index[op.rD] > i) return false;
+        }
+    }
+
+    bulk_loops[PC] = std::move(loop);
+    mark_loop(first, members, size, DecodedInstr::GROUP_BULK_LOOP);
+    return true;
+}
+
+// Run a bulk loop (can_run_group must have returned true): all its iterations that fit in the cycles
+// left, or until it's left. Returns the used cycles, and sets the number of executed instructions
+int CPU::exec_bulk_loop(const DecodedInstr& first, int32_t cycles_left, int& instructions) {
+    const BulkLoop& loop = bulk_loops.find(PC)->second;
+    const int n_ops = int(loop.ops.size());
+
+    // Iterations whose last instruction starts before the end of the time slice and the next device event
+    int32_t period = first.group_cycles;
+    int32_t budget = std::min(cycles_left - 1, int32_t(events.max_tick())) - first.group_lead_cycles();
+    int32_t max_iterations = budget / period + 1;
+
+    // 1. Simulate the iterations that don't leave the loop (the last one is always run normally).
+    // r contains the registers during the simulation, and committed at the start of the next iteration
+    std::array<word,16> r, committed;
+    for (int i = 0; i < 16; i++) r[i] = regs[byte(i)];
+    committed = r;
+    // Address accessed by each operation in the first and the second iteration
+    std::array<word,MAX_LOOP_SZ> first_addr{}, second_addr{};
+
+    auto set_flags = [this](LazyFlags op, word A, word B, word result) {
+        lazy_op = op;
+        lazy_A = A;
+        lazy_B = B;
+        lazy_result = result;
+    };
+
+    int32_t iterations = 0;
+    while (iterations < max_iterations - 1) {
+        bool leaves = false;
+        for (int i = 0; i < n_ops && !leaves; i++) {
+            const Op& op = loop.ops[i];
+            switch (op.kind) {
+            case Op::STEP: {
+                word A = r[op.rD];
+                if (op.funct == 0b100) set_flags(LazyFlags::ADD, A, op.imm, r[op.rD] = A + op.imm);
+                else set_flags(LazyFlags::SUB, A, op.imm, r[op.rD] = A - op.imm);
+                break;
+            }
+            case Op::TEST: {
+                word A = r[op.rA];
+                word B = op.has_value ? op.value : r[op.rB];
+                if (op.funct == 0b101) set_flags(LazyFlags::SUB, A, B, A - B);
+                else set_flags(LazyFlags::LOGIC, A, B, A & B);
+                break;
+            }
+            case Op::LOAD:
+            case Op::STORE: {
+                word address = r[op.rA] + r[op.rB] + op.imm;
+                // MMIO is only accessed by the instructions
+                if (address >= 0xFF00) {
+                    leaves = true;
+                    break;
+                }
+                if (iterations == 0) first_addr[i] = address;
+                else if (iterations == 1) second_addr[i] = address;
+                if (op.kind == Op::LOAD && op.rD != 0) r[op.rD] = ram.read(address);
+                break;
+            }
+            case Op::EXIT:
+                leaves = is_condition_met(op.funct);
+                break;
+            default:
+                leaves = !is_condition_met(op.funct);
+                break;
+            }
+        }
+        if (leaves) break;
+        committed = r;
+        iterations++;
+    }
+
+    // 2. Check that the simulated iterations only read words that they don't write, and that their stores
+    // don't overlap (so they can be done in any order)
+    struct Range { int32_t start, stride, low, high; };
+    std::array<Range,MAX_LOOP_SZ> ranges;
+    for (int i = 0; i < n_ops && iterations > 0; i++) {
+        const Op& op = loop.ops[i];
+        if (op.kind != Op::LOAD && op.kind != Op::STORE) continue;
+        Range& range = ranges[i];
+        range.start = first_addr[i];
+        range.stride = (iterations > 1) ? int16_t(second_addr[i] - first_addr[i]) : 0;
+        int32_t end = range.start + (iterations-1) * range.stride;
+        range.low = std::min(range.start, end);
+        range.high = std::max(range.start, end);
+        // The addresses can't wrap around
+        if (range.low < 0 || range.high >= 0xFF00) iterations = 0;
+    }
+    for (int i = 0; i < n_ops && iterations > 0; i++) {
+        if (loop.ops[i].kind != Op::STORE) continue;
+        for (int j = 0; j < n_ops; j++) {
+            if (j == i || (loop.ops[j].kind != Op::LOAD && loop.ops[j].kind != Op::STORE)) continue;
+            if (ranges[i].low <= ranges[j].high && ranges[j].low <= ranges[i].high) iterations = 0;
+        }
+    }
+
+    // 3. Run the stores of the simulated iterations, and set the registers to their values at the end
+    if (iterations > 0) {
+        word count = word(iterations);
+        for (int i = 0; i < n_ops; i++) {
+            const Op& op = loop.ops[i];
+            if (op.kind != Op::STORE) continue;
+            const Range& dst = ranges[i];
+
+            // Operation that loads the stored data (if it isn't the same on every iteration)
+            int source = -1;
+            for (int j = 0; j < i && !op.has_value && op.rD != 0; j++) {
+                if (loop.ops[j].kind == Op::LOAD && loop.ops[j].rD == op.rD) source = j;
+            }
+
+            if (source < 0) {
+                word value = op.has_value ? op.value : word(regs[op.rD]);
+                if (dst.stride == 1 || dst.stride == -1) ram.fill(word(dst.low), value, count);
+                else for (int32_t k = 0; k < iterations; k++) ram.write(word(dst.start + k*dst.stride), value);
+            }
+            else {
+                const Range& src = ranges[source];
+                if (dst.stride == src.stride && (dst.stride == 1 || dst.stride == -1)) ram.copy(word(dst.low), word(src.low), count);
+                else for (int32_t k = 0; k < iterations; k++) {
+                    ram.write(word(dst.start + k*dst.stride), ram.read(word(src.start + k*src.stride)));
+                }
+            }
+        }
+        for (int i = 1; i < 16; i++) regs.write(byte(i), committed[i]);
+    }
+
+    // 4. Run the next iteration normally
+    instructions = iterations * first.group_size;
+    return iterations * period + exec_loop_iteration(first, instructions);
+}
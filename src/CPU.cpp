@@ -1,642 +1,558 @@
-#include "CPU.h"
-#include "Exceptions/EmulatorException.h"
-#include "Exceptions/IllegalOpcodeException.h"
+#include "CpuCore.h"
+#include "Breakpoints.h"
+#include "ControlChannel.h"
+#include "DecodeTable.h"
+#include "Aot/Aot.h"
+#include "Jit/Jit.h"
 #include "Utilities/Assert.h"
 #include "Utilities/ExitHelper.h"
-#include <algorithm>
-
-
-// Returns the argument pointed by the PC
-word CPU::fetch_argument() {
-    return user_mode ? ram[PC] : rom_l[PC];
-}
-
-// Push some data into the stack
-void CPU::push(word data) {
-    *SP = *SP - 1; // No -= operator
-    if (*SP == 0xFFFF) throw EmulatorException("SP overflowed");
-    ram[*SP] = data;
-}
-
-// Pop some data from the stack
-word CPU::pop() {
-    word data = ram[*SP];
-    *SP = *SP + 1; // No += operator
-    if (*SP == 0x0000) throw EmulatorException("SP overflowed");
-    return data;
-}
-
-// Equivalent to ++PC, but if PC overflows an exception is thrown
-word CPU::PC_plus_1() {
-    PC++;
-    if (PC == 0x0000) throw EmulatorException("PC overflowed");
-    return PC;
-}
-
-
-// Returns the result of an ALU operation, given the funct bits and the 2 operands
-word CPU::ALU_result(byte funct, word A, word B) {
-    if (funct == 0b000) return B;  // mov
-
-    word result;
-    // true_result is used to detect overflow. Undefined in logical operations
-    uint32_t true_result = -1;
-
-    switch (funct) {
-    case 0b001: result = A&B; break; // and
-    case 0b010: result = A|B; break; // or
-    case 0b011: result = A^B; break; // xor
-    case 0b100: // add
-        result = A+B;
-        true_result = uint32_t(A) + uint32_t(B);
-        break;
-    case 0b101: // sub
-        result = A-B;
-        true_result = uint32_t(A) - uint32_t(B);
-        B = ~B; // Invert second operand for overflow computation
-        break;
-    case 0b110: // addc
-        result = A+B + word(Flags.C);
-        true_result = uint32_t(A) + uint32_t(B) + uint32_t(Flags.C);
-        break;
-    case 0b111: // subb
-        result = A-B - word(Flags.C);
-        true_result = uint32_t(A) - uint32_t(B) - uint32_t(Flags.C);
-        B = ~B; // Invert second operand for overflow computation
-        break;
-    default:
-        throw EmulatorException("Unreachable ALU funct!");
-    }
-
-    // Set flags
-    Flags.Z = (result == 0x0000);
-    Flags.C = bool(true_result & 0x10000);
-    Flags.V = ((A&MSB) == (B&MSB)) && ((A&MSB) != (result&MSB));
-    Flags.S = bool(result&MSB);
-    // No need to invert carry on sub, in case of borrow the upper bits of true_result are 0xFFFF
 
-    return result;
-}
 
 // Returns true if the jump condition is met and the jump has to be performed
 bool CPU::is_condition_met(byte cond) const {
     switch (cond) {
-    case 0b0000: // jmp
-        return true;
-
-    case 0b0001: // jz / je
-        return Flags.Z;
-    case 0b0010: // jnz / jne
-        return !Flags.Z;
-
-    case 0b0011: // jc / jb / jnae
-        return Flags.C;
-    case 0b0100: // jnc / jnb / jae
-        return !Flags.C;
-
-    case 0b0101: // jo
-        return Flags.V;
-    case 0b0110: // jno
-        return !Flags.V;
-
-    case 0b0111: // js
-        return Flags.S;
-    case 0b1000: // jns
-        return !Flags.S;
-
-    case 0b1001: // jbe / jna
-        return Flags.C || Flags.Z;
-    case 0b1010: // ja / jnbe
-        return !(Flags.C || Flags.Z);
-
-    case 0b1011: // jl / jnge
-        return Flags.V != Flags.S;
-    case 0b1100: // jle / jng
-        return (Flags.V != Flags.S) || Flags.Z;
-
-    case 0b1101: // jg / jnle
-        return (Flags.V == Flags.S) && !Flags.Z;
-    case 0b1110: // jge / jnl
-        return Flags.V == Flags.S;
-    
-    default:
-        throw EmulatorException("Invalid jump condition: " + std::to_string(cond));
+    case 0b0000: return is_condition_met<0b0000>(); // jmp
+    case 0b0001: return is_condition_met<0b0001>(); // jz / je
+    case 0b0010: return is_condition_met<0b0010>(); // jnz / jne
+    case 0b0011: return is_condition_met<0b0011>(); // jc / jb / jnae
+    case 0b0100: return is_condition_met<0b0100>(); // jnc / jnb / jae
+    case 0b0101: return is_condition_met<0b0101>(); // jo
+    case 0b0110: return is_condition_met<0b0110>(); // jno
+    case 0b0111: return is_condition_met<0b0111>(); // js
+    case 0b1000: return is_condition_met<0b1000>(); // jns
+    case 0b1001: return is_condition_met<0b1001>(); // jbe / jna
+    case 0b1010: return is_condition_met<0b1010>(); // ja / jnbe
+    case 0b1011: return is_condition_met<0b1011>(); // jl / jnge
+    case 0b1100: return is_condition_met<0b1100>(); // jle / jng
+    case 0b1101: return is_condition_met<0b1101>(); // jg / jnle
+    case 0b1110: return is_condition_met<0b1110>(); // jge / jnl
     }
     
-    // Unreachable
-    assert(false);
+    // Unreachable (invalid conditions are decoded as exec_JMP, which records a trap)
+    debug_assert(false);
+    return false;
 }
 
-// Returns true if the OS is ready to be interrupted (handlers have been initialized)
-bool CPU::is_OS_ready() const {
-    // 1. We suppose that all the critical work is done on the first instructions
-    // 2. This extra protection layer isn't present in the real CPU. If strict_flg is set, return true
-    return Globals::strict_flg || (PC >= Globals::OS_critical_instr);
+// Returns the value of the flags (without modifying the CPU state)
+StatusFlags CPU::get_flags() const {
+    StatusFlags flags = Flags;
+    flags.Z = flag_Z();
+    flags.C = flag_C();
+    flags.V = flag_V();
+    flags.S = flag_S();
+    return flags;
 }
 
-bool CPU::is_breakpoint(const std::vector<word>& breakpoints) const {
-    // Return true if PC is in the breakpoints vector
-    return std::find(breakpoints.begin(), breakpoints.end(), PC) != breakpoints.end();
+// Returns the kinds of the breakpoints (Breakpoints::Kind) that have been reached at the current PC
+byte CPU::check_breakpoints() {
+    // Most addresses don't have any breakpoint
+    if (Globals::breakpoints.flags(PC, user_mode) == 0) return 0;
+    return check_conditional_breakpoints();
 }
 
+// Evaluate the conditions and hit counts of the breakpoints set at the current PC
+byte CPU::check_conditional_breakpoints() {
+    byte reached = 0;
+    for (Breakpoints::Entry& entry : Globals::breakpoints.entries(PC)) {
+        if (!(user_mode ? entry.ram : entry.rom)) continue;
+
+        bool met = true;
+        for (const Breakpoints::Condition& cond : entry.conditions) {
+            word value;
+            switch (cond.type) {
+            case Breakpoints::Condition::REG: value = regs[byte(cond.index)]; break;
+            case Breakpoints::Condition::MEM: value = ram.read(cond.index); break;
+            default: {
+                // Same order as StatusFlags
+                const bool flags[] = {flag_Z(), flag_C(), flag_V(), flag_S()};
+                value = flags[cond.index];
+                break;
+            }
+            }
+            if (!Breakpoints::compare(cond.compare, value, cond.value)) met = false;
+        }
+        if (!met) continue;
 
+        entry.hits++;
+        if (entry.hits >= entry.hit_count) reached |= entry.kind;
+    }
+    return reached;
+}
 
-int CPU::exec_INSTR(word opcode) {
+// Returns true if a breakpoint has been reached at the current PC (used before the first instruction)
+bool CPU::is_at_breakpoint() {
+    return check_breakpoints() & Breakpoints::BREAK;
+}
+
+
+
+// Specialized handler of each instruction variant, in the order of DecodedInstr::Op
+#define ALU_REG_HANDLER(f, m) &CPU::op_ALU_reg<f,m>,
+#define ALU_M_OP_HANDLER(f, m) &CPU::op_ALU_m_op<f,m>,
+#define ALU_M_DEST_HANDLER(f, m) &CPU::op_ALU_m_dest<f,m>,
+#define ALU_MEM_IMM_HANDLER(f, m) &CPU::op_ALU_mem_imm<f,m>,
+#define JMP_HANDLER(c, m) &CPU::op_JMP<c,m>,
+
+const CPU::Handler CPU::op_handlers[DecodedInstr::OP_COUNT] = {
+    EACH_FUNCT_IMM(ALU_REG_HANDLER)
+    EACH_FUNCT_MODE(ALU_M_OP_HANDLER)
+    EACH_FUNCT_MODE(ALU_M_DEST_HANDLER)
+    EACH_FUNCT_MODE(ALU_MEM_IMM_HANDLER)
+    &CPU::op_SHFT<0b01>, &CPU::op_SHFT<0b10>, &CPU::op_SHFT<0b11>,
+    &CPU::exec_MOVB, &CPU::exec_SWAP, &CPU::exec_PEEK_L, &CPU::exec_PEEK_H,
+    &CPU::exec_PUSH_reg, &CPU::exec_PUSH_imm, &CPU::exec_PUSHF, &CPU::exec_POP, &CPU::exec_POPF,
+    EACH_COND_IMM(JMP_HANDLER)
+    &CPU::exec_JMP, &CPU::exec_JMP, // Invalid jump condition
+    &CPU::exec_CALL, &CPU::exec_SYSCALL, &CPU::exec_ENTER, &CPU::exec_RET, &CPU::exec_SYSRET, &CPU::exec_EXIT,
+    &CPU::exec_INVALID_SP, &CPU::exec_ILLEGAL,
+};
+
+const std::array<byte,DecodedInstr::OP_COUNT> DecodedInstr::op_cycles = make_op_cycles();
+
+// Decode an instruction, given its opcode and argument (see DecodeTable.h)
+void CPU::decode_INSTR(DecodedInstr& instr, word opcode, word argument) const {
+    const OpcodeInfo& info = DECODE_TABLE[opcode];
+    instr.op = info.op;
+    instr.argument = argument;
+    instr.funct = info.funct;
+    instr.mode = info.mode;
+    instr.rD = info.rD;
+    instr.rA = info.rA;
+    instr.rB = info.rB_is_rA ? info.rA : get_bits<3,0>(argument);
+    instr.group = DecodedInstr::NO_GROUP;
+    instr.group_size = 1;
+}
 
-    int used_cycles;
+
+
+// Execute a decoded instruction. Returns the used cycles
+int CPU::exec_INSTR(const DecodedInstr& instr) {
     increment_PC = true;
 
-    // Decode instruction
-    switch (get_bits<15,13>(opcode)) {
-    case 0b000:
-        // ALU or shift operation
-        if (get_bit<12>(opcode) == 0) {
-            // 0000... -> ALU op
-            used_cycles = exec_ALU_reg(opcode);
-        }
-        else {
-            // 0001... -> sll
-            used_cycles = exec_SHFT(opcode);
-        }
-        break;
-
-    case 0b001:
-        // Shift operation
-        used_cycles = exec_SHFT(opcode);
-        break;
-
-    case 0b010:
-        // ALU operation (operand in memory)
-        used_cycles = exec_ALU_m_op(opcode);
-        break;
-
-    case 0b011:
-        // ALU operation (destination in memory)
-        used_cycles = exec_ALU_m_dest(opcode);
-        break;
-
-    case 0b100:
-        // ALU operation (destination in memory, immediate operand)
-        used_cycles = exec_ALU_mem_imm(opcode);
-        break;
-    
-    case 0b101:
-        // Memory operation
-        used_cycles = exec_MEM(opcode);
-        break;
-
-    case 0b110:
-        // Jump
-        used_cycles = exec_JMP(opcode);
-        break;
-
-    case 0b111:
-        // Call/ret opcode
-        used_cycles = exec_CALL(opcode);
-        break;
-    
-    default:
-        throw EmulatorException("Unreachable opcode: " + std::to_string(opcode));
-    }
+    (this->*op_handlers[instr.op])(instr);
 
     // Increment PC at the end of instruction
     if (increment_PC) PC_plus_1();
 
-    return used_cycles;
+    return instr.cycles();
 }
 
-// Execute an ALU operation (operands in registers). Returns the used cycles
-int CPU::exec_ALU_reg(word opcode) {
-    bool immediate_mode = get_bit<11>(opcode);
-    byte funct = get_bits<10,8>(opcode);
-    byte rD = get_bits<7,4>(opcode);
-    byte rA = get_bits<3,0>(opcode);
+// movb
+void CPU::exec_MOVB(const DecodedInstr&) {
+    set_trap(Trap::MOVB);
+}
 
-    bool is_mov = (funct == 0b000);
+// swap
+void CPU::exec_SWAP(const DecodedInstr& instr) {
+    word address = regs[instr.rA] + instr.argument;
+    word temp = regs[instr.rD];
+    regs.write(instr.rD, ram.read(address));
+    ram.write(address, temp);
+}
 
-    word argument = fetch_argument();
+// peek (LSB/argument)
+void CPU::exec_PEEK_L(const DecodedInstr& instr) {
+    regs.write(instr.rD, rom.low(regs[instr.rA] + instr.argument));
+}
 
-    if (immediate_mode)
-        regs[rD] = ALU_result(funct, regs[rA], argument);
-    else {
-        byte rB = get_bits<3,0>(argument);
-        // mov register to register uses rA instead of rB
-        if (is_mov) rB = rA;
+// peek (MSB/opcode)
+void CPU::exec_PEEK_H(const DecodedInstr& instr) {
+    regs.write(instr.rD, rom.high(regs[instr.rA] + instr.argument));
+}
 
-        regs[rD] = ALU_result(funct, regs[rA], regs[rB]);
-    }
+// push (reg)
+void CPU::exec_PUSH_reg(const DecodedInstr& instr) {
+    push(regs[instr.rB]);
+}
 
-    return is_mov ? 2 : 3;
+// push (imm)
+void CPU::exec_PUSH_imm(const DecodedInstr& instr) {
+    push(instr.argument);
 }
 
-// Execute an ALU operation (operand in memory). Returns the used cycles
-int CPU::exec_ALU_m_op(word opcode) {
-    byte addr_mode = get_bits<12,11>(opcode);
-    byte funct = get_bits<10,8>(opcode);
-    byte rD = get_bits<7,4>(opcode);
-    byte rA = get_bits<3,0>(opcode);
+// pushf
+void CPU::exec_PUSHF(const DecodedInstr&) {
+    materialize_flags();
+    push(FLG);
+}
 
-    word argument = fetch_argument();
-    int cycles = 4;
+// pop
+void CPU::exec_POP(const DecodedInstr& instr) {
+    regs.write(instr.rD, pop());
+}
 
-    if (addr_mode == 0b00) {
-        // Direct addressing: OP rD, rA, [imm]
-        regs[rD] = ALU_result(funct, regs[rA], ram[argument]);
-    }
-    else if (addr_mode == 0b01) {
-        // Indirect addressing: OP rD, rA, [rB]
-        byte rB = get_bits<3,0>(argument);
-        regs[rD] = ALU_result(funct, regs[rA], ram[regs[rB]]);
-    }
-    else if (addr_mode == 0b10) {
-        // Indexed addressing: OP rD, [rA+imm]
-        word address = regs[rA] + argument;
-        regs[rD] = ALU_result(funct, regs[rD], ram[address]);
-        cycles = 5;
-    }
-    else /* addr_mode == 0b11 */ {
-        // Indexed addressing: OP rD, [rA+rB]
-        byte rB = get_bits<3,0>(argument);
-        word address = regs[rA] + regs[rB];
-        regs[rD] = ALU_result(funct, regs[rD], ram[address]);
-        cycles = 5;
-    }
-    if (funct == 0b000) cycles = 3; // mov always takes 3 cycles
+// popf
+void CPU::exec_POPF(const DecodedInstr&) {
+    FLG = byte(pop());
+    lazy_op = LazyFlags::NONE;
+    if (trap != Trap::NONE) return;
+    if ((FLG & 0xF0) != 0) set_trap(Trap::INVALID_FLAGS); // Top bits should be 0
+}
 
-    return cycles;
+// Jump with an invalid condition (valid jumps use op_JMP)
+void CPU::exec_JMP(const DecodedInstr&) {
+    set_trap(Trap::INVALID_JUMP_CONDITION);
 }
 
-// Execute an ALU operation (destination in memory). Returns the used cycles
-int CPU::exec_ALU_m_dest(word opcode) {
-    byte addr_mode = get_bits<12,11>(opcode);
-    byte funct = get_bits<10,8>(opcode);
-    byte rA = get_bits<3,0>(opcode);
+// Returns the destination of a call/syscall/enter operation
+word CPU::call_destination(const DecodedInstr& instr) {
+    // do not increment the PC after executing this instruction
+    increment_PC = false;
 
-    word argument = fetch_argument();
-    int cycles = 4;
+    if (instr.mode == 0) return regs[instr.rB]; // REG variant
+    else return instr.argument; // IMM variant
+}
 
-    if (addr_mode == 0b00) {
-        // Direct addressing: OP [imm], rA
-        ram[argument] = ALU_result(funct, ram[argument], regs[rA]);
-    }
-    else if (addr_mode == 0b01) {
-        // Indirect addressing: OP [rA], rB
-        byte rB = get_bits<3,0>(argument);
-        ram[regs[rA]] = ALU_result(funct, ram[regs[rA]], regs[rB]);
-    }
-    else if (addr_mode == 0b10) {
-        // Indexed addressing: OP [rA+imm], rB
-        byte rB = get_bits<7,4>(opcode);
-        word address = regs[rA] + argument;
-        ram[address] = ALU_result(funct, ram[address], regs[rB]);
-        cycles = 5;
-    }
-    else /* addr_mode == 0b11 */ {
-        // Indexed addressing: OP [rA+rC], rB
-        byte rB = get_bits<7,4>(opcode);
-        byte rC = get_bits<3,0>(argument);
-        word address = regs[rA] + regs[rC];
-        ram[address] = ALU_result(funct, ram[address], regs[rB]);
-        cycles = 5;
-    }
-    if (funct == 0b000) cycles--; // mov takes 3 cycles (4 cycles in indexed mode)
+// call
+void CPU::exec_CALL(const DecodedInstr& instr) {
+    word destination = call_destination(instr);
+    word return_address = PC_plus_1();
+    if (trap != Trap::NONE) return;
+    push(return_address);
+    PC = destination;
+}
 
-    return cycles;
+// syscall
+void CPU::exec_SYSCALL(const DecodedInstr& instr) {
+    word destination = call_destination(instr);
+    word return_address = PC_plus_1();
+    if (trap != Trap::NONE) return;
+    push(return_address);
+    PC = destination;
+    user_mode = false;
 }
 
-// Execute an ALU operation (destination in memory). Returns the used cycles
-int CPU::exec_ALU_mem_imm(word opcode) {
-    byte addr_mode = get_bits<12,11>(opcode);
-    byte funct = get_bits<10,8>(opcode);
-    word imm4 = get_bits<7,4>(opcode);
-    byte rA = get_bits<3,0>(opcode);
+// enter
+void CPU::exec_ENTER(const DecodedInstr& instr) {
+    word destination = call_destination(instr);
+    word return_address = PC_plus_1();
+    if (trap != Trap::NONE) return;
+    push(return_address);
+    PC = destination;
+    user_mode = true;
+}
+
+// ret
+void CPU::exec_RET(const DecodedInstr&) {
+    increment_PC = false;
+    PC = pop();
+}
 
-    word argument = fetch_argument();
-    int cycles = 4;
+// sysret
+void CPU::exec_SYSRET(const DecodedInstr&) {
+    increment_PC = false;
+    PC = pop();
+    user_mode = true;
+}
 
-    if (addr_mode == 0b00) {
-        // Direct addressing: OP [Addr16], imm4
-        ram[argument] = ALU_result(funct, ram[argument], imm4);
-        cycles = 5; // Direct addressing is implemented as indexed
-    }
-    else if (addr_mode == 0b01) {
-        // Indirect addressing: OP [rA], Imm16
-        ram[regs[rA]] = ALU_result(funct, ram[regs[rA]], argument);
-    }
-    else if (addr_mode == 0b10) {
-        // Indexed addressing: OP [rA+imm], imm4
-        word address = regs[rA] + argument;
-        ram[address] = ALU_result(funct, ram[address], imm4);
-        cycles = 5;
-    }
-    else /* addr_mode == 0b11 */ {
-        // Indexed addressing: OP [rA+rC], imm4
-        byte rC = get_bits<3,0>(argument);
-        word address = regs[rA] + regs[rC];
-        ram[address] = ALU_result(funct, ram[address], imm4);
-        cycles = 5;
-    }
-    if (funct == 0b000) cycles--; // mov takes 3 cycles (4 cycles in indexed mode)
-
-    return cycles;
-}
-
-// Execute a bit shift. Returns the used cycles
-int CPU::exec_SHFT(word opcode) {
-    byte op = get_bits<13,12>(opcode);
-    byte shamt = get_bits<11,8>(opcode);
-    byte rD = get_bits<7,4>(opcode);
-    byte rA = get_bits<3,0>(opcode);
-    word result;
-
-    switch (op) {
-    case 0b01: // sll
-        result = regs[rA];
-        for (byte i = 0; i < shamt; i++)
-            result = ALU_result(0b100, result, result);
-        break;
-
-    case 0b10: // srl
-        result = uint16_t(regs[rA]) >> shamt;
-        Flags.Z = (result == 0);
-        Flags.S = bool(result&MSB);
-        // V and C are undefined
-        break;
-
-    case 0b11: // sra
-        result = int16_t(regs[rA]) >> shamt;
-        Flags.Z = (result == 0);
-        Flags.S = bool(result&MSB);
-        // V and C are undefined
-        break;
-    
-    default:
-        throw EmulatorException("Unreachable shift op: " + std::to_string(op));
-    }
-    
-    regs[rD] = result;
+// exit
+void CPU::exec_EXIT(const DecodedInstr&) {
+    increment_PC = false;
+    PC = pop();
+    user_mode = false;
+}
 
-    return shamt+1;
+// Stack operation that doesn't encode sp in rA
+void CPU::exec_INVALID_SP(const DecodedInstr&) {
+    set_trap(Trap::INVALID_STACK_OPERATION);
 }
 
-// Execute a memory operation. Returns the used cycles
-int CPU::exec_MEM(word opcode) {
-    byte rD = get_bits<7,4>(opcode);
-    byte rA = get_bits<3,0>(opcode);
-    word argument = fetch_argument();
+// Illegal opcode
+void CPU::exec_ILLEGAL(const DecodedInstr&) {
+    set_trap(Trap::ILLEGAL_OPCODE);
+}
 
-    switch (get_bits<12,8>(opcode)) {
-    case 0b00000: { // movb
-        throw EmulatorException("MOVB is deprecated and cannot be used");
-    }
-    case 0b00001: { // swap
-        word address = regs[rA] + argument;
-        word temp = regs[rD];
-        regs[rD] = ram[address];
-        ram[address] = temp;
-        return 5;
-    }
-    case 0b00010: // peek (LSB/argument)
-        regs[rD] = rom_l[regs[rA] + argument];
-        return 3;
-    case 0b00011: // peek (MSB/opcode)
-        regs[rD] = rom_h[regs[rA] + argument];
-        return 3;
-
-    case 0b00100: { // push (reg)
-        assert(rA == 0b0001);
-        byte rB = get_bits<3,0>(argument);
-        push(regs[rB]);
-        return 3;
-    }
-    case 0b00101: // push (imm)
-        assert(rA == 0b0001);
-        push(argument);
-        return 3;
-    case 0b00110: // pushf
-        assert(rA == 0b0001);
-        push(FLG);
-        return 3;
-        
-    case 0b00111: // pop
-        assert(rA == 0b0001);
-        regs[rD] = pop();
-        return 3;
-    case 0b01000: // popf
-        assert(rA == 0b0001);
-        FLG = byte(pop());
-        assert((FLG & 0xF0) == 0); // Top bits should be 0
-        return 3;
-    
-    default:
-        throw IllegalOpcodeException();
-    }
 
-    // Unreachable
-    assert(false);
-    return 0;
+
+
+CPU::CPU() {
+    // Memory-mapped IO devices. Each one uses a single address, and the rest of its 64-word block is unmapped
+    ram.map_device(0xFF00, 1, keyboard);
+    ram.map_device(0xFF40, 1, display);
+    ram.map_device(0xFF80, 1, timer);
+    ram.map_device(0xFFC0, 1, disk);
+}
+CPU::~CPU() = default;
+
+// Reset CPU
+void CPU::reset() {
+    PC = 0x0000;
+    user_mode = false;
+    IRQ = false;
+    timer.reset();
+    events.reset();
+    cycle_count = 0;
+    sync_cycles();
 }
 
-// Execute a jump. Returns the used cycles
-int CPU::exec_JMP(word opcode) {
-    // Get encoded jump condition and check if it is true
-    if (byte cond = get_bits<11,8>(opcode); !is_condition_met(cond))
-        return 2; // Jump is not taken
+// Jump to the interrupt vector (0x0011 if in RAM, 0x0013 if in ROM). Returns the used cycles
+int CPU::exec_IRQ() {
+    push(PC);
+    if (trap != Trap::NONE) ExitHelper::error("Error while processing interrupt:\n%s\n", trap_description(PC, user_mode).c_str());
 
-    // Jump is taken
-    if (get_bit<12>(opcode) == 0) {
-        // Jump to address in register
-        byte rA = get_bits<3,0>(opcode);
-        PC = regs[rA];
+    // The cycles and results of a tracked call would include the handler: the next call is tracked instead
+    hook_call.active = false;
+
+    PC = user_mode ? 0x0011 : 0x0013;
+    user_mode = false;  // Jump to ROM
+    IRQ = false;
+    return 3; // Takes 3 clock cycles in both cases
+}
+
+// Exit the emulator after the instruction at old_PC (in RAM if user is true) has failed
+void CPU::report_error(word old_PC, bool user, const char *message) {
+    if (user) {
+        ExitHelper::error(
+            "Error at PC = 0x%04X [RAM] (OP = 0x%04X, ARG = 0x%04X):\n%s\n",
+            old_PC, uint(ram.read(old_PC)), uint(ram.read(old_PC+1)), message
+        );
     }
     else {
-        // Jump to immediate address
-        PC = fetch_argument();
+        ExitHelper::error(
+            "Error at PC = 0x%04X [ROM] (OP = 0x%04X, ARG = 0x%04X):\n%s\n",
+            old_PC, uint(rom.high(old_PC)), uint(rom.low(old_PC)), message
+        );
     }
-    // do not increment the PC after executing this instruction
-    increment_PC = false;
-    
-    return 2;
 }
 
-// Execute a call/ret operation. Returns the used cycles
-int CPU::exec_CALL(word opcode) {
-    word argument = fetch_argument();
-    byte rB = get_bits<3,0>(argument);
+// Exit the emulator after the instruction at old_PC has caused a trap
+void CPU::report_trap(word old_PC, bool user) {
+    report_error(old_PC, user, trap_description(old_PC, user).c_str());
+}
+
+// Error message of the recorded trap, caused by the instruction at old_PC
+std::string CPU::trap_description(word old_PC, bool user) {
+    std::string message = trap_message(trap);
+    if (trap == Trap::INVALID_JUMP_CONDITION) {
+        word opcode = user ? ram.read(old_PC) : rom.high(old_PC);
+        message += std::to_string(get_bits<11,8>(opcode));
+    }
+    else if (trap == Trap::DEVICE_ERROR) message += ram.get_device_error();
+    return message;
+}
+
+// Update the timer and the metrics after an instruction or interrupt (or a block of instructions) has been executed.
+// Returns true if the execution has to be paused (a breakpoint has been reached)
+bool CPU::end_instruction(int used_cycles, int instructions) {
+    if (events.advance(used_cycles)) run_events();
 
-    word destination;
-    if (get_bit<8>(opcode) == 0) destination = regs[rB]; // REG variant
-    else destination = argument; // IMM variant
+    // Add CPI info
+    cpi_stats.add(used_cycles, instructions);
+    
+    // Increment the cycle count (published at the end of the time slice)
+    cycle_count += used_cycles;
 
-    // do not increment the PC after executing this instruction
-    increment_PC = false;
+    // A hooked routine that is run normally in order to measure or validate it (see Hooks.cpp)
+    if (hook_call.active) track_hook_call();
+    
+    byte reached = check_breakpoints();
 
-    int cycles = 4;
+    // Check if we landed on an exit point
+    if (reached & Breakpoints::EXIT) {
+        if (Globals::dump_file) dump_state();
 
-    switch (get_bits<12,9>(opcode)) {
-    case 0b0000: // call
-        assert((get_bits<3,0>(opcode)) == 0b0001);
-        push(PC_plus_1());
-        PC = destination;
-        break;
+        // The exit code is the value stored in a0
+        int exit_code = regs.ABI_A0();
         
-    case 0b0001: // syscall
-        assert((get_bits<3,0>(opcode)) == 0b0001);
-        push(PC_plus_1());
-        PC = destination;
-        user_mode = false;
-        break;
-
-    case 0b0010: // enter
-        assert((get_bits<3,0>(opcode)) == 0b0001);
-        push(PC_plus_1());
-        PC = destination;
-        user_mode = true;
-        break;
-
-    case 0b0011:
-        if (get_bit<8>(opcode) == 0) {
-            assert((get_bits<3,0>(opcode)) == 0b0001);
-            // 0b00110 -> ret
-            PC = pop();
-            cycles = 3;
-        }
-        else {
-            assert((get_bits<3,0>(opcode)) == 0b0001);
-            // 0b00111 -> sysret
-            PC = pop();
-            user_mode = true;
-            cycles = 3;
-        }
-        break;
-    
-    case 0b0100: // exit
-        if (get_bit<8>(opcode) == 0) {
-            assert((get_bits<3,0>(opcode)) == 0b0001);
-            // 0b01000 -> exit
-            PC = pop();
-            user_mode = false;
-            cycles = 3;
+        if (exit_code > 0xFF) {
+            ExitHelper::exitCode(
+                exit_code & 0xFF,
+                "Warning: the exit code 0x%X is bigger than 255 and will be truncated\n", exit_code
+            );
         }
         else {
-            // 0b01001 -> illegal
-            throw IllegalOpcodeException();
+            ExitHelper::exitCode(exit_code, "");
         }
-        break;
+    }
     
-    default:
-        throw IllegalOpcodeException();
+    // Check if we landed on a breakpoint, or the last instruction of a step
+    bool step_done = steps_left != 0 && --steps_left == 0;
+    if (step_done || (reached & Breakpoints::BREAK)) {
+        steps_left = 0;
+        Globals::control.set_paused(true);
+        return true;
     }
+    return false;
+}
 
-    return cycles;
+// Write the final state of the CPU, so that the results of different runs can be compared
+void CPU::dump_state() {
+    FILE *file = fopen(Globals::dump_file, "w");
+    if (file == nullptr) ExitHelper::error("Error: Dump file [%s] could not be opened\n", Globals::dump_file);
+
+    materialize_flags();
+    fprintf(file, "PC = 0x%04X [%s]\n", PC, user_mode ? "RAM" : "ROM");
+    fprintf(file, "Flags = 0x%X\n", uint(FLG));
+    fprintf(file, "Cycles = %llu\n", (unsigned long long)cycle_count);
+    for (byte i = 0; i < 16; i++) fprintf(file, "%s = 0x%04X\n", Regfile::ABI_names[i].c_str(), uint(regs[i]));
+    // Reading MMIO would access the devices
+    for (uint32_t addr = 0; addr < Ram::MMIO_START; addr += 16) {
+        fprintf(file, "%04X:", addr);
+        for (uint32_t i = 0; i < 16; i++) fprintf(file, " %04X", uint(ram.peek(word(addr+i))));
+        fprintf(file, "\n");
+    }
+    fclose(file);
 }
 
+// Run CPU for a number of clock cycles. Instructions are atomic, the function  
+// returns how many extra cycles were needed to finish the last instruction.
+int32_t CPU::execute(int32_t cycles) {
+    auto start_time = std::chrono::steady_clock::now();
+    uint64_t start_cycles = cycle_count;
+
+    int32_t extra_cycles;
+    switch (Globals::engine) {
+    case Globals::Engine::THREADED: extra_cycles = execute_threaded(cycles); break;
+    case Globals::Engine::JIT: extra_cycles = execute_jit(cycles); break;
+    case Globals::Engine::AOT: extra_cycles = execute_aot(cycles); break;
+    default: extra_cycles = execute_switch(cycles); break;
+    }
 
+    // Measure how fast the host is running the emulated code
+    host_time += std::chrono::steady_clock::now() - start_time;
+    host_cycles += cycle_count - start_cycles;
+    // The count is exact even if the slice has been stopped by a breakpoint
+    sync_cycles();
+    return extra_cycles;
+}
 
+// Run the device events that are due
+void CPU::run_events() {
+    for (auto kind = events.pop_due(); kind != EventQueue::KIND_COUNT; kind = events.pop_due()) {
+        switch (kind) {
+        case EventQueue::TIMER_START:
+        case EventQueue::TIMER_OVERFLOW:
+            if (timer.handle_event(kind)) IRQ = true; // If an overflow occurs, trigger interrupt
+            break;
+        case EventQueue::DISPLAY_READY: display.handle_event(); break;
+        case EventQueue::KEYBOARD_READY: keyboard.handle_event(); break;
+        case EventQueue::DISK_POLL: disk.handle_event(); break;
+        default: break;
+        }
+    }
+}
 
-// Reset CPU
-void CPU::reset() {
-    PC = 0x0000;
-    user_mode = false;
-    IRQ = false;
-    timer.reset();
-    Globals::elapsed_cycles = 0;
+// Publish the cycle counter for the UI. Only called while the CPU isn't running a time slice
+void CPU::sync_cycles() {
+    Globals::elapsed_cycles = cycle_count;
 }
 
-// Run CPU for a number of clock cycles. Instructions are atomic, the function  
-// returns how many extra cycles were needed to finish the last instruction.
-int32_t CPU::execute(int32_t cycles) {
+// Run a number of instructions, then pause again. Groups of instructions aren't run while stepping
+void CPU::step(uint64_t instructions) {
+    steps_left = instructions;
+}
+
+void CPU::reset_cycles() {
+    cycle_count = 0;
+    sync_cycles();
+}
+
+// Execute the instruction pointed by the PC (or jump to the interrupt vector), or a group of instructions
+// if it fits in the cycles left. Returns the used cycles, and sets the number of executed instructions
+template <bool user>
+int CPU::exec_next(int32_t cycles_left, int& instructions) {
+    word old_PC = PC;
+    instructions = 1;
+
+    // CPU INTERRUPT! Jump to interrupt vector
+    if (IRQ && is_OS_ready()) return exec_IRQ();
+
+    // EXECUTE INSTRUCTION NORMALLY
+    // Faults (including the errors of the devices) are recorded as traps and only checked once the
+    // instruction has finished
+    const DecodedInstr& instr = fetch_decoded<user>();
+    if (user) {
+        PC_plus_1();
+        if (trap != Trap::NONE) report_trap(old_PC, user);
+    }
+    if (instr.group != DecodedInstr::NO_GROUP && can_run_group(instr, cycles_left)) {
+        if (instr.group >= DecodedInstr::GROUP_IDLE_LOOP) return exec_long_group(instr, cycles_left, instructions);
+        instructions = instr.group_size;
+        return exec_group(instr);
+    }
+    int used_cycles = exec_INSTR(instr);
+    if (trap != Trap::NONE) report_trap(old_PC, user);
+    return used_cycles;
+}
+
+template int CPU::exec_next<false>(int32_t cycles_left, int& instructions);
+template int CPU::exec_next<true>(int32_t cycles_left, int& instructions);
+
+// Default execution engine: decoded instructions are executed one by one
+int32_t CPU::execute_switch(int32_t cycles) {
 
     while (cycles > 0) {
-        int used_cycles;
-        word old_PC = PC;
-        
-        // CPU INTERRUPT! Jump to interrupt vector (0x0011 if in RAM, 0x0013 if in ROM)
-        if (IRQ && is_OS_ready()) try {
-            push(PC);
-            PC = user_mode ? 0x0011 : 0x0013;
-            user_mode = false;  // Jump to ROM
-            used_cycles = 3;    // Takes 3 clock cycles in both cases
-            IRQ = false;
-            if (timer.tick(used_cycles)) IRQ = true; // If an overflow occurs, trigger interrupt
-        }
-        catch (const EmulatorException& e) {
-            ExitHelper::error("Error while processing interrupt:\n%s\n", e.what());
-        }
+        // Run the loop of the current privilege mode, until the mode changes
+        bool paused = user_mode ? run_switch<true>(cycles) : run_switch<false>(cycles);
+        if (paused) return 0;
+    }
 
-        // EXECUTE INSTRUCTION NORMALLY
-        else try {
-            word opcode = user_mode ? ram[PC] : rom_h[PC];
-            if (user_mode) PC_plus_1();
-            used_cycles = exec_INSTR(opcode);
-            if (timer.tick(used_cycles)) IRQ = true; // If an overflow occurs, trigger interrupt
-        }
-        catch (const EmulatorException& e) {
-            if (user_mode) {
-                ExitHelper::error(
-                    "Error at PC = 0x%04X [RAM] (OP = 0x%04X, ARG = 0x%04X):\n%s\n",
-                    old_PC, uint(ram[old_PC]), uint(ram[old_PC+1]), e.what()
-                );
-            }
-            else {
-                ExitHelper::error(
-                    "Error at PC = 0x%04X [ROM] (OP = 0x%04X, ARG = 0x%04X):\n%s\n",
-                    old_PC, uint(rom_h[old_PC]), uint(rom_l[old_PC]), e.what()
-                );
-            }
-        }
+    // If finishing an instruction took some extra cycles, return how many
+    return -cycles;
+}
+
+// Loop of the default engine, for a given privilege mode. Returns true if the execution has been paused
+template <bool user>
+bool CPU::run_switch(int32_t& cycles_left) {
+    int32_t cycles = cycles_left;
 
-        // Add CPI info
-        cpi_mean.addDataPoint(used_cycles);
+    while (cycles > 0 && user_mode == user) {
+        int instructions;
+        int used_cycles = exec_next<user>(cycles, instructions);
 
         // Decrement the remaining cycles
         cycles -= used_cycles;
         
-        // Increment global count to be displayed
-        Globals::elapsed_cycles = Globals::elapsed_cycles + used_cycles;
-        // (+= is deprecated for volatile variables)
-        
-        // Check if we landed on an exit point
-        if (is_breakpoint(Globals::exitpoints)) {
-            // The exit code is the value stored in a0
-            int exit_code = regs.ABI_A0();
-            
-            if (exit_code > 0xFF) {
-                ExitHelper::exitCode(
-                    exit_code & 0xFF,
-                    "Warning: the exit code 0x%X is bigger than 255 and will be truncated\n", exit_code
-                );
-            }
-            else {
-                ExitHelper::exitCode(exit_code, "");
-            }
-        }
-        
-        // Check if we landed on a breakpoint
-        if (Globals::single_step || is_breakpoint(Globals::breakpoints)) {
-            Globals::is_paused = true;
-            return 0;
+        if (end_instruction(used_cycles, instructions)) {
+            cycles_left = cycles;
+            return true;
         }
     }
+    cycles_left = cycles;
+    return false;
+}
 
-    // If finishing an instruction took some extra cycles, return how many
-    return -cycles;
+// Called by the CPU thread after each time slice (and while paused): get the input and publish the state for the UI
+void CPU::poll_IO() {
+    // If a new key has been pressed, trigger interrupt
+    if (keyboard.update()) IRQ = true;
+
+    Status current;
+    current.PC = PC;
+    current.user_mode = user_mode;
+    current.flags = get_flags();
+    current.regs = regs;
+    // Emulated cycles per microsecond of host time spent executing them
+    if (auto us = std::chrono::duration_cast<std::chrono::microseconds>(host_time).count(); us > 0)
+        current.host_MHz = double(host_cycles) / double(us);
+    status.write(current);
 }
 
-// Called at regular intervals for updating the UI and getting input
-void CPU::update() {
-    // Flush the output stream
+// Called periodically by the I/O thread: output the terminal and update the UI
+void CPU::update_UI() {
     Terminal *terminal = Terminal::get_instance();
-    terminal->display_status(PC, user_mode, Flags, regs, cpi_mean.getCurrentMean());
+    display.flush_output();
+    terminal->update_input();
+    // CPI metrics of the instructions executed since the last update (if there are none, keep the previous ones)
+    CpiStats::Snapshot cpi_now = cpi_stats.snapshot();
+    if (cpi_now.instructions != cpi_last.instructions) {
+        cpi_interval = cpi_now - cpi_last;
+        cpi_last = cpi_now;
+    }
+    const Status& current = status.read();
+    terminal->display_status(current.PC, current.user_mode, current.flags, current.regs, cpi_interval, current.host_MHz);
+    // Flush the output stream
     terminal->flush();
+}
 
-    // If a new key has been pressed, trigger interrupt
-    if (keyboard.update()) IRQ = true;
+// Output the pending chars and commands of the terminal
+void CPU::flush_output() {
+    display.flush_output();
 }
 
 
 // Write a 32-bit word to the upper and lower bits of ROM, at a given address
 void CPU::write_ROM(word address, word data_high, word data_low) {
-    rom_h[address] = data_high;
-    rom_l[address] = data_low;
+    rom.write(address, data_high, data_low);
+    rom_cache.invalidate(address);
 }
@@ -5,44 +5,116 @@
 #include "Keyboard.h"
 #include "Display.h"
 #include "Timer.h"
+#include "EventQueue.h"
 #include "Disk.h"
-#include "ArithmeticMean.h"
+#include "CpiStats.h"
+#include "BulkLoop.h"
+#include "Hooks.h"
+#include "Utilities/TripleBuffer.h"
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Jit;
+class Aot;
 
 // Based on Dave Poo's 6502 emulator
 class CPU {
+    friend class Jit;
+    friend class Aot;
 
 private:
     word PC;                    // Program Counter
     Regfile regs;               // Register file
-    Reg* const SP = &regs[1];   // Direct access to SP
+    word* const SP = &regs.stack_pointer();   // Direct access to SP
 
     // Flags register
     union {
         byte FLG;
         StatusFlags Flags;
     };
+    // Lazy flags: ALU operations only record their operands and result, and the flags are computed
+    // from them when they are read. If lazy_op is NONE, the flags are stored in FLG
+    enum class LazyFlags : byte { NONE, ADD, SUB, LOGIC };
+    LazyFlags lazy_op = LazyFlags::NONE;
+    word lazy_A, lazy_B, lazy_result;
     
 
     bool user_mode; // true if fetching from RAM, false if fetching from ROM
     bool increment_PC; // If set to false by an instruction, the PC won't be postincremented
     bool IRQ;
+    // Fault caused by the current instruction (see Trap.h). Only the first one is recorded
+    Trap trap = Trap::NONE;
+
+    // Call of a hooked routine that is run normally, in order to measure its cycles or to validate
+    // its native code (see Hooks.cpp). It ends when the routine returns, or is dropped on an interrupt
+    struct HookCall {
+        bool active = false;
+        word entry;                 // First address of the routine
+        word call_SP;               // SP at the call (pointing to the return address)
+        word lowest_SP;             // Lowest SP reached by the routine (the stack below it is free again)
+        uint64_t start_cycles;
+        uint64_t start_instructions;
+        // Results of the native code (validation only)
+        word hook_PC;
+        std::array<word,16> hook_regs;
+        std::vector<word> hook_ram;
+    };
+    HookCall hook_call;
+
+    // Cycles of the executed instructions, in order to compute CPI metrics
+    CpiStats cpi_stats;
+    // Last snapshot displayed, and CPI metrics of the instructions executed before it (see update_UI())
+    CpiStats::Snapshot cpi_last;
+    CpiStats::Snapshot cpi_interval;
+    // Cycles executed since the last reset (published in Globals::elapsed_cycles by sync_cycles())
+    uint64_t cycle_count = 0;
+    // Instructions left before pausing again (0 if not stepping)
+    uint64_t steps_left = 0;
+    // Host time spent inside execute() and cycles emulated during that time
+    std::chrono::steady_clock::duration host_time{0};
+    uint64_t host_cycles = 0;
+
+    // State shown by the UI, published by the CPU thread after each time slice (see poll_IO())
+    struct Status {
+        word PC = 0;
+        bool user_mode = false;
+        StatusFlags flags{};
+        Regfile regs;
+        double host_MHz = 0;
+    };
+    TripleBuffer<Status> status;
 
-    // Store how many cycles the last 500 instructions took in order to compute CPI metrics
-    ArithmeticMean<int> cpi_mean = ArithmeticMean<int>(500);
-
+    // Delays of the devices, in emulated cycles
+    EventQueue events;
     // Input terminal
-    Keyboard keyboard;
+    Keyboard keyboard = Keyboard(events);
     // Output terminal
-    Display display;
+    Display display = Display(events);
     // 16-bit timer
-    Timer timer;
+    Timer timer = Timer(events);
     // USB disk
-    Disk disk;
+    Disk disk = Disk(events);
+
+    // Decoded instructions, indexed by address
+    DecodeCache rom_cache;
+    DecodeCache ram_cache;
+    // Used for instructions that can't be cached (overlapping MMIO)
+    DecodedInstr uncached_instr;
+    // Bulk loops found in ROM, indexed by their first address
+    std::unordered_map<word, BulkLoop> bulk_loops;
 
     // Memory banks: ROM (32 bit), RAM (16 bit)
-    Rom rom_l; // Lower 16 bits of ROM
-    Rom rom_h; // Upper 16 bits of ROM
-    Ram ram = Ram(keyboard, display, timer, disk); // 4 IO devices
+    Rom rom;
+    Ram ram = Ram(ram_cache, trap); // IO devices are mapped in the constructor
+
+    // Compiles hot ROM code (only created if the JIT engine is used)
+    std::unique_ptr<Jit> jit;
+    // ROM code compiled ahead of time (only loaded if the AOT engine is used)
+    std::unique_ptr<Aot> aot;
 
 
 
@@ -64,8 +136,11 @@ private:
         return (value >> bit_index) & 1;
     }
     
-    // Returns the argument pointed by the PC
-    inline word fetch_argument();
+    // Returns the decoded instruction pointed by the PC (decodes it if needed). user must be equal to user_mode
+    template <bool user> inline const DecodedInstr& fetch_decoded();
+
+    // Returns true if a group of instructions can be run at once, given the cycles left in the time slice
+    inline bool can_run_group(const DecodedInstr& first, int32_t cycles_left) const;
 
     // Push some data into the stack
     inline void push(word data);
@@ -73,67 +148,207 @@ private:
     // Pop some data from the stack
     inline word pop();
 
-    // Equivalent to ++PC, but if PC overflows an exception is thrown
+    // Equivalent to ++PC, but if PC overflows a trap is recorded
     inline word PC_plus_1();
 
+    // Record a trap, unless the instruction already caused another one
+    inline void set_trap(Trap t);
+
     // Returns the result of an ALU operation, given the funct bits and the 2 operands
-    word ALU_result(byte funct, word A, word B);
+    template <byte funct> inline word ALU_result(word A, word B);
+
+    // Value of each flag (computed from the last ALU operation if needed)
+    inline bool flag_Z() const;
+    inline bool flag_C() const;
+    inline bool flag_V() const;
+    inline bool flag_S() const;
+    StatusFlags get_flags() const;
+    // Store the flags of the last ALU operation in FLG (must be called before accessing FLG/Flags)
+    inline void materialize_flags();
 
     // Returns true if the jump condition is met and the jump has to be performed
     bool is_condition_met(byte cond) const;
+    template <byte cond> inline bool is_condition_met() const;
 
     // Returns true if the OS is ready to be interrupted (handlers have been initialized)
     inline bool is_OS_ready() const;
 
-    // Returns true if a breakpoint (from the provided list) has been set at current PC
-    inline bool is_breakpoint(const std::vector<word>& breakpoints) const;
+    // Returns the kinds of the breakpoints (Breakpoints::Kind) that have been reached at the current PC
+    inline byte check_breakpoints();
+    byte check_conditional_breakpoints();
 
 
 
-    // MAIN INSTRUCTION FUNCTIONS
+    // DECODING
 
-    // Execute a generic instruction. Returns the used cycles
-    int exec_INSTR(word opcode);
+    // Function that executes a decoded instruction
+    using Handler = void (CPU::*)(const DecodedInstr&);
+    // Specialized handler of each instruction variant, indexed by DecodedInstr::op
+    static const Handler op_handlers[DecodedInstr::OP_COUNT];
 
-    // Execute an ALU operation (operands in registers). Returns the used cycles
-    int exec_ALU_reg(word opcode);
+    // Decode an instruction, given its opcode and argument
+    void decode_INSTR(DecodedInstr& instr, word opcode, word argument) const;
 
-    // Execute an ALU operation (operand in memory). Returns the used cycles
-    int exec_ALU_m_op(word opcode);
+    // Superinstructions (Superinstructions.cpp): look for a group that starts with the instruction at the PC
+    void fuse_group(DecodedInstr& first, DecodeCache& cache);
+    bool is_group_valid(const DecodedInstr& first) const;
 
-    // Execute an ALU operation (destination in memory). Returns the used cycles
-    int exec_ALU_m_dest(word opcode);
-    
-    // Execute an ALU operation (destination in memory, immediate operand). Returns the used cycles
-    int exec_ALU_mem_imm(word opcode);
+    // Loops in ROM, run as a group whose members are the body of the loop
+    static const int MAX_LOOP_SZ = 12;
+    static_assert(MAX_LOOP_SZ < 16, "The size of a group is stored in 4 bits");
+    int collect_loop(const DecodedInstr& first, DecodedInstr* members);
+    void mark_loop(DecodedInstr& first, const DecodedInstr* members, int size, DecodedInstr::Group group);
+    // Idle loops (IdleLoops.cpp): polling loops whose identical iterations can be skipped
+    bool find_idle_loop(DecodedInstr& first, const DecodedInstr* members, int size);
+    // Bulk loops (BulkLoops.cpp): loops that copy, fill or compare memory, run at once
+    bool find_bulk_loop(DecodedInstr& first, const DecodedInstr* members, int size);
 
-    // Execute a bit shift. Returns the used cycles
-    int exec_SHFT(word opcode);
 
-    // Execute a memory operation. Returns the used cycles
-    int exec_MEM(word opcode);
+
+    // MAIN INSTRUCTION FUNCTIONS
+
+    // Execute a decoded instruction. Returns the used cycles
+    int exec_INSTR(const DecodedInstr& instr);
+
+    // Execute a whole group of instructions. Returns the used cycles
+    int exec_group(const DecodedInstr& first);
+
+    // Execute a loop group (as many iterations as fit in the cycles left) or a hooked routine.
+    // Returns the used cycles, and sets the number of executed instructions
+    int exec_long_group(const DecodedInstr& first, int32_t cycles_left, int& instructions);
+    int exec_loop_iteration(const DecodedInstr& first, int& instructions);
+    int exec_idle_loop(const DecodedInstr& first, int32_t cycles_left, int& instructions);
+    int exec_bulk_loop(const DecodedInstr& first, int32_t cycles_left, int& instructions);
+
+    // Hooked routines (Hooks.cpp): run the native code that replaces the routine at the PC and return
+    bool can_run_hook(int32_t cycles_left) const;
+    int exec_hook(const DecodedInstr& first, int& instructions);
+    // Cycles of a call to a hook with the current arguments (negative if the call can't be replaced)
+    int64_t hook_cycles(const Hooks::Entry& hook) const;
+    // Run the native code of a hook on the current state, keep its results and undo its changes
+    void run_hook_for_validation(const Hooks::Entry& hook);
+    // Called by end_instruction while hook_call is active: finishes it once the routine has returned
+    void track_hook_call();
+    void validate_hook_call(const Hooks::Entry& hook);
+
+    // Memory operations
+    void exec_MOVB(const DecodedInstr& instr);
+    void exec_SWAP(const DecodedInstr& instr);
+    void exec_PEEK_L(const DecodedInstr& instr);
+    void exec_PEEK_H(const DecodedInstr& instr);
+    void exec_PUSH_reg(const DecodedInstr& instr);
+    void exec_PUSH_imm(const DecodedInstr& instr);
+    void exec_PUSHF(const DecodedInstr& instr);
+    void exec_POP(const DecodedInstr& instr);
+    void exec_POPF(const DecodedInstr& instr);
     
-    // Execute a jump. Returns the used cycles
-    int exec_JMP(word opcode);
+    // Execute a jump (only used for invalid jump conditions, see op_JMP)
+    void exec_JMP(const DecodedInstr& instr);
+
+    // Call/ret operations
+    inline word call_destination(const DecodedInstr& instr);
+    void exec_CALL(const DecodedInstr& instr);
+    void exec_SYSCALL(const DecodedInstr& instr);
+    void exec_ENTER(const DecodedInstr& instr);
+    void exec_RET(const DecodedInstr& instr);
+    void exec_SYSRET(const DecodedInstr& instr);
+    void exec_EXIT(const DecodedInstr& instr);
+
+    // Stack operation that doesn't encode sp in rA: records an INVALID_STACK_OPERATION trap
+    void exec_INVALID_SP(const DecodedInstr& instr);
+
+    // Records an ILLEGAL_OPCODE trap
+    void exec_ILLEGAL(const DecodedInstr& instr);
 
-    // Execute a call/ret operation. Returns the used cycles
-    int exec_CALL(word opcode);
+    // Specialized handlers, defined in CpuCore.h
+    template <byte funct, bool imm> inline void op_ALU_reg(const DecodedInstr& instr);
+    template <byte funct, byte mode> inline void op_ALU_m_op(const DecodedInstr& instr);
+    template <byte funct, byte mode> inline void op_ALU_m_dest(const DecodedInstr& instr);
+    template <byte funct, byte mode> inline void op_ALU_mem_imm(const DecodedInstr& instr);
+    template <byte type> inline void op_SHFT(const DecodedInstr& instr);
+    template <byte cond, bool imm> inline void op_JMP(const DecodedInstr& instr);
+
+
+
+    // EXECUTION ENGINES
+
+    // Jump to the interrupt vector. Returns the used cycles
+    int exec_IRQ();
+
+    // Exit the emulator after the instruction at old_PC (in RAM if user is true) has failed
+    [[noreturn]] void report_error(word old_PC, bool user, const char *message);
+    // Exit the emulator after the instruction at old_PC has caused a trap
+    [[noreturn]] void report_trap(word old_PC, bool user);
+    // Error message of the recorded trap
+    std::string trap_description(word old_PC, bool user);
+
+    // Execute the instruction pointed by the PC (or jump to the interrupt vector), or a group of instructions
+    // if it fits in the cycles left. Returns the used cycles, and sets the number of executed instructions
+    template <bool user> int exec_next(int32_t cycles_left, int& instructions);
+
+    // Update the timer and the metrics after an instruction or interrupt (or a block of instructions)
+    // has been executed. Returns true if the execution has to be paused (a breakpoint has been reached)
+    bool end_instruction(int used_cycles, int instructions = 1);
+    // Write the PC, the flags, the registers, the cycle count and the RAM (except MMIO) to
+    // Globals::dump_file, once an exit point has been reached (-D)
+    void dump_state();
+
+    // Publish the cycle counter for the UI
+    void sync_cycles();
+
+    // Run the device events that are due (the time has been advanced past their deadline)
+    void run_events();
+
+    // Default engine: decoded instructions are executed one by one
+    int32_t execute_switch(int32_t cycles);
+
+    // Threaded engine (ThreadedEngine.cpp): each instruction variant jumps directly to the next one
+    int32_t execute_threaded(int32_t cycles);
+
+    // Loops of each engine, specialized for the privilege mode (user must be equal to user_mode).
+    // They return when the mode changes, the cycles run out or the execution is paused (returns true)
+    template <bool user> bool run_switch(int32_t& cycles_left);
+    template <bool user> bool run_threaded(int32_t& cycles_left);
+
+    // JIT engine (JitEngine.cpp): hot ROM code is compiled into native code
+    int32_t execute_jit(int32_t cycles);
+
+    // AOT engine (AotEngine.cpp): ROM code is run by a shared object generated with compile_ROM
+    int32_t execute_aot(int32_t cycles);
 
 
 public:
     const static word MSB = 0x8000;
     const static word MAX_TIMESTEPS = 16;
 
+    CPU();
+    ~CPU();
+
     // Reset CPU
     void reset();
 
+    // Returns true if a breakpoint has been reached at the current PC (used before the first instruction)
+    bool is_at_breakpoint();
+
+    // Run a number of instructions, then pause again (the CPU is resumed by the caller)
+    void step(uint64_t instructions);
+    // Reset the cycle counter (F7)
+    void reset_cycles();
+
     // Run CPU for a number of clock cycles. Instructions are atomic, the function
     // returns how many extra cycles were needed to finish the last instruction.
     int32_t execute(int32_t cycles);
 
-    // Called at regular intervals for updating the UI and getting input
-    void update();
+    // Called by the CPU thread after each time slice (and while paused): get the input and publish the state for the UI
+    void poll_IO();
+    // Called periodically by the I/O thread: output the terminal and update the UI
+    void update_UI();
+    // Output the pending chars and commands of the terminal (called by the I/O thread, or while exiting)
+    void flush_output();
 
     // Write a 32-bit word in ROM, at a given address
     void write_ROM(word address, word data_high, word data_low);
+
+    // Translate the ROM into C++ code for the AOT engine. Returns the number of compiled blocks
+    int compile_ROM(const char *filename);
 };
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Utilities/SpscQueue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Commands that control the execution (pause, step...), sent by the I/O thread to the CPU thread.
+// The CPU thread applies them between time slices, and while it's paused it sleeps until the next
+// command arrives (instead of spinning)
+class ControlChannel {
+public:
+    struct Command {
+        enum Kind {
+            TOGGLE_PAUSE,   // Pause or resume the execution
+            STEP,           // While paused: run a number of instructions (amount), then pause again
+            RUN_CYCLES,     // While paused: run a number of cycles (amount), then pause again
+            RESET_CYCLES,   // While paused: reset the cycle counter
+        } kind;
+        uint64_t amount = 0;
+    };
+
+    // Send a command to the CPU thread (only called by the I/O thread). If too many commands are
+    // pending, it's discarded
+    void send(Command command) {
+        if (!commands.push(command)) return;
+        // Take the lock so that the notification can't be lost between the check and the wait of the CPU thread
+        { std::scoped_lock<std::mutex> lock(mutex); }
+        wake.notify_one();
+    }
+
+    // Get the next pending command (only called by the CPU thread)
+    bool receive(Command& command) {
+        return commands.pop(command);
+    }
+
+    // Sleep until a command is pending (only called by the CPU thread)
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]() { return commands.size() != 0; });
+    }
+
+    // The state is only changed by the CPU thread, and read by the UI
+    bool is_paused() const {
+        return paused.load(std::memory_order_relaxed);
+    }
+    void set_paused(bool value) {
+        paused.store(value, std::memory_order_relaxed);
+    }
+
+private:
+    SpscQueue<Command,64> commands;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> paused = false;
+};
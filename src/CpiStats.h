@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Cycles per instruction of the executed instructions. The CPU thread updates the counters without
+// locks or allocations, and other threads read a consistent snapshot of them (sequence lock).
+// The mean and the histogram of an interval are the difference between two snapshots
+class CpiStats {
+public:
+    // Bucket i counts the instructions that took i cycles, and the last one also counts the slower ones
+    static const int BUCKETS = 8;
+
+    struct Snapshot {
+        uint64_t cycles = 0;
+        uint64_t instructions = 0;
+        std::array<uint64_t,BUCKETS> histogram{};
+
+        // Counts of the instructions executed between two snapshots
+        Snapshot operator-(const Snapshot& older) const {
+            Snapshot diff;
+            diff.cycles = cycles - older.cycles;
+            diff.instructions = instructions - older.instructions;
+            for (int i = 0; i < BUCKETS; i++) diff.histogram[i] = histogram[i] - older.histogram[i];
+            return diff;
+        }
+        double mean() const {
+            if (instructions == 0) return 0;   // Invalid
+            return double(cycles)/double(instructions);
+        }
+    };
+
+    // Add count instructions that took a total of cycles (only called by the CPU thread).
+    // The instructions of a group are counted in the bucket of their mean
+    void add(int cycles, int count) {
+        int bucket = (count == 1) ? cycles : (cycles + count/2) / count;
+        if (bucket >= BUCKETS) bucket = BUCKETS-1;
+
+        uint32_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed); // Odd: update in progress
+        std::atomic_thread_fence(std::memory_order_release);
+        increment(total_cycles, uint64_t(cycles));
+        increment(total_instructions, uint64_t(count));
+        increment(histogram[bucket], uint64_t(count));
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    // Read all the counters at once (retries if the CPU thread updates them in the meantime)
+    Snapshot snapshot() const {
+        Snapshot snap;
+        uint32_t before, after;
+        do {
+            before = sequence.load(std::memory_order_acquire);
+            snap.cycles = total_cycles.load(std::memory_order_relaxed);
+            snap.instructions = total_instructions.load(std::memory_order_relaxed);
+            for (int i = 0; i < BUCKETS; i++) snap.histogram[i] = histogram[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) != 0 || before != after);
+        return snap;
+    }
+
+private:
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint64_t> total_cycles{0};
+    std::atomic<uint64_t> total_instructions{0};
+    std::array<std::atomic<uint64_t>,BUCKETS> histogram{};
+
+    // There is a single writer, so a plain load and store is enough (no locked instruction)
+    static void increment(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
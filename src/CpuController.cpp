@@ -1,20 +1,20 @@
 #include "CpuController.h"
 #include "Utilities/Assert.h"
 #include "Utilities/ExitHelper.h"
+#include "IoReactor.h"
+#include "ControlChannel.h"
 
-volatile bool Globals::is_paused;
-volatile bool Globals::single_step;
-volatile uint64_t Globals::elapsed_cycles;
-std::mutex ExitHelper::exit_mutex;
+ControlChannel Globals::control;
+std::atomic<uint64_t> Globals::elapsed_cycles;
+std::recursive_mutex ExitHelper::exit_mutex;
 
 CPU CpuController::cpu;
-std::mutex CpuController::update_mutex;
+uint64_t CpuController::pause_at_cycle = CpuController::NEVER;
 
 CpuController::CpuController() {
     // Create and reset CPU
     cpu.reset();
     
-    Globals::is_paused = false;
     if (signal(SIGINT, sig_handler) == SIG_ERR) {
         ExitHelper::error("Error: Couldn't catch SIGINT\n");
     }
@@ -55,81 +55,119 @@ void CpuController::read_ROM_file(const char* filename) const {
     hex_file.close();
 }
 
-void CpuController::call_update() {
-    std::scoped_lock<std::mutex> lock(update_mutex);
-    cpu.update();
+// Translate the loaded ROM into C++ code for the AOT engine, and exit
+void CpuController::compile_ROM(const char* filename) const {
+    int blocks = cpu.compile_ROM(filename);
+    ExitHelper::exitCode(EXIT_SUCCESS, "Compiled %d blocks into %s\n", blocks, filename);
+}
+
+// Start the I/O thread, which refreshes the UI and reads the keys while the CPU runs
+void CpuController::start_IO() {
+    IoReactor *reactor = IoReactor::get_instance();
+    reactor->set_handler(IoReactor::REFRESH, []() { cpu.update_UI(); });
+    reactor->set_handler(IoReactor::OUTPUT, []() { cpu.flush_output(); });
+    if (!Globals::silent_flg) reactor->set_handler(IoReactor::STDIN, []() { Terminal::get_instance()->update_input(); });
+    // The chars written before exiting are still output
+    reactor->set_exit_handler([]() { cpu.flush_output(); });
+    reactor->start();
 }
 
 
 
 // Execute the program
 [[noreturn]] void CpuController::execute() const {
-    // Schedule timer for calling update() every 30 milliseconds
-    std::thread([]() {
-        while (true) {
-            auto x = std::chrono::steady_clock::now() + std::chrono::milliseconds(30);
-            call_update();
-            std::this_thread::sleep_until(x);
-        }
-    }).detach();
+    start_IO();
 
     // Give some time for the ncurses window to initialize.
     // Otherwise, if the program sends outputs too soon, the first chars wouldn't be displayed
     std::this_thread::sleep_for(std::chrono::milliseconds(20));
 
-    // Amount of cycles to execute every (DEFAULT_SLEEP_US) microseconds
-    auto CYCLES = int32_t((Globals::CLK_freq * DEFAULT_SLEEP_US) / TEN_RAISED_6);
+    // Amount of cycles to execute every (DEFAULT_SLEEP_US) microseconds, or shorter slices in low jitter mode
+    int64_t slice_us = DEFAULT_SLEEP_US;
+    if (Globals::pacing == Pacer::Mode::LOW_JITTER) slice_us = LOW_JITTER_SLEEP_US;
+    auto CYCLES = int32_t((Globals::CLK_freq * slice_us) / TEN_RAISED_6);
 
     // Workaround for breakpoints not being checked on the first instruction
-    for (word addr : Globals::breakpoints)
-        if (addr == 0) Globals::is_paused = true;
-    
-    if (CYCLES < CPU::MAX_TIMESTEPS) run_slow();
-    else run_fast(CYCLES, DEFAULT_SLEEP_US);
+    if (cpu.is_at_breakpoint()) Globals::control.set_paused(true);
+
+    // At low clock speeds, a time slice would be shorter than an instruction: run them one by one
+    Pacer::Mode mode = Globals::pacing;
+    if (mode == Pacer::Mode::REALTIME && CYCLES < CPU::MAX_TIMESTEPS) mode = Pacer::Mode::LOW_FREQUENCY;
 
-    // Unreachable
-    assert(false);
+    // In low jitter mode they are also run one by one, so that each one ends at its own deadline
+    if (mode == Pacer::Mode::LOW_FREQUENCY || (mode == Pacer::Mode::LOW_JITTER && CYCLES < CPU::MAX_TIMESTEPS)) run(1, mode);
+    else run(std::max<int32_t>(CYCLES, CPU::MAX_TIMESTEPS), mode);
 }
 
-// Execute the program at high clock speeds
-[[noreturn]] void CpuController::run_fast(int32_t CYCLES, int32_t sleep_us) const {
+// Run time slices of a number of cycles, and let the pacer wait after each one
+[[noreturn]] void CpuController::run(int32_t CYCLES, Pacer::Mode mode) const {
+    Pacer pacer(mode);
     int32_t extra_cycles = 0;
+    uint64_t last_cycles = Globals::elapsed_cycles;
     while (true) {
-        // Wait until the program is unpaused
-        while (Globals::is_paused);
-
-        
-        auto end_wait = std::chrono::steady_clock::now() + std::chrono::microseconds(sleep_us);
-        {
-            std::scoped_lock<std::mutex> lock(update_mutex);
-            // Store the used extra cycles and subtract them from the next execution
-            extra_cycles = cpu.execute(CYCLES - extra_cycles);
+        apply_commands();
+        if (Globals::control.is_paused()) {
+            // Publish the state, and sleep until a command resumes the execution
+            cpu.poll_IO();
+            while (Globals::control.is_paused()) {
+                Globals::control.wait();
+                apply_commands();
+            }
+            // Don't catch up with the time spent paused
+            pacer.restart();
+            last_cycles = Globals::elapsed_cycles;
         }
 
-        if (std::chrono::steady_clock::now() > end_wait) {
-            ExitHelper::error("Target clock frequency too high for real-time emulation, try a slower clock\n");
+        // Store the used extra cycles and subtract them from the next execution. With a single cycle,
+        // exactly 1 instruction is executed every time (the pacer waits for all of its cycles)
+        int32_t slice_cycles = CYCLES - extra_cycles;
+        // Don't run past the cycle at which the execution has to pause
+        if (pause_at_cycle != NEVER)
+            slice_cycles = int32_t(std::min<uint64_t>(slice_cycles, pause_at_cycle - last_cycles));
+        auto start = std::chrono::steady_clock::now();
+        extra_cycles = cpu.execute(slice_cycles);
+        if (CYCLES == 1) extra_cycles = 0;
+        auto busy_time = std::chrono::steady_clock::now() - start;
+        cpu.poll_IO();
+
+        uint64_t cycles = Globals::elapsed_cycles;
+        pacer.pace(cycles - last_cycles, busy_time);
+        last_cycles = cycles;
+        if (cycles >= pause_at_cycle) {
+            pause_at_cycle = NEVER;
+            Globals::control.set_paused(true);
         }
-        
-        std::this_thread::sleep_until(end_wait);
     }
 }
 
-// Execute the program at low clock speeds
-[[noreturn]] void CpuController::run_slow() const {
-    while (true) {
-        // gcc with -O2 will "optimize" this to an endless loop unless is_paused is marked as volatile
-        while (Globals::is_paused);
-
-        // Request only 1 clock cycle so that exactly 1 instruction is executed.
-        // Returned value is (required_timesteps - 1): sleep to simulate the instruction timesteps
-        // The execution time of cpu.execute() is negligible at low clock speeds
-        int32_t required_timesteps;
-        {
-            std::scoped_lock<std::mutex> lock(update_mutex);
-            required_timesteps = cpu.execute(1) + 1;
+// Apply the commands sent by the UI. Only called by the CPU thread, between time slices
+void CpuController::apply_commands() {
+    using Command = ControlChannel::Command;
+    Command command;
+    while (Globals::control.receive(command)) {
+        bool paused = Globals::control.is_paused();
+        switch (command.kind) {
+        case Command::TOGGLE_PAUSE:
+            Globals::control.set_paused(!paused);
+            cpu.step(0);    // Stop stepping
+            pause_at_cycle = NEVER;
+            break;
+        case Command::STEP:
+            if (!paused || command.amount == 0) break;
+            cpu.step(command.amount);
+            pause_at_cycle = NEVER;
+            Globals::control.set_paused(false);
+            break;
+        case Command::RUN_CYCLES:
+            if (!paused || command.amount == 0) break;
+            pause_at_cycle = Globals::elapsed_cycles + command.amount;
+            Globals::control.set_paused(false);
+            break;
+        case Command::RESET_CYCLES:
+            if (!paused) break;
+            cpu.reset_cycles();
+            pause_at_cycle = NEVER;
+            break;
         }
-        int64_t required_us = TEN_RAISED_6 * required_timesteps / Globals::CLK_freq;
-        
-        std::this_thread::sleep_for(std::chrono::microseconds(required_us));
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "CPU.h"
+#include "Pacer.h"
 
 #include <functional>
 #include <thread>
@@ -8,19 +9,23 @@
 class CpuController {
 private:
     static const int64_t DEFAULT_SLEEP_US = 10000; // 10000 microseconds (10 ms)
+    static const int64_t LOW_JITTER_SLEEP_US = 1000; // 1000 microseconds (1 ms)
     static const int64_t TEN_RAISED_6 = 1000000;   // 10^6
+    static const uint64_t NEVER = UINT64_MAX;
     static CPU cpu;
-    static std::mutex update_mutex;
+    static uint64_t pause_at_cycle; // Set by a RUN_CYCLES command
 
     static void sig_handler(int sig);
-    static void call_update();
-    [[noreturn]] void run_fast(int32_t CYCLES, int32_t sleep_us) const;
-    [[noreturn]] void run_slow() const;
+    static void start_IO();
+    static void apply_commands();
+    [[noreturn]] void run(int32_t CYCLES, Pacer::Mode mode) const;
 
 
 public:
     CpuController();
     
     void read_ROM_file(const char* filename) const;
+    // Translate the loaded ROM into C++ code for the AOT engine, and exit
+    [[noreturn]] void compile_ROM(const char* filename) const;
     [[noreturn]] void execute() const;
 };
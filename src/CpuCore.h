@@ -0,0 +1,316 @@
+#pragma once
+
+// Inline CPU functions and specialized instruction handlers, shared by all the execution engines.
+// The specialized handlers take the fields that select their behavior (funct, addressing mode...)
+// as template parameters, so each variant is compiled without any runtime decoding.
+
+#include "CPU.h"
+#include "Utilities/Assert.h"
+
+
+// Returns the decoded instruction pointed by the PC (decodes it if needed). user must be equal to user_mode
+template <bool user>
+const DecodedInstr& CPU::fetch_decoded() {
+    if constexpr (!user) {
+        DecodedInstr& instr = rom_cache[PC];
+        if (instr.op == DecodedInstr::OP_NONE) {
+            uint32_t rom_word = rom[PC]; // Opcode and argument
+            decode_INSTR(instr, word(rom_word >> 16), word(rom_word));
+            fuse_group(instr, rom_cache);
+        }
+        return instr;
+    }
+    else {
+        // In RAM, the argument is stored after the opcode
+        if (PC < 0xFEFF) {
+            DecodedInstr& instr = ram_cache[PC];
+            if (instr.op == DecodedInstr::OP_NONE) {
+                decode_INSTR(instr, ram.read(PC), ram.read(PC+1));
+                fuse_group(instr, ram_cache);
+            }
+            return instr;
+        }
+        // The instruction overlaps MMIO and can change at any time: decode it every time
+        decode_INSTR(uncached_instr, ram.read(PC), ram.read(PC+1));
+        return uncached_instr;
+    }
+}
+
+// Returns true if a group of instructions (see Superinstructions.cpp) can be run at once, given
+// the cycles left in the time slice. Interrupts and breakpoints can only happen after the group
+bool CPU::can_run_group(const DecodedInstr& first, int32_t cycles_left) const {
+    if (IRQ || steps_left != 0) return false;
+    // The time slice can't end and no device event can happen before the last instruction
+    if (first.group_lead_cycles() >= cycles_left || first.group_lead_cycles() > events.max_tick()) return false;
+    if (user_mode && !is_group_valid(first)) return false;
+
+    // Stack accesses can't overflow the SP or reach MMIO
+    switch (first.group) {
+    case DecodedInstr::GROUP_PUSH:
+        if (*SP < first.group_size || *SP > 0xFF00) return false;
+        // In RAM, the pushes can't overwrite the group itself
+        return !user_mode || *SP <= PC-1 || *SP - first.group_size >= PC-1 + 2*first.group_size;
+    case DecodedInstr::GROUP_POP: return uint32_t(*SP) + first.group_size <= 0xFF00;
+    case DecodedInstr::GROUP_MOV_CALL: return *SP >= 1 && *SP <= 0xFF00;
+    case DecodedInstr::GROUP_HOOK: return can_run_hook(cycles_left);
+    default: return true;
+    }
+}
+
+// Record a trap, unless the instruction already caused another one
+void CPU::set_trap(Trap t) {
+    if (trap == Trap::NONE) trap = t;
+}
+
+// Push some data into the stack
+void CPU::push(word data) {
+    *SP = *SP - 1; // No -= operator
+    if (*SP == 0xFFFF) {
+        set_trap(Trap::SP_OVERFLOW);
+        return;
+    }
+    ram.write(*SP, data);
+}
+
+// Pop some data from the stack
+word CPU::pop() {
+    word data = ram.read(*SP);
+    *SP = *SP + 1; // No += operator
+    if (*SP == 0x0000) set_trap(Trap::SP_OVERFLOW);
+    return data;
+}
+
+// Equivalent to ++PC, but if PC overflows a trap is recorded
+word CPU::PC_plus_1() {
+    PC++;
+    if (PC == 0x0000) set_trap(Trap::PC_OVERFLOW);
+    return PC;
+}
+
+// Returns true if the OS is ready to be interrupted (handlers have been initialized)
+bool CPU::is_OS_ready() const {
+    // 1. We suppose that all the critical work is done on the first instructions
+    // 2. This extra protection layer isn't present in the real CPU. In strict mode, return true
+    return Globals::strict() || (PC >= Globals::OS_critical_instr);
+}
+
+
+
+// Returns the result of an ALU operation, given the funct bits and the 2 operands
+template <byte funct>
+word CPU::ALU_result(word A, word B) {
+    static_assert(funct <= 0b111);
+    if constexpr (funct == 0b000) return B;  // mov
+    else {
+        word result;
+        if constexpr (funct == 0b001) result = A&B; // and
+        else if constexpr (funct == 0b010) result = A|B; // or
+        else if constexpr (funct == 0b011) result = A^B; // xor
+        else if constexpr (funct == 0b100) result = A+B; // add
+        else if constexpr (funct == 0b101) result = A-B; // sub
+        else if constexpr (funct == 0b110) result = A+B + word(flag_C()); // addc
+        else result = A-B - word(flag_C()); // subb
+
+        // The flags are computed when they are read
+        if constexpr (funct <= 0b011) lazy_op = LazyFlags::LOGIC;
+        else if constexpr (funct == 0b100 || funct == 0b110) lazy_op = LazyFlags::ADD;
+        else lazy_op = LazyFlags::SUB;
+        lazy_A = A;
+        lazy_B = B;
+        lazy_result = result;
+
+        return result;
+    }
+}
+
+// Zero flag
+bool CPU::flag_Z() const {
+    return (lazy_op == LazyFlags::NONE) ? Flags.Z : (lazy_result == 0x0000);
+}
+
+// Carry flag
+bool CPU::flag_C() const {
+    switch (lazy_op) {
+    case LazyFlags::ADD: {
+        // The carry input of addc can be recovered from the result
+        word carry_in = lazy_result - lazy_A - lazy_B;
+        return bool((uint32_t(lazy_A) + uint32_t(lazy_B) + carry_in) & 0x10000);
+    }
+    case LazyFlags::SUB: {
+        // No need to invert carry on sub, in case of borrow the upper bits of the true result are 0xFFFF
+        word borrow_in = lazy_A - lazy_B - lazy_result;
+        return bool((uint32_t(lazy_A) - uint32_t(lazy_B) - borrow_in) & 0x10000);
+    }
+    case LazyFlags::LOGIC: return true; // The true result of logical operations is undefined (all 1s)
+    default: return Flags.C;
+    }
+}
+
+// Overflow flag
+bool CPU::flag_V() const {
+    if (lazy_op == LazyFlags::NONE) return Flags.V;
+    // Invert second operand of sub for overflow computation
+    word B = (lazy_op == LazyFlags::SUB) ? word(~lazy_B) : lazy_B;
+    return ((lazy_A&MSB) == (B&MSB)) && ((lazy_A&MSB) != (lazy_result&MSB));
+}
+
+// Sign flag
+bool CPU::flag_S() const {
+    return (lazy_op == LazyFlags::NONE) ? Flags.S : bool(lazy_result&MSB);
+}
+
+// Store the flags of the last ALU operation in FLG (must be called before accessing FLG/Flags)
+void CPU::materialize_flags() {
+    if (lazy_op == LazyFlags::NONE) return;
+    bool Z = flag_Z(), C = flag_C(), V = flag_V(), S = flag_S();
+    Flags.Z = Z;
+    Flags.C = C;
+    Flags.V = V;
+    Flags.S = S;
+    lazy_op = LazyFlags::NONE;
+}
+
+// Returns true if the jump condition is met and the jump has to be performed
+template <byte cond>
+bool CPU::is_condition_met() const {
+    static_assert(cond <= 0b1110, "Invalid jump condition");
+    if constexpr (cond == 0b0000) return true;                  // jmp
+    else if constexpr (cond == 0b0001) return flag_Z();         // jz / je
+    else if constexpr (cond == 0b0010) return !flag_Z();        // jnz / jne
+    else if constexpr (cond == 0b0011) return flag_C();         // jc / jb / jnae
+    else if constexpr (cond == 0b0100) return !flag_C();        // jnc / jnb / jae
+    else if constexpr (cond == 0b0101) return flag_V();         // jo
+    else if constexpr (cond == 0b0110) return !flag_V();        // jno
+    else if constexpr (cond == 0b0111) return flag_S();         // js
+    else if constexpr (cond == 0b1000) return !flag_S();        // jns
+    else if constexpr (cond == 0b1001) return flag_C() || flag_Z();     // jbe / jna
+    else if constexpr (cond == 0b1010) return !(flag_C() || flag_Z());  // ja / jnbe
+    else if constexpr (cond == 0b1011) return flag_V() != flag_S();     // jl / jnge
+    else if constexpr (cond == 0b1100) return (flag_V() != flag_S()) || flag_Z();  // jle / jng
+    else if constexpr (cond == 0b1101) return (flag_V() == flag_S()) && !flag_Z(); // jg / jnle
+    else return flag_V() == flag_S();                           // jge / jnl
+}
+
+
+
+// SPECIALIZED HANDLERS
+
+// ALU operation (operands in registers)
+template <byte funct, bool imm>
+void CPU::op_ALU_reg(const DecodedInstr& instr) {
+    word B = imm ? instr.argument : word(regs[instr.rB]);
+    regs.write(instr.rD, ALU_result<funct>(regs[instr.rA], B));
+}
+
+// ALU operation (operand in memory)
+template <byte funct, byte mode>
+void CPU::op_ALU_m_op(const DecodedInstr& instr) {
+    if constexpr (mode == 0b00) {
+        // Direct addressing: OP rD, rA, [imm]
+        regs.write(instr.rD, ALU_result<funct>(regs[instr.rA], ram.read(instr.argument)));
+    }
+    else if constexpr (mode == 0b01) {
+        // Indirect addressing: OP rD, rA, [rB]
+        regs.write(instr.rD, ALU_result<funct>(regs[instr.rA], ram.read(regs[instr.rB])));
+    }
+    else if constexpr (mode == 0b10) {
+        // Indexed addressing: OP rD, [rA+imm]
+        word address = regs[instr.rA] + instr.argument;
+        regs.write(instr.rD, ALU_result<funct>(regs[instr.rD], ram.read(address)));
+    }
+    else {
+        // Indexed addressing: OP rD, [rA+rB]
+        word address = regs[instr.rA] + regs[instr.rB];
+        regs.write(instr.rD, ALU_result<funct>(regs[instr.rD], ram.read(address)));
+    }
+}
+
+// ALU operation (destination in memory)
+template <byte funct, byte mode>
+void CPU::op_ALU_m_dest(const DecodedInstr& instr) {
+    word address;
+    word B;
+    if constexpr (mode == 0b00) {
+        // Direct addressing: OP [imm], rA
+        address = instr.argument;
+        B = regs[instr.rA];
+    }
+    else if constexpr (mode == 0b01) {
+        // Indirect addressing: OP [rA], rB
+        address = regs[instr.rA];
+        B = regs[instr.rB];
+    }
+    else if constexpr (mode == 0b10) {
+        // Indexed addressing: OP [rA+imm], rB (rB is encoded in the opcode)
+        address = regs[instr.rA] + instr.argument;
+        B = regs[instr.rD];
+    }
+    else {
+        // Indexed addressing: OP [rA+rC], rB (rB is encoded in the opcode, rC in the argument)
+        address = regs[instr.rA] + regs[instr.rB];
+        B = regs[instr.rD];
+    }
+    ram.write(address, ALU_result<funct>(ram.read(address), B));
+}
+
+// ALU operation (destination in memory, immediate operand)
+template <byte funct, byte mode>
+void CPU::op_ALU_mem_imm(const DecodedInstr& instr) {
+    word imm4 = instr.rD;
+    if constexpr (mode == 0b00) {
+        // Direct addressing: OP [Addr16], imm4
+        ram.write(instr.argument, ALU_result<funct>(ram.read(instr.argument), imm4));
+    }
+    else if constexpr (mode == 0b01) {
+        // Indirect addressing: OP [rA], Imm16
+        word address = regs[instr.rA];
+        ram.write(address, ALU_result<funct>(ram.read(address), instr.argument));
+    }
+    else if constexpr (mode == 0b10) {
+        // Indexed addressing: OP [rA+imm], imm4
+        word address = regs[instr.rA] + instr.argument;
+        ram.write(address, ALU_result<funct>(ram.read(address), imm4));
+    }
+    else {
+        // Indexed addressing: OP [rA+rC], imm4
+        word address = regs[instr.rA] + regs[instr.rB];
+        ram.write(address, ALU_result<funct>(ram.read(address), imm4));
+    }
+}
+
+// Bit shift
+template <byte type>
+void CPU::op_SHFT(const DecodedInstr& instr) {
+    byte shamt = instr.mode;
+    word result;
+
+    if constexpr (type == 0b01) { // sll
+        result = regs[instr.rA];
+        // The flags are the ones of the last add (result+result)
+        if (shamt != 0) {
+            word half = word(result << (shamt-1));
+            result = ALU_result<0b100>(half, half);
+        }
+    }
+    else {
+        if constexpr (type == 0b10) result = uint16_t(regs[instr.rA]) >> shamt; // srl
+        else result = int16_t(regs[instr.rA]) >> shamt; // sra
+        materialize_flags();
+        Flags.Z = (result == 0);
+        Flags.S = bool(result&MSB);
+        // V and C are undefined
+    }
+    regs.write(instr.rD, result);
+}
+
+// Jump
+template <byte cond, bool imm>
+void CPU::op_JMP(const DecodedInstr& instr) {
+    if (!is_condition_met<cond>())
+        return; // Jump is not taken
+
+    // Jump to immediate address or to address in register
+    PC = imm ? instr.argument : word(regs[instr.rA]);
+    // do not increment the PC after executing this instruction
+    increment_PC = false;
+}
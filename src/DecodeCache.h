@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Globals.h"
+
+#include <array>
+
+// Instruction whose fields have already been extracted, so that it doesn't need to be decoded every time it's executed.
+// The fields are packed into 8 bytes, so that the caches of ROM and RAM (64K entries each) stay small
+struct DecodedInstr {
+    // Index of the specialized handler for each instruction variant (see CPU::op_handlers)
+    enum Op : byte {
+        OP_ALU_REG = 0,         // + 2*funct + imm
+        OP_ALU_M_OP = 16,       // + 4*funct + mode
+        OP_ALU_M_DEST = 48,     // + 4*funct + mode
+        OP_ALU_MEM_IMM = 80,    // + 4*funct + mode
+        OP_SHFT = 112,          // + type-1 (sll, srl, sra)
+        OP_MEM = 115,           // + operation (movb, swap, peek L/H, push reg/imm, pushf, pop, popf)
+        OP_JMP = 124,           // + 2*cond + imm
+        OP_CALL = 156, OP_SYSCALL, OP_ENTER, OP_RET, OP_SYSRET, OP_EXIT,
+        OP_INVALID_SP,          // Stack operation that doesn't encode sp in rA
+        OP_ILLEGAL,
+        OP_COUNT,
+        OP_NONE = 0xFF          // The instruction hasn't been decoded yet
+    };
+
+    // Superinstructions: common sequences that start with this instruction can be run at once
+    enum Group : byte {
+        NO_GROUP,
+        GROUP_ALU_JMP,          // ALU operation (operands in registers) + jump
+        GROUP_PUSH,             // Sequence of push/pushf
+        GROUP_POP,              // Sequence of pop
+        GROUP_MOV_CALL,         // mov (operands in registers) + call
+        // Groups that run a variable number of instructions (see CPU::exec_long_group).
+        // For loops, the other members are the rest of the body
+        GROUP_IDLE_LOOP,        // Loop that only polls registers or memory (see IdleLoops.cpp)
+        GROUP_BULK_LOOP,        // Loop that copies, fills or compares memory (see BulkLoops.cpp)
+        GROUP_HOOK,             // Routine replaced by native code (see Hooks.cpp)
+    };
+    static const byte MAX_GROUP_SZ = 4;
+
+    word argument;              // Second word of the instruction (immediate value or address)
+    Op op;                      // Specialized handler (OP_NONE if the instruction hasn't been decoded yet)
+    byte rD : 4;                // Bits 7..4 of the opcode (destination register or 4-bit immediate)
+    byte rA : 4;                // Bits 3..0 of the opcode
+    byte rB : 4;                // Bits 3..0 of the argument
+    byte funct : 4;             // ALU funct, shift type or jump condition
+    byte mode : 4;              // Addressing mode, immediate flag or shift amount
+    byte group_size : 4;        // Number of instructions in the group (the others are decoded in the next entries)
+    byte group : 3;             // Group that starts with this instruction (see Group)
+    byte group_last_cycles : 5; // Clock cycles used by the last instruction of the group
+    byte group_cycles;          // Clock cycles used by the whole group
+
+    DecodedInstr() : argument(0), op(OP_NONE), rD(0), rA(0), rB(0), funct(0), mode(0),
+        group_size(1), group(NO_GROUP), group_last_cycles(0), group_cycles(0) {}
+
+    // Clock cycles used by the instruction (a shift takes 1 cycle per position, plus 1)
+    byte cycles() const {
+        if (op >= OP_SHFT && op < OP_MEM) return byte(mode + 1);
+        return op_cycles[op];
+    }
+    // Clock cycles used by all the instructions of the group except the last one
+    byte group_lead_cycles() const {
+        return group_cycles - group_last_cycles;
+    }
+
+    // Clock cycles of each instruction variant, except for the shifts (see DecodeTable.h)
+    static const std::array<byte,OP_COUNT> op_cycles;
+};
+static_assert(sizeof(DecodedInstr) <= 8, "The decoded instructions must be packed into 8 bytes");
+
+
+// Macros for listing the instruction variants, in the order of DecodedInstr::Op
+
+// Expand X for every combination of funct (0..7) and immediate flag
+#define EACH_IMM(X, f) X(f,0) X(f,1)
+#define EACH_FUNCT_IMM(X) \
+    EACH_IMM(X,0) EACH_IMM(X,1) EACH_IMM(X,2) EACH_IMM(X,3) \
+    EACH_IMM(X,4) EACH_IMM(X,5) EACH_IMM(X,6) EACH_IMM(X,7)
+
+// Expand X for every combination of funct (0..7) and addressing mode (0..3)
+#define EACH_MODE(X, f) X(f,0) X(f,1) X(f,2) X(f,3)
+#define EACH_FUNCT_MODE(X) \
+    EACH_MODE(X,0) EACH_MODE(X,1) EACH_MODE(X,2) EACH_MODE(X,3) \
+    EACH_MODE(X,4) EACH_MODE(X,5) EACH_MODE(X,6) EACH_MODE(X,7)
+
+// Expand X for every valid jump condition (0..14) and immediate flag
+#define EACH_COND_IMM(X) \
+    EACH_IMM(X,0) EACH_IMM(X,1) EACH_IMM(X,2)  EACH_IMM(X,3)  EACH_IMM(X,4)  EACH_IMM(X,5)  EACH_IMM(X,6) \
+    EACH_IMM(X,7) EACH_IMM(X,8) EACH_IMM(X,9)  EACH_IMM(X,10) EACH_IMM(X,11) EACH_IMM(X,12) EACH_IMM(X,13) \
+    EACH_IMM(X,14)
+
+
+// Stores the decoded instruction at each address of a memory bank
+class DecodeCache {
+private:
+    const static uint32_t CACHE_SZ = 0x10000;
+    std::array<DecodedInstr,CACHE_SZ> entries;
+
+public:
+    // Returns the decoded instruction stored at a given address (its op is OP_NONE if it isn't valid)
+    DecodedInstr& operator[](word addr) {
+        return entries[addr];
+    }
+
+    // Must be called when a memory address is written. In RAM an instruction spans 2 words,
+    // so the instruction that starts at the previous address is also invalidated
+    void invalidate(word addr) {
+        entries[addr].op = DecodedInstr::OP_NONE;
+        entries[word(addr-1)].op = DecodedInstr::OP_NONE;
+    }
+};
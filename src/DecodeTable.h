@@ -0,0 +1,135 @@
+#pragma once
+
+#include "DecodeCache.h"
+
+#include <array>
+
+// Fields of a decoded instruction that only depend on its opcode
+struct OpcodeInfo {
+    DecodedInstr::Op op = DecodedInstr::OP_ILLEGAL;
+    byte funct = 0;
+    byte mode = 0;
+    byte rD = 0;
+    byte rA = 0;
+    byte cycles = 0;
+    bool rB_is_rA = false;  // mov register to register uses rA instead of rB
+};
+
+// Decode an opcode. Encodings that can't be executed are mapped to a trap (OP_INVALID_SP or OP_ILLEGAL)
+constexpr OpcodeInfo decode_opcode(word opcode) {
+    using D = DecodedInstr;
+    OpcodeInfo info;
+    info.rD = (opcode >> 4) & 0xF;
+    info.rA = opcode & 0xF;
+    info.funct = (opcode >> 8) & 0b111;
+    info.mode = (opcode >> 11) & 0b11;
+    bool is_mov = (info.funct == 0b000);
+    // Stack operations must encode sp in rA
+    bool is_sp = (info.rA == 0b0001);
+
+    switch (opcode >> 13) {
+    case 0b000:
+        if (((opcode >> 12) & 1) == 0) {
+            // 0000... -> ALU op (operands in registers)
+            info.mode = (opcode >> 11) & 1; // Immediate mode
+            info.rB_is_rA = is_mov;
+            info.cycles = is_mov ? 2 : 3;
+            info.op = D::Op(D::OP_ALU_REG + 2*info.funct + info.mode);
+            break;
+        }
+        // 0001... -> sll
+        [[fallthrough]];
+
+    case 0b001:
+        // Shift operation
+        info.funct = (opcode >> 12) & 0b11;    // Shift type
+        info.mode = (opcode >> 8) & 0xF;        // Shift amount
+        info.cycles = info.mode + 1;
+        info.op = D::Op(D::OP_SHFT + info.funct - 1);
+        break;
+
+    case 0b010:
+        // ALU operation (operand in memory)
+        if (is_mov) info.cycles = 3; // mov always takes 3 cycles
+        else info.cycles = (info.mode >= 0b10) ? 5 : 4;
+        info.op = D::Op(D::OP_ALU_M_OP + 4*info.funct + info.mode);
+        break;
+
+    case 0b011:
+        // ALU operation (destination in memory)
+        info.cycles = (info.mode >= 0b10) ? 5 : 4;
+        if (is_mov) info.cycles--; // mov takes 3 cycles (4 cycles in indexed mode)
+        info.op = D::Op(D::OP_ALU_M_DEST + 4*info.funct + info.mode);
+        break;
+
+    case 0b100:
+        // ALU operation (destination in memory, immediate operand)
+        // Direct addressing is implemented as indexed
+        info.cycles = (info.mode == 0b01) ? 4 : 5;
+        if (is_mov) info.cycles--; // mov takes 3 cycles (4 cycles in indexed mode)
+        info.op = D::Op(D::OP_ALU_MEM_IMM + 4*info.funct + info.mode);
+        break;
+
+    case 0b101: {
+        // Memory operation: movb, swap, peek (LSB/argument), peek (MSB/opcode), push (reg), push (imm),
+        // pushf, pop, popf
+        byte operation = (opcode >> 8) & 0x1F;
+        info.cycles = (operation == 0b00001) ? 5 : 3;
+        if (operation <= 0b00011) info.op = D::Op(D::OP_MEM + operation);
+        else if (operation <= 0b01000) info.op = is_sp ? D::Op(D::OP_MEM + operation) : D::OP_INVALID_SP;
+        break;
+    }
+
+    case 0b110:
+        // Jump
+        info.funct = (opcode >> 8) & 0xF;   // Jump condition
+        info.mode = (opcode >> 12) & 1;     // Jump to immediate address
+        info.cycles = 2;
+        info.op = D::Op(D::OP_JMP + 2*info.funct + info.mode);
+        break;
+
+    default: /* 0b111 */
+        // Call/ret operation
+        info.mode = (opcode >> 8) & 1; // IMM variant
+        info.cycles = 4;
+        switch ((opcode >> 9) & 0xF) {
+        case 0b0000: info.op = is_sp ? D::OP_CALL : D::OP_INVALID_SP; break;
+        case 0b0001: info.op = is_sp ? D::OP_SYSCALL : D::OP_INVALID_SP; break;
+        case 0b0010: info.op = is_sp ? D::OP_ENTER : D::OP_INVALID_SP; break;
+        case 0b0011:
+            // 0b00110 -> ret, 0b00111 -> sysret
+            if (!is_sp) info.op = D::OP_INVALID_SP;
+            else info.op = (info.mode == 0) ? D::OP_RET : D::OP_SYSRET;
+            info.cycles = 3;
+            break;
+        case 0b0100:
+            // 0b01000 -> exit, 0b01001 -> illegal
+            if (info.mode == 0) {
+                info.op = is_sp ? D::OP_EXIT : D::OP_INVALID_SP;
+                info.cycles = 3;
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+    return info;
+}
+
+// Decoding of every possible opcode, generated at compile time
+constexpr std::array<OpcodeInfo, 0x10000> make_decode_table() {
+    std::array<OpcodeInfo, 0x10000> table{};
+    for (uint32_t opcode = 0; opcode < 0x10000; opcode++)
+        table[opcode] = decode_opcode(word(opcode));
+    return table;
+}
+inline constexpr std::array<OpcodeInfo, 0x10000> DECODE_TABLE = make_decode_table();
+
+// Clock cycles of each instruction variant (see DecodedInstr::cycles). The cycles of the shifts
+// depend on their amount, and the traps don't use their cycles
+constexpr std::array<byte, DecodedInstr::OP_COUNT> make_op_cycles() {
+    std::array<byte, DecodedInstr::OP_COUNT> table{};
+    for (const OpcodeInfo& info : DECODE_TABLE) table[info.op] = info.cycles;
+    return table;
+}
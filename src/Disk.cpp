@@ -2,8 +2,8 @@
 #include "Exceptions/DiskControllerException.h"
 #include "Utilities/Assert.h"
 #include "Utilities/ExitHelper.h"
+#include "IoReactor.h"
 
-#include <thread>
 #include <filesystem>
 #include <unistd.h> // chdir
 #include <cstring> // strerror
@@ -13,9 +13,12 @@ std::string Globals::disk_root_dir = "";
 
 // DISK CONTROLLER
 
-DiskController::DiskController(std::atomic<word> *input_reg, std::atomic<word> *output_reg, const std::string& root_directory) : input(input_reg), output(output_reg) {
+DiskController::DiskController(std::atomic<word> *input_reg, std::atomic<word> *output_reg, std::atomic<bool> *finished,
+    std::function<void()> wait_for_CPU, const std::string& root_directory) :
+    input(input_reg), output(output_reg), finished(finished), wait_for_CPU(std::move(wait_for_CPU)) {
     assert(input_reg != nullptr);
     assert(output_reg != nullptr);
+    assert(finished != nullptr);
     
     // Change working directory to the new root
     if (root_directory != "" && chdir(root_directory.c_str()) != 0) {
@@ -43,21 +46,15 @@ DiskController::DiskController(std::atomic<word> *input_reg, std::atomic<word> *
             default: throw DiskControllerException("Unrecognized command");
         }
         
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        clear(); // Command has been processed: clear the busy bit
+        finish(); // Command has been processed: wait until the Disk clears the busy bit
     }
 }
 
 // Read the input register
 word DiskController::read() const {
-    word data = 0;
-    // Poll busy bit until an input is detected
-    while ((data & Disk::BUSY_BIT) == 0) {
-        // Acquire exit lock to prevent segfault when the main thread is exiting
-        std::scoped_lock<std::mutex> lock(ExitHelper::get_exit_mutex());
-        
-        data = *input;
-    }
+    word data;
+    // Check the busy bit until an input is detected
+    while (((data = *input) & Disk::BUSY_BIT) == 0) wait_for_CPU();
     assert(data <= 0x3FF);
     
     // Don't return the busy bit
@@ -67,20 +64,14 @@ word DiskController::read() const {
 // Write to the output register
 void DiskController::write(word data) {
     assert(data <= 0x1FF);
-    {
-        // Acquire exit lock to prevent segfault when the main thread is exiting
-        std::scoped_lock<std::mutex> lock(ExitHelper::get_exit_mutex());
-        *output = data;
-    }
+    *output = data;
     expectAck();
 }
 
-// Clear the input register
-void DiskController::clear() {
-    // Acquire exit lock to prevent segfault when the main thread is exiting
-    std::scoped_lock<std::mutex> lock(ExitHelper::get_exit_mutex());
-    
-    *input = 0;
+// Signal the end of a command, and wait until the input register is cleared (see Disk::handle_event)
+void DiskController::finish() {
+    *finished = true;
+    while (*input != 0) wait_for_CPU();
 }
 
 
@@ -291,36 +282,73 @@ void DiskController::getInfo() {
 
 // DISK PERIPHERAL
 
-Disk::Disk() {
-    std::thread([this]() {
-        try {
-            DiskController controller(&input_reg, &output_reg, Globals::disk_root_dir);
-            controller.main_loop();
-        }
-        catch (const DiskControllerException& e) {
-            ExitHelper::error("Error in Disk controller:\n%s\n", e.what());
-        }
-    }).detach();
+Disk::Disk(EventQueue& events) : events(events) {
+    IoReactor::get_instance()->set_handler(IoReactor::DISK, [this]() { resume_controller(); });
+}
+
+// Entry point of the controller coroutine (makecontext only passes int arguments)
+void Disk::controller_main(uint32_t this_high, uint32_t this_low) {
+    auto disk = reinterpret_cast<Disk*>((uintptr_t(this_high) << 32) | this_low);
+    try {
+        DiskController controller(&disk->input_reg, &disk->output_reg, &disk->command_finished,
+            [disk]() { disk->suspend_controller(); }, Globals::disk_root_dir);
+        controller.main_loop();
+    }
+    catch (const DiskControllerException& e) {
+        ExitHelper::error("Error in Disk controller:\n%s\n", e.what());
+    }
+}
+
+// Run the controller until it has to wait for the CPU (called by the I/O thread). It's started on the first command
+void Disk::resume_controller() {
+    if (!controller_stack) {
+        controller_stack = new char[CONTROLLER_STACK_SZ];
+        if (getcontext(&controller_context) != 0) ExitHelper::error("Error: Couldn't start the disk controller\n");
+        controller_context.uc_stack.ss_sp = controller_stack;
+        controller_context.uc_stack.ss_size = CONTROLLER_STACK_SZ;
+        controller_context.uc_link = nullptr;   // The controller never returns
+        auto address = uint64_t(uintptr_t(this));
+        makecontext(&controller_context, reinterpret_cast<void(*)()>(&controller_main), 2,
+            uint32_t(address >> 32), uint32_t(address));
+    }
+    swapcontext(&io_context, &controller_context);
+}
+
+// Return to the I/O thread until the CPU accesses the disk again (called by the controller)
+void Disk::suspend_controller() {
+    swapcontext(&controller_context, &io_context);
 }
 
 // WRITE
 MemCell& Disk::operator=(word rhs) {
-    if (input_reg != 0 && !Globals::strict_flg) {
+    if (input_reg != 0 && !Globals::strict()) {
         // If strict mode is not enabled, warn when overwriting the controller input register
         throw DiskControllerException("Overwriting non-zero value in disk input register");
     }
-    if (rhs > 0x1FF && !Globals::strict_flg) {
+    if (rhs > 0x1FF && !Globals::strict()) {
         // If strict mode is not enabled, warn when written value is more than 9-bit long
         throw DiskControllerException("Value written in Disk is bigger than 9 bit and will be truncated");
     }
     input_reg = (rhs & 0x1FF) | BUSY_BIT;
+    IoReactor::get_instance()->notify(IoReactor::DISK);
+    // The busy bit is cleared some time after the controller has processed the command
+    events.schedule_in(EventQueue::DISK_POLL, EventQueue::us_to_cycles(COMMAND_DELAY_US));
     
     return *this;
 }
 
 // READ
 Disk::operator word() const {
-    assert(output_reg <= 0x1FF);
+    debug_assert(output_reg <= 0x1FF);
     // The read value contains the busy bit from the input register
     return output_reg | (input_reg & BUSY_BIT);
 }
+
+// Clear the input register if the controller has finished the command, otherwise check again later
+void Disk::handle_event() {
+    if (command_finished.exchange(false)) {
+        input_reg = 0;
+        IoReactor::get_instance()->notify(IoReactor::DISK);
+    }
+    else events.schedule_in(EventQueue::DISK_POLL, EventQueue::us_to_cycles(POLL_US));
+}
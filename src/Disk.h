@@ -2,10 +2,13 @@
 
 #include "Globals.h"
 #include "Memory.h"
+#include "EventQueue.h"
 
 #include <string>
 #include <fstream>
 #include <atomic>
+#include <functional>
+#include <ucontext.h>
 
 
 class DiskController {
@@ -13,6 +16,8 @@ private:
     // Communication with CPU
     std::atomic<word> * const input;
     std::atomic<word> * const output;
+    std::atomic<bool> * const finished; // Set when a command has been processed
+    const std::function<void()> wait_for_CPU; // Suspend the controller until the CPU writes or clears the input register
     
     std::string currentFile = ""; // 8.3 filename (8 char long name + 3 char long extension)
     bool file_is_open = false;
@@ -22,7 +27,7 @@ private:
     
     word read() const;
     void write(word data);
-    void clear();
+    void finish();
     
     void expectAck() const;
     size_t readByteStream(buf_t& buffer) const;
@@ -48,7 +53,8 @@ private:
     
     
 public:
-    DiskController(std::atomic<word> *input_reg, std::atomic<word> *output_reg, const std::string& root_directory);
+    DiskController(std::atomic<word> *input_reg, std::atomic<word> *output_reg, std::atomic<bool> *finished,
+        std::function<void()> wait_for_CPU, const std::string& root_directory);
     [[noreturn]] void main_loop();
 };
 
@@ -58,6 +64,23 @@ class Disk : public MemCell {
 private:
     std::atomic<word> input_reg = 0;
     std::atomic<word> output_reg = 0;
+    std::atomic<bool> command_finished = false;
+    EventQueue& events;
+
+    // The controller runs as a coroutine on the I/O thread (see IoReactor): it's resumed when the CPU
+    // writes or clears the input register, and it returns to the I/O thread while it waits for the CPU
+    static const size_t CONTROLLER_STACK_SZ = 1 << 20;
+    char *controller_stack = nullptr;  // Never freed: the emulator can exit while the controller runs on it
+    ucontext_t controller_context;
+    ucontext_t io_context;
+
+    static void controller_main(uint32_t this_high, uint32_t this_low);
+    void resume_controller();
+    void suspend_controller();
+
+    // Time that the disk takes to process a command, and between checks for the end of a slow command
+    static const int COMMAND_DELAY_US = 500000;
+    static const int POLL_US = 1000;
     
 public:
     static const int BUSY_BIT = 1 << 9;
@@ -78,11 +101,13 @@ public:
     static const int CMD_mkdir = 0x11A;
     static const int CMD_getInfo = 0x11B;
     
-    Disk();
+    explicit Disk(EventQueue& events);
     
     // WRITE
     MemCell& operator=(word rhs) override;
     // READ
     operator word() const override;
-    
+
+    // Handle the event of the end of a command (DISK_POLL)
+    void handle_event();
 };
@@ -2,13 +2,14 @@
 #include "Exceptions/EmulatorException.h"
 #include "Utilities/Assert.h"
 #include "Utilities/ExitHelper.h"
+#include "IoReactor.h"
 
-#include <thread>
 #include <cstddef>
+#include <thread>
 
 int Globals::terminal_delay = 0; // In real hardware this would be 32 microseconds
 
-Display::Display() {
+Display::Display(EventQueue& events) : events(events) {
     term = Terminal::get_instance();
     // Initialize color lines to all white
     for (Terminal::color& c : cram) c = Terminal::color::WHITE;
@@ -240,31 +241,29 @@ void Display::process_char(byte inbyte) {
 
 // WRITE
 MemCell& Display::operator=(word rhs) {
-    if (busy_flag != 0 && !Globals::strict_flg) {
+    if (busy_flag != 0 && !Globals::strict()) {
         // If strict mode is not enabled, warn when overwriting the controller input register
         throw EmulatorException("Terminal: attempting to output while the controller was busy");
     }
     
-    if (rhs > 0xFF && !Globals::strict_flg) {
+    if (rhs > 0xFF && !Globals::strict()) {
         // If strict mode is not enabled, warn when written value is more than 8-bit long
         throw EmulatorException("Terminal: Value written is bigger than 8 bit and will be truncated");
     }
     
     if (Globals::terminal_delay > 0) {
         busy_flag = rhs;
-        // VGA terminal can process 1 input every 32 microseconds, wait and clear the flag
-        std::thread([this]() {
-            std::this_thread::sleep_for(std::chrono::microseconds(Globals::terminal_delay));
-            
-            // Acquire exit lock to prevent segfault when the main thread is exiting
-            std::scoped_lock<std::mutex> lock(ExitHelper::get_exit_mutex());
-            
-            busy_flag = 0;
-        }).detach();
+        // VGA terminal can process 1 input every 32 microseconds, clear the flag after that time
+        events.schedule_in(EventQueue::DISPLAY_READY, EventQueue::us_to_cycles(Globals::terminal_delay));
     }
     
-    // Output char or process command
-    process_char(byte(rhs));
+    // Output char or process command. The I/O thread processes the queue on its next refresh, or as
+    // soon as it's half full. If it's full, wait until there is space (the order must be kept)
+    while (!output_queue.push(byte(rhs))) {
+        IoReactor::get_instance()->notify(IoReactor::OUTPUT);
+        std::this_thread::yield();
+    }
+    if (output_queue.size() == output_queue.capacity()/2) IoReactor::get_instance()->notify(IoReactor::OUTPUT);
     return *this;
 }
 
@@ -272,3 +271,23 @@ MemCell& Display::operator=(word rhs) {
 Display::operator word() const {
     return busy_flag;
 }
+
+// The terminal has processed the last input
+void Display::handle_event() {
+    busy_flag = 0;
+}
+
+// Output the queued chars and commands to the terminal
+void Display::flush_output() {
+    // An error while processing a char may exit the emulator, which flushes the output again
+    if (flushing) return;
+    flushing = true;
+    byte inbyte;
+    try {
+        while (output_queue.pop(inbyte)) process_char(inbyte);
+    }
+    catch (const EmulatorException& e) {
+        ExitHelper::error("Error in terminal output:\n%s\n", e.what());
+    }
+    flushing = false;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Terminal.h"
+#include "EventQueue.h"
+#include "Utilities/SpscQueue.h"
 
 #include <array>
 
@@ -11,7 +13,11 @@ private:
     static const int WHITE = 0b111111;
     
     Terminal *term;
+    EventQueue& events;
     word busy_flag = 0;
+    // Written chars and commands, processed by the I/O thread (see flush_output)
+    SpscQueue<byte,0x10000> output_queue;
+    bool flushing = false;
     // Some commands are sent in 2 bytes, store the command state
     enum {FIRST_BYTE = 0, SET_COLOR_LINE, SET_COLOR_SCREEN};
     byte next_byte = FIRST_BYTE;
@@ -28,10 +34,16 @@ private:
     inline void update_cursor_color(int row);
 
 public:
-    Display();
+    explicit Display(EventQueue& events);
 
     // WRITE
     MemCell& operator=(word rhs) override;
     // READ
     operator word() const override;
+
+    // Handle the event of the busy flag (DISPLAY_READY)
+    void handle_event();
+
+    // Output the queued chars and commands to the terminal. Only called by the I/O thread, or while exiting
+    void flush_output();
 };
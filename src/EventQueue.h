@@ -0,0 +1,90 @@
+#pragma once
+
+#include "Globals.h"
+
+#include <algorithm>
+#include <array>
+#include <climits>
+
+/*  Device events:
+    The delays of the devices (busy flags, timer overflow, disk commands) are scheduled in emulated
+    cycles instead of host time, so they happen at the same point of the program on every run.
+    The CPU advances the time after every instruction (or group of instructions) and only compares
+    it with the deadline of the next event. Each kind of event has at most one pending deadline, so
+    scheduling an event again replaces the previous one.
+*/
+class EventQueue {
+public:
+    enum Kind {
+        TIMER_START,        // The instruction that wrote the timer has finished: start counting
+        TIMER_OVERFLOW,     // The timer has reached its end count: trigger an interrupt
+        DISPLAY_READY,      // Clear the busy flag of the terminal
+        KEYBOARD_READY,     // Clear the busy flag of the keyboard controller
+        DISK_POLL,          // Check if the disk controller has finished the current command
+        KIND_COUNT
+    };
+
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    // Convert a delay of the host (in microseconds) into emulated cycles
+    static uint64_t us_to_cycles(int64_t us) {
+        return uint64_t(us * Globals::CLK_freq / 1000000);
+    }
+
+    // Emulated cycles since the CPU was reset. During an instruction, this is the time at which it started
+    uint64_t now() const {
+        return time;
+    }
+
+    // Schedule an event of a kind at a given time (replacing the previous one)
+    void schedule(Kind kind, uint64_t deadline) {
+        deadlines[kind] = deadline;
+        update_next();
+    }
+    // Schedule an event after a number of cycles (at least 1)
+    void schedule_in(Kind kind, uint64_t cycles) {
+        schedule(kind, time + std::max<uint64_t>(cycles, 1));
+    }
+    void cancel(Kind kind) {
+        deadlines[kind] = NEVER;
+        update_next();
+    }
+
+    // Advance the time after an instruction. Returns true if an event is due (see pop_due)
+    bool advance(int cycles) {
+        time += uint64_t(cycles);
+        return time >= next;
+    }
+
+    // Remove and return the earliest event that is due, or KIND_COUNT if there are none
+    Kind pop_due() {
+        if (time < next) return KIND_COUNT;
+        int earliest = int(std::min_element(deadlines.begin(), deadlines.end()) - deadlines.begin());
+        deadlines[earliest] = NEVER;
+        update_next();
+        return Kind(earliest);
+    }
+
+    // Returns how many cycles can be run before the next event, so that several instructions can be
+    // run at once (their last cycle can be after the deadline, like in a single instruction)
+    int max_tick() const {
+        if (next == NEVER) return INT_MAX;
+        if (next <= time) return 0;
+        return int(std::min<uint64_t>(next - time - 1, INT_MAX));
+    }
+
+    void reset() {
+        time = 0;
+        deadlines.fill(NEVER);
+        next = NEVER;
+    }
+
+private:
+    uint64_t time = 0;
+    uint64_t next = NEVER;  // Earliest deadline
+    std::array<uint64_t,KIND_COUNT> deadlines{NEVER, NEVER, NEVER, NEVER, NEVER};
+
+    void update_next() {
+        next = *std::min_element(deadlines.begin(), deadlines.end());
+    }
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -7,6 +8,10 @@
 using byte = uint8_t;
 using word = uint16_t;
 
+class Breakpoints;
+class Hooks;
+class ControlChannel;
+
 
 // Global variables that may be changed by user options
 class Globals {
@@ -14,18 +19,34 @@ private:
     Globals() = delete; // Prevent instantiation
     
 public:
+    enum class Engine { SWITCH, THREADED, JIT, AOT };
+    enum class Pacing { REALTIME, LOW_FREQUENCY, TURBO, LOW_JITTER };
+
     static bool strict_flg;         // True if -S has been used
     static bool silent_flg;         // True if -s has been used
     static char *out_file;          // If -o has been used, it contains the name of the output file. Otherwise nullptr
-    static std::vector<word> breakpoints;   // Contains the breakpoint addresses (if -b has been used)
-    static std::vector<word> exitpoints;    // Contains the exitpoint addresses (if -x has been used)
+    static char *dump_file;         // If -D has been used, the final state is written to this file at an exit point. Otherwise nullptr
+    static Breakpoints breakpoints; // Contains the breakpoints and exitpoints (if -b or -x have been used)
+    static Hooks hooks;             // Routines replaced by native code (if -H has been used)
     static int terminal_delay;      // How many microseconds to wait before the output terminal clears the busy flag
     static int keyboard_delay;      // Microseconds to wait before the keyboard controller clears the busy flag
 
     static int64_t CLK_freq;        // Emulated clock frequency (in Hz)
     static word OS_critical_instr;  // Number of critical instructions that the OS must perform before an interrupt
-    static volatile bool is_paused; // True if the emulator is currently paused
-    static volatile bool single_step;        // True if in single step mode (break on every instruction)
-    static volatile uint64_t elapsed_cycles; // Store how many cycles the CPU has executed
+    static ControlChannel control;  // Commands from the UI to the CPU thread (pause, step...), and whether it's paused
+    static std::atomic<uint64_t> elapsed_cycles;   // Cycles executed by the CPU (published after each time slice)
     static std::string disk_root_dir;   // Root directory used for disk emulation
+    static Engine engine;           // Execution engine used by the CPU (selected with -e or -a)
+    static char *aot_file;          // If -a has been used, it contains the name of the compiled ROM. Otherwise nullptr
+    static Pacing pacing;           // How the emulated clock follows the host time (selected with -p)
+
+    // Returns true if strict mode is enabled. Builds with -DSTRICT_MODE=0 or -DSTRICT_MODE=1 fix it
+    // at compile time, so that the extra protections are compiled out or always done
+    static bool strict() {
+#ifdef STRICT_MODE
+        return STRICT_MODE;
+#else
+        return strict_flg;
+#endif
+    }
 };
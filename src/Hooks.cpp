@@ -0,0 +1,324 @@
+#include "Hooks.h"
+#include "CpuCore.h"
+#include "Utilities/ExitHelper.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+/*  Hooked routines (high-level emulation):
+    Software multiplication and division, and memory routines, take thousands of cycles of simple
+    code. Each hooked routine is replaced by a native function that reads its arguments from the
+    registers and memory and writes its results. When the PC reaches the first instruction of the
+    routine in ROM (through any kind of call), the function is run instead, the cycles of the whole
+    routine are accounted at once, and the CPU returns like the ret instruction.
+    Like a group of instructions, a hook is only run when no interrupt can happen in the middle of
+    the routine: otherwise the routine is run normally.
+    The cycles of the memory routines depend on their arguments, so they are configured as a base
+    plus a cost per processed word. The cycles of the other routines can be measured instead: their
+    first call is run normally, and the cycles between the call and the matching return are recorded.
+    In validation mode (-V), the native function is run on the state at every call and its results
+    are kept, then the routine is run normally. When it returns, the emulator exits if the results,
+    the PC or the RAM don't match.
+    A measured or validated call is run by the normal loop (see CPU::track_hook_call), so it can be
+    interrupted: in that case, it's dropped and the next call is measured or validated instead.
+*/
+
+// Registers used for the arguments and results (see README.md)
+static const byte A0 = 12, A1 = 13, A2 = 14;
+
+// Registers that the calling convention doesn't preserve: t0-t3 and a0-a3 (the flags aren't preserved either)
+static const uint16_t CALLER_SAVED = 0xFF00;
+
+static constexpr uint16_t bit(byte reg) {
+    return uint16_t(1 << reg);
+}
+
+
+// NATIVE ROUTINES
+
+// mul: a0 = a0 * a1 (lower 16 bits)
+static void hook_mul(Regfile& regs, Ram&) {
+    regs.write(A0, word(regs[A0] * regs[A1]));
+}
+
+// udiv: a0 = a0 / a1, a1 = a0 % a1 (unsigned). Dividing by 0 returns 0xFFFF and the dividend
+static void hook_udiv(Regfile& regs, Ram&) {
+    word dividend = regs[A0];
+    word divisor = regs[A1];
+    regs.write(A0, (divisor == 0) ? 0xFFFF : word(dividend / divisor));
+    regs.write(A1, (divisor == 0) ? dividend : word(dividend % divisor));
+}
+
+// div: a0 = a0 / a1, a1 = a0 % a1 (signed, rounded towards 0). Dividing by 0 returns -1 and the dividend
+static void hook_div(Regfile& regs, Ram&) {
+    int32_t dividend = int16_t(regs[A0]);
+    int32_t divisor = int16_t(regs[A1]);
+    regs.write(A0, (divisor == 0) ? 0xFFFF : word(dividend / divisor));
+    regs.write(A1, (divisor == 0) ? word(dividend) : word(dividend % divisor));
+}
+
+// memcpy: copy a2 words from [a1] to [a0]
+static void hook_memcpy(Regfile& regs, Ram& ram) {
+    word dst = regs[A0];
+    word src = regs[A1];
+    word count = regs[A2];
+    // The ranges don't overlap and are below MMIO
+    if (uint32_t(dst) + count <= 0xFF00 && uint32_t(src) + count <= 0xFF00 && (dst + count <= src || src + count <= dst)) {
+        ram.copy(dst, src, count);
+        return;
+    }
+    for (word i = 0; i < count; i++) ram.write(word(dst+i), ram.read(word(src+i)));
+}
+
+// memset: write a1 to a2 words, starting at [a0]
+static void hook_memset(Regfile& regs, Ram& ram) {
+    word dst = regs[A0];
+    word value = regs[A1];
+    word count = regs[A2];
+    if (uint32_t(dst) + count <= 0xFF00) {
+        ram.fill(dst, value, count);
+        return;
+    }
+    for (word i = 0; i < count; i++) ram.write(word(dst+i), value);
+}
+
+// strlen: a0 = number of words before the first 0, starting at [a0]
+static void hook_strlen(Regfile& regs, Ram& ram) {
+    word start = regs[A0];
+    word length = 0;
+    while (length != 0xFFFF && ram.read(word(start+length)) != 0) length++;
+    regs.write(A0, length);
+}
+
+
+
+// COST OF THE ROUTINES THAT DEPEND ON THEIR ARGUMENTS
+
+// memcpy: a2 words. The call is only replaced if both ranges are below MMIO
+static int32_t count_memcpy(const Regfile& regs, const Ram&) {
+    uint32_t end = uint32_t(std::max(regs[A0], regs[A1])) + regs[A2];
+    return (end <= Ram::MMIO_START) ? regs[A2] : -1;
+}
+
+// memset: a2 words. The call is only replaced if the range is below MMIO
+static int32_t count_memset(const Regfile& regs, const Ram&) {
+    return (uint32_t(regs[A0]) + regs[A2] <= Ram::MMIO_START) ? regs[A2] : -1;
+}
+
+// strlen: words before the first 0. The call is only replaced if the 0 is found below MMIO
+static int32_t count_strlen(const Regfile& regs, const Ram& ram) {
+    for (uint32_t addr = regs[A0]; addr < Ram::MMIO_START; addr++) {
+        if (ram.peek(word(addr)) == 0) return int32_t(addr - regs[A0]);
+    }
+    return -1;
+}
+
+
+struct Routine {
+    const char *name;
+    Hooks::Function function;
+    Hooks::Count count;     // nullptr if the routine always takes the same cycles
+    uint16_t clobbered;     // Caller-saved registers that aren't results
+};
+
+static const Routine ROUTINES[] = {
+    {"mul", &hook_mul, nullptr, CALLER_SAVED & ~bit(A0)},
+    {"udiv", &hook_udiv, nullptr, CALLER_SAVED & ~(bit(A0) | bit(A1))},
+    {"div", &hook_div, nullptr, CALLER_SAVED & ~(bit(A0) | bit(A1))},
+    {"memcpy", &hook_memcpy, &count_memcpy, CALLER_SAVED},
+    {"memset", &hook_memset, &count_memset, CALLER_SAVED},
+    {"strlen", &hook_strlen, &count_strlen, CALLER_SAVED & ~bit(A0)},
+};
+
+
+// Parse a hook with the format address=routine[,cycles[,cycles_per_word]]
+std::string Hooks::add(const std::string& spec) {
+    size_t equal = spec.find('=');
+    if (equal == std::string::npos) return "the format is address=routine[,cycles[,cycles_per_word]]";
+
+    // Address
+    std::string address_str = spec.substr(0, equal);
+    char *endptr;
+    long address = strtol(address_str.c_str(), &endptr, 16);
+    if (address_str.empty() || *endptr != '\0') return "make sure the address is a valid hex integer";
+    if (address < 0 || address >= 0xFFFF) return "make sure the address is between 0 and 0xFFFE";
+    if (table[address]) return "a routine has already been hooked at this address";
+
+    // Routine
+    size_t comma = spec.find(',', equal);
+    Entry entry;
+    entry.name = spec.substr(equal+1, comma-equal-1);
+    entry.function = nullptr;
+    for (const Routine& routine : ROUTINES) {
+        if (entry.name != routine.name) continue;
+        entry.function = routine.function;
+        entry.count = routine.count;
+        entry.clobbered = routine.clobbered;
+    }
+    if (entry.function == nullptr) return "unknown routine [" + entry.name + "], use mul, udiv, div, memcpy, memset or strlen";
+
+    // Cycles
+    size_t per_word_comma = std::string::npos;
+    if (comma != std::string::npos) {
+        per_word_comma = spec.find(',', comma+1);
+        std::string cycles_str = spec.substr(comma+1, per_word_comma-comma-1);
+        long cycles = strtol(cycles_str.c_str(), &endptr, 10);
+        if (cycles_str.empty() || *endptr != '\0' || cycles < 1 || cycles > 0xFFFFFF) return "invalid cycle count";
+        entry.cycles = uint32_t(cycles);
+    }
+    // Cycles per word
+    if (per_word_comma != std::string::npos) {
+        if (entry.count == nullptr) return entry.name + " always takes the same cycles, the format is address=" + entry.name + "[,cycles]";
+        long per_word = strtol(spec.c_str() + per_word_comma + 1, &endptr, 10);
+        if (per_word_comma+1 == spec.size() || *endptr != '\0' || per_word < 0 || per_word > 0xFFFF) return "invalid cycle count per word";
+        entry.cycles_per_word = uint32_t(per_word);
+    }
+    // A single call can't be used to measure a routine whose cycles depend on its arguments
+    else if (entry.count != nullptr) {
+        return "the cycles of " + entry.name + " depend on its arguments, the format is address=" + entry.name + ",cycles,cycles_per_word";
+    }
+
+    table[address] = true;
+    entries[word(address)] = entry;
+    return "";
+}
+
+
+
+// EXECUTION
+
+// Cycles of a call to a hook with the current arguments (0 if they have to be measured, and negative
+// if the call can't be replaced)
+int64_t CPU::hook_cycles(const Hooks::Entry& hook) const {
+    if (hook.count == nullptr) return hook.cycles;
+    int32_t count = hook.count(regs, ram);
+    if (count < 0) return -1;
+    return hook.cycles + int64_t(hook.cycles_per_word) * count;
+}
+
+// Returns true if the hooked routine at the PC can be replaced now, given the cycles left in the time slice
+bool CPU::can_run_hook(int32_t cycles_left) const {
+    const Hooks::Entry& hook = Globals::hooks.entry(PC);
+    // The return address must be popped from RAM
+    if (*SP >= 0xFF00) return false;
+    int64_t cycles = hook_cycles(hook);
+    if (cycles < 0) return false;
+    // When the cycles are measured or the native code is validated, only the first instruction of the
+    // routine is run now (the rest of the call is tracked by the normal loop). One call is tracked at a time
+    if (cycles == 0 || Globals::hooks.validate) return !hook_call.active;
+    // Like in a single instruction, only the last cycle can be after the end of the time slice or a device event
+    int64_t lead_cycles = cycles - 1;
+    return lead_cycles < cycles_left && lead_cycles <= events.max_tick();
+}
+
+// Replace the hooked routine at the PC, or start a call that is measured or validated (can_run_group
+// must have returned true). Returns the used cycles, and sets the number of executed instructions
+int CPU::exec_hook(const DecodedInstr& first, int& instructions) {
+    Hooks::Entry& hook = Globals::hooks.entry(PC);
+    const word entry = PC;
+    int64_t cycles = hook_cycles(hook);
+
+    if (cycles == 0 || Globals::hooks.validate) {
+        if (Globals::hooks.validate) run_hook_for_validation(hook);
+        hook_call.active = true;
+        hook_call.entry = entry;
+        hook_call.call_SP = *SP;
+        hook_call.lowest_SP = *SP;
+        hook_call.start_cycles = cycle_count;
+        hook_call.start_instructions = cpi_stats.snapshot().instructions;
+
+        // Run the first instruction of the routine normally
+        int used_cycles = exec_INSTR(first);
+        if (trap != Trap::NONE) report_trap(entry, false);
+        instructions = 1;
+        return used_cycles;
+    }
+
+    hook.function(regs, ram);
+    // Return like ret
+    PC = pop();
+    if (trap != Trap::NONE) report_trap(entry, false);
+    instructions = hook.instructions;
+    return int(cycles);
+}
+
+// Called after each instruction (or group) while a call of a hooked routine is tracked: once the
+// routine has popped its return address, record its cycles or compare its results
+void CPU::track_hook_call() {
+    if (*SP <= hook_call.call_SP) {
+        hook_call.lowest_SP = std::min(hook_call.lowest_SP, *SP);
+        return;
+    }
+    hook_call.active = false;
+
+    Hooks::Entry& hook = Globals::hooks.entry(hook_call.entry);
+    if (Globals::hooks.validate) {
+        validate_hook_call(hook);
+        return;
+    }
+    // The cycles and the instructions include the call to end_instruction that is running now
+    hook.cycles = uint32_t(cycle_count - hook_call.start_cycles);
+    hook.instructions = uint32_t(cpi_stats.snapshot().instructions - hook_call.start_instructions);
+}
+
+// Run the native function of a hook on the current state and keep its results in hook_call, then
+// undo its changes so that the routine can be run normally
+void CPU::run_hook_for_validation(const Hooks::Entry& hook) {
+    const uint32_t RAM_SZ = Ram::MMIO_START; // MMIO isn't compared
+
+    std::array<word,16> initial_regs;
+    std::vector<word> initial_ram(RAM_SZ);
+    std::vector<word>& hook_ram = hook_call.hook_ram;
+    hook_ram.resize(RAM_SZ);
+    for (byte i = 0; i < 16; i++) initial_regs[i] = regs[i];
+    for (uint32_t addr = 0; addr < RAM_SZ; addr++) initial_ram[addr] = ram.peek(word(addr));
+
+    hook.function(regs, ram);
+    if (trap != Trap::NONE) report_trap(PC, false);
+
+    for (byte i = 0; i < 16; i++) {
+        hook_call.hook_regs[i] = regs[i];
+        regs.write(i, initial_regs[i]);
+    }
+    for (uint32_t addr = 0; addr < RAM_SZ; addr++) {
+        hook_ram[addr] = ram.peek(word(addr));
+        if (hook_ram[addr] != initial_ram[addr]) ram.write(word(addr), initial_ram[addr]);
+    }
+    // The native function returns like ret
+    hook_call.hook_PC = hook_ram[initial_regs[1]];
+    hook_call.hook_regs[1]++;
+}
+
+// Compare the state after the routine has returned with the results of its native function.
+// The registers clobbered by the routine and its stack frame aren't compared
+void CPU::validate_hook_call(const Hooks::Entry& hook) {
+    const uint32_t RAM_SZ = Ram::MMIO_START;
+    const std::vector<word>& hook_ram = hook_call.hook_ram;
+
+    std::string diff;
+    char line[80];
+    if (PC != hook_call.hook_PC) {
+        snprintf(line, sizeof(line), "  PC: 0x%04X (hook: 0x%04X)\n", PC, hook_call.hook_PC);
+        diff += line;
+    }
+    for (byte i = 1; i < 16; i++) {
+        if ((hook.clobbered & bit(i)) || regs[i] == hook_call.hook_regs[i]) continue;
+        snprintf(line, sizeof(line), "  %s: 0x%04X (hook: 0x%04X)\n", Regfile::ABI_names[i].c_str(), uint(regs[i]), hook_call.hook_regs[i]);
+        diff += line;
+    }
+    // Only the first different words are listed
+    int different_words = 0;
+    for (uint32_t addr = 0; addr < RAM_SZ; addr++) {
+        if (addr >= hook_call.lowest_SP && addr < hook_call.call_SP) continue;
+        if (ram.peek(word(addr)) == hook_ram[addr]) continue;
+        if (++different_words > 8) continue;
+        snprintf(line, sizeof(line), "  [0x%04X]: 0x%04X (hook: 0x%04X)\n", addr, ram.peek(word(addr)), hook_ram[addr]);
+        diff += line;
+    }
+    if (different_words > 8) diff += "  (" + std::to_string(different_words - 8) + " more words are different)\n";
+    if (!diff.empty()) {
+        ExitHelper::error("Error: The hook of the routine at 0x%04X (%s) doesn't match the routine:\n%s",
+            hook_call.entry, hook.name.c_str(), diff.c_str());
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Globals.h"
+
+#include <array>
+#include <string>
+#include <unordered_map>
+
+class Regfile;
+class Ram;
+
+// Routines in ROM that are replaced by native code (high-level emulation). When the PC reaches the
+// first instruction of a hooked routine, its native implementation is run instead, the configured
+// cycles are accounted, and the CPU returns like the ret instruction (see CPU::exec_hook)
+class Hooks {
+public:
+    // Native implementation of a routine: reads its arguments and writes its results (see README.md)
+    using Function = void (*)(Regfile& regs, Ram& ram);
+    // Number of words processed by a call of a routine whose cycles depend on its arguments
+    // (negative if the call can't be replaced, for example if it would access MMIO)
+    using Count = int32_t (*)(const Regfile& regs, const Ram& ram);
+
+    struct Entry {
+        std::string name;
+        Function function;
+        Count count;                // nullptr if the routine always takes the same cycles
+        uint16_t clobbered;         // Registers that the routine can leave with any value (bit i: register i)
+        uint32_t cycles = 0;        // Cycles of each call (0 if they have to be measured on the first call)
+        uint32_t cycles_per_word = 0;   // Extra cycles of each word processed (only if count isn't nullptr)
+        uint32_t instructions = 1;  // Instructions of each call (only known if the cycles were measured)
+    };
+
+    // Run both the native code and the routine on every call, and compare their results (-V)
+    bool validate = false;
+
+    // Parse a hook with the format address=routine[,cycles[,cycles_per_word]] (see README.md).
+    // Returns an error message, or an empty string if the hook was added
+    std::string add(const std::string& spec);
+
+    // Returns true if a routine has been hooked at an address of ROM
+    bool is_hooked(word addr) const {
+        return table[addr];
+    }
+
+    // Returns the hook of a hooked address
+    Entry& entry(word addr) {
+        return entries.find(addr)->second;
+    }
+
+private:
+    std::array<bool,0x10000> table{};
+    std::unordered_map<word, Entry> entries;
+};
@@ -0,0 +1,81 @@
+#include "CpuCore.h"
+
+#include <algorithm>
+
+/*  Idle loops:
+    The OS spends a lot of time polling a device (the busy flag of the display or the disk, the
+    keyboard register) or spinning on a jump to itself until an interrupt arrives. Such a loop
+    only reads registers and memory, so once an iteration has brought the registers and flags
+    back to their values at the start of the loop, every following iteration will do exactly the
+    same until something outside the CPU changes: a device event (see EventQueue.h), or a device
+    updated by the disk controller thread or by CPU::update (which can't run during a time slice).
+    These loops are detected when their first instruction is decoded, and run as a group (see
+    Superinstructions.cpp). When an iteration doesn't change anything, the identical iterations
+    that follow are skipped and only accounted, up to the end of the time slice or the next
+    device event (whichever comes first). Cycle counts and interrupts stay the same as if
+    every iteration had been run.
+*/
+
+// MMIO port of the timer: its value changes on every tick, so a loop that reads it isn't idle
+static const word TIMER_ADDR = 0xFF80;
+
+// Returns true if an instruction can be part of an idle loop: it doesn't write memory, and if it
+// reads memory the address is fixed
+static bool is_idle_instr(const DecodedInstr& instr) {
+    using D = DecodedInstr;
+    if (instr.op < D::OP_ALU_M_OP) return true;
+    if (instr.op < D::OP_ALU_M_DEST) {
+        bool direct = (instr.mode == 0b00) || (instr.mode == 0b10 && instr.rA == 0);
+        return direct && instr.argument != TIMER_ADDR;
+    }
+    if (instr.op >= D::OP_SHFT && instr.op < D::OP_MEM) return true;
+    if (instr.op == D::OP_MEM+0b00010 || instr.op == D::OP_MEM+0b00011) return true; // peek
+    if (instr.op >= D::OP_JMP && instr.op < D::OP_JMP + 2*15) return true;
+    return false;
+}
+
+
+// Check if the loop that starts at the PC (see collect_loop) is an idle loop. first is the instruction
+// at the PC, which has just been decoded. Returns true if it has been marked as the start of the loop
+bool CPU::find_idle_loop(DecodedInstr& first, const DecodedInstr* members, int size) {
+    for (int i = 0; i < size; i++) {
+        if (!is_idle_instr(members[i])) return false;
+    }
+    mark_loop(first, members, size, DecodedInstr::GROUP_IDLE_LOOP);
+    return true;
+}
+
+// Run an iteration of an idle loop (can_run_group must have returned true). If it hasn't changed
+// the registers or the flags, also account the following iterations that fit in the cycles left.
+// Returns the used cycles, and sets the number of executed instructions
+int CPU::exec_idle_loop(const DecodedInstr& first, int32_t cycles_left, int& instructions) {
+    const word start = PC;
+    const DecodedInstr* members = &first;
+    auto flag_bits = [this]() { return flag_Z() | flag_C() << 1 | flag_V() << 2 | flag_S() << 3; };
+
+    // Value of the registers that the instructions can write, and of the flags
+    word initial_regs[MAX_LOOP_SZ];
+    for (int i = 0; i < first.group_size; i++) initial_regs[i] = regs[members[i].rD];
+    int initial_flags = flag_bits();
+
+    instructions = 0;
+    int used_cycles = exec_loop_iteration(first, instructions);
+
+    // The loop has been left, or the iteration has changed the CPU state
+    if (PC != start) return used_cycles;
+    for (int i = 0; i < first.group_size; i++) {
+        if (regs[members[i].rD] != initial_regs[i]) return used_cycles;
+    }
+    if (flag_bits() != initial_flags) return used_cycles;
+
+    // Skip the identical iterations. The time slice can't end and no device event can happen before
+    // the last one, so the following instructions see the same state as if they had been run
+    int32_t period = first.group_cycles;
+    int32_t limit = std::min(cycles_left - 1, int32_t(events.max_tick()));
+    int32_t skipped = limit / period - 1;
+    if (skipped > 0) {
+        used_cycles += skipped * period;
+        instructions += skipped * first.group_size;
+    }
+    return used_cycles;
+}
@@ -0,0 +1,99 @@
+#include "IoReactor.h"
+#include "Utilities/Assert.h"
+#include "Utilities/ExitHelper.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+IoReactor *IoReactor::get_instance() {
+    static IoReactor instance;
+    return &instance;
+}
+
+IoReactor::IoReactor() {
+    fds.fill(-1);
+}
+
+void IoReactor::set_handler(Source source, Handler handler) {
+    assert(!started);
+    handlers[source] = std::move(handler);
+}
+
+void IoReactor::set_exit_handler(Handler handler) {
+    exit_handler = std::move(handler);
+}
+
+// Wake the I/O thread (the eventfd counts the notifications until they are handled)
+void IoReactor::notify(Source source) {
+    if (fds[source] < 0) return;
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t written = write(fds[source], &one, sizeof(one));
+}
+
+void IoReactor::add_source(Source source, int fd) {
+    if (fd < 0) ExitHelper::error("Error: Couldn't create the file descriptors of the I/O thread\n");
+    fds[source] = fd;
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u32 = source;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        // stdin can't be waited on if it's a regular file, its keys are still read on every refresh
+        if (source == STDIN && errno == EPERM) return;
+        ExitHelper::error("Error: Couldn't add a source to the I/O thread\n");
+    }
+}
+
+void IoReactor::start() {
+    assert(!started);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) ExitHelper::error("Error: Couldn't create the I/O thread\n");
+
+    if (handlers[STDIN]) add_source(STDIN, STDIN_FILENO);
+    if (handlers[REFRESH]) {
+        add_source(REFRESH, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+        itimerspec period{};
+        period.it_interval.tv_nsec = REFRESH_MS * 1000000L;
+        period.it_value = period.it_interval;
+        if (timerfd_settime(fds[REFRESH], 0, &period, nullptr) != 0)
+            ExitHelper::error("Error: Couldn't start the refresh timer\n");
+    }
+    for (Source source : {OUTPUT, DISK, SHUTDOWN})
+        add_source(source, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+    started = true;
+    std::thread([this]() { main_loop(); }).detach();
+}
+
+void IoReactor::stop() {
+    stopped = true;
+    if (started) notify(SHUTDOWN);
+    if (exit_handler) exit_handler();
+}
+
+void IoReactor::main_loop() {
+    std::array<epoll_event,SOURCE_COUNT> ready;
+    while (true) {
+        int count = epoll_wait(epoll_fd, ready.data(), SOURCE_COUNT, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;   // Interrupted by a signal (SIGWINCH...)
+            ExitHelper::error("Error: The I/O thread couldn't wait for its sources\n");
+        }
+
+        // Acquire exit lock, so that the process doesn't exit in the middle of a handler
+        std::scoped_lock<std::recursive_mutex> lock(ExitHelper::get_exit_mutex());
+        if (stopped) return;
+
+        for (int i = 0; i < count; i++) {
+            auto source = Source(ready[i].data.u32);
+            // Consume the expirations of the timer and the notifications (stdin is read by its handler)
+            if (source != STDIN) {
+                uint64_t expirations;
+                [[maybe_unused]] ssize_t bytes = read(fds[source], &expirations, sizeof(expirations));
+            }
+            if (handlers[source]) handlers[source]();
+        }
+    }
+}
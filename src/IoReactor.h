@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+/*  Host I/O thread:
+    Everything that the emulator does on the host apart from running the CPU (reading the keyboard,
+    refreshing the UI, printing the output of the terminal and running the disk controller) is done
+    by a single thread, which sleeps in epoll until one of its sources is ready. The CPU thread only
+    talks to it through lock-free queues and notify(), so it never waits for a lock held by the UI.
+    The handlers run with the exit lock held, so the process never exits in the middle of one.
+*/
+class IoReactor {
+public:
+    enum Source {
+        STDIN,      // Keys are available in stdin (only if the ncurses interface is used)
+        REFRESH,    // Periodic refresh of the UI (every REFRESH_MS)
+        OUTPUT,     // The queue of the terminal output is filling up
+        DISK,       // The CPU has written or cleared the input register of the disk
+        SHUTDOWN,   // The emulator is exiting
+        SOURCE_COUNT
+    };
+    using Handler = std::function<void()>;
+
+    static const int REFRESH_MS = 30;
+
+    // The instance is created on first use, since the devices register their handlers while the CPU is created
+    static IoReactor *get_instance();
+
+    // Set the function called (on the I/O thread) when a source is ready. Must be called before start()
+    void set_handler(Source source, Handler handler);
+    // Set the function that completes the pending output before exiting (called by stop())
+    void set_exit_handler(Handler handler);
+    // Wake the I/O thread in order to run the handler of OUTPUT or DISK (can be called from any thread)
+    void notify(Source source);
+
+    void start();
+    // Called with the exit lock held before the process exits: the I/O thread won't run any more
+    // handlers, and the exit handler is run on the calling thread
+    void stop();
+
+private:
+    int epoll_fd = -1;
+    std::array<int,SOURCE_COUNT> fds;
+    std::array<Handler,SOURCE_COUNT> handlers;
+    Handler exit_handler;
+    std::atomic<bool> stopped = false;
+    bool started = false;
+
+    IoReactor();
+    void add_source(Source source, int fd);
+    void main_loop();
+};
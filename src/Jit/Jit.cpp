@@ -0,0 +1,707 @@
+#include "Jit.h"
+#include "../CpuCore.h"
+#include "../Breakpoints.h"
+#include "../Hooks.h"
+#include "../Utilities/ExitHelper.h"
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstddef>
+
+using namespace x86;
+
+// Offset of a field of the context (relative to RBX)
+#define CTX(field) int32_t(offsetof(Context, field))
+
+namespace {
+    // Bits of each flag (see StatusFlags)
+    const byte FLAG_Z = 1 << 0;
+    const byte FLAG_C = 1 << 1;
+    const byte FLAG_V = 1 << 2;
+    const byte FLAG_S = 1 << 3;
+    const byte ALL_FLAGS = FLAG_Z | FLAG_C | FLAG_V | FLAG_S;
+
+    // Lowest MMIO address. Accesses from this address on are done by the interpreter
+    const uint32_t MMIO_START = 0xFF00;
+}
+
+
+Jit::Jit(CPU& cpu) :
+    cpu(cpu),
+    ctx(std::make_unique<Context>()),
+    code_buffer(static_cast<byte*>(mmap(nullptr, CODE_BUFFER_SZ, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))),
+    emitter(code_buffer, CODE_BUFFER_SZ),
+    blocks(0x10000), block_cycles(0x10000), hit_count(0x10000), not_compilable(0x10000), stop_at(0x10000)
+{
+    if (code_buffer == MAP_FAILED)
+        ExitHelper::error("Error: Could not allocate executable memory for the JIT compiler\n");
+
+    ctx->cpu = &cpu;
+    // LAHF stores SF in bit 7, ZF in bit 6 and CF in bit 0
+    for (int ah = 0; ah < 256; ah++) {
+        byte flags = 0;
+        if (ah & (1 << 6)) flags |= FLAG_Z;
+        if (ah & (1 << 0)) flags |= FLAG_C;
+        if (ah & (1 << 7)) flags |= FLAG_S;
+        ctx->flag_table[ah] = flags;
+    }
+    // Evaluate each jump condition with the interpreter, for every possible value of the flags
+    cpu.materialize_flags();
+    byte old_FLG = cpu.FLG;
+    for (byte cond = 0; cond < 15; cond++) {
+        condition_masks[cond] = 0;
+        for (byte flags = 0; flags <= ALL_FLAGS; flags++) {
+            cpu.FLG = flags;
+            if (cpu.is_condition_met(cond)) condition_masks[cond] |= 1 << flags;
+        }
+    }
+    cpu.FLG = old_FLG;
+
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        stop_at[addr] = Globals::breakpoints.flags(word(addr), false) != 0 || Globals::hooks.is_hooked(word(addr));
+        // Hooked routines are replaced by the interpreter (see CPU::exec_hook)
+        not_compilable[addr] = Globals::hooks.is_hooked(word(addr));
+    }
+
+    emit_trampoline();
+    set_writable(false);
+}
+
+Jit::~Jit() {
+    munmap(code_buffer, CODE_BUFFER_SZ);
+}
+
+
+// Run the compiled code starting at the current PC for at most max_cycles
+Jit::Result Jit::run(int32_t max_cycles) {
+    word start = cpu.PC;
+    const byte *code = blocks[start];
+    if (code == nullptr) {
+        // Compile the block once it has been reached enough times
+        if (not_compilable[start] || ++hit_count[start] < HOT_THRESHOLD) return {};
+        code = compile(start);
+        if (code == nullptr) {
+            not_compilable[start] = true;
+            return {};
+        }
+    }
+    if (block_cycles[start] > max_cycles) return {};
+
+    for (byte i = 0; i < 16; i++) ctx->regs[i] = cpu.regs[i];
+    cpu.materialize_flags();
+    ctx->flags = cpu.FLG;
+    ctx->cycles_left = max_cycles;
+    ctx->instructions = 0;
+
+    reinterpret_cast<EntryFunction>(code_buffer)(ctx.get(), code);
+
+    for (byte i = 1; i < 16; i++) cpu.regs.write(i, word(ctx->regs[i]));
+    cpu.FLG = byte(ctx->flags);
+    cpu.PC = word(ctx->PC);
+    return { max_cycles - ctx->cycles_left, ctx->instructions };
+}
+
+
+
+// HELPER FUNCTIONS (called by the generated code, the address is never MMIO)
+
+uint32_t Jit::read_RAM(CPU *cpu, uint32_t address) {
+    return cpu->ram.read(word(address));
+}
+
+void Jit::write_RAM(CPU *cpu, uint32_t address, uint32_t value) {
+    cpu->ram.write(word(address), word(value));
+}
+
+uint32_t Jit::read_ROM_L(CPU *cpu, uint32_t address) {
+    return cpu->rom.low(word(address));
+}
+
+uint32_t Jit::read_ROM_H(CPU *cpu, uint32_t address) {
+    return cpu->rom.high(word(address));
+}
+
+
+
+// Generate the code that enters and leaves the compiled blocks
+void Jit::emit_trampoline() {
+    // Save the callee-saved registers. After the 6 pushes, RSP needs to be realigned to 16 bytes
+    // for calling the helpers. The extra 8 bytes are used for spilling values across calls.
+    emitter.push64(EBX);
+    emitter.push64(EBP);
+    emitter.push64(R12D);
+    emitter.push64(R13D);
+    emitter.push64(R14D);
+    emitter.push64(R15D);
+    emitter.sub_rsp(8);
+    emitter.mov64(EBX, EDI);
+    emitter.load(R12D, EBX, CTX(flags));
+    emitter.load(R13D, EBX, CTX(cycles_left));
+    emitter.jmp64(ESI);
+
+    trampoline_exit = emitter.position();
+    emitter.store(EBX, CTX(flags), R12D);
+    emitter.store(EBX, CTX(cycles_left), R13D);
+    emitter.add_rsp(8);
+    emitter.pop64(R15D);
+    emitter.pop64(R14D);
+    emitter.pop64(R13D);
+    emitter.pop64(R12D);
+    emitter.pop64(EBP);
+    emitter.pop64(EBX);
+    emitter.ret();
+
+    blocks_start = emitter.position();
+}
+
+// The code buffer is either writable (while code is emitted or patched) or executable, never both
+void Jit::set_writable(bool writable) {
+    int protection = writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC);
+    if (mprotect(code_buffer, CODE_BUFFER_SZ, protection) != 0)
+        ExitHelper::error("Error: Could not change the protection of the JIT code buffer\n");
+}
+
+// Discard all compiled blocks
+void Jit::flush() {
+    emitter.set_position(blocks_start);
+    std::fill(blocks.begin(), blocks.end(), nullptr);
+    std::fill(std::begin(ctx->chain_table), std::end(ctx->chain_table), nullptr);
+    pending_links.clear();
+}
+
+
+
+// COMPILATION
+
+// Compile the block starting at an address. Returns nullptr if it can't be compiled
+const byte *Jit::compile(word start) {
+    collect_block(start);
+    if (block.empty()) return nullptr;
+    if (!emitter.has_room(MAX_BLOCK_BYTES)) flush();
+    set_writable(true);
+
+    analyze_flags();
+    allocate_registers();
+    side_exits.clear();
+
+    int32_t cycles = 0;
+    for (const Instr& instr : block) cycles += instr.d.cycles();
+    auto n_instrs = uint32_t(block.size());
+
+    // Leave if the whole block can't be run
+    size_t entry = emitter.position();
+    emitter.alu(CMP, R13D, uint32_t(cycles));
+    size_t no_cycles = emitter.jcc(CC_L);
+    emitter.alu(SUB, R13D, uint32_t(cycles));
+    emitter.alu(ADD, EBX, CTX(instructions), n_instrs);
+    for (byte reg = 1; reg < 16; reg++)
+        if (host_reg[reg] != NO_REG) emitter.load(host_reg[reg], EBX, CTX(regs) + 4*reg);
+
+    for (size_t i = 0; i < block.size(); i++) emit_instr(i);
+    // The block has been cut before an instruction that can't be compiled
+    const Instr& last = block.back();
+    if (last.d.op < DecodedInstr::OP_JMP) exit_static(last.PC + 1);
+
+    // Out of line exits
+    emitter.patch_rel32(no_cycles, emitter.position());
+    emitter.store(EBX, CTX(PC), uint32_t(start));
+    emitter.jmp_to(trampoline_exit);
+
+    for (auto [site, index] : side_exits) {
+        emitter.patch_rel32(site, emitter.position());
+        store_allocated();
+        // Give back the cycles and instructions that haven't been executed
+        int32_t unused_cycles = 0;
+        for (size_t i = index; i < block.size(); i++) unused_cycles += block[i].d.cycles();
+        emitter.alu(ADD, R13D, uint32_t(unused_cycles));
+        emitter.alu(SUB, EBX, CTX(instructions), uint32_t(block.size() - index));
+        emitter.store(EBX, CTX(PC), uint32_t(block[index].PC));
+        emitter.jmp_to(trampoline_exit);
+    }
+
+    const byte *code = emitter.address(entry);
+    blocks[start] = code;
+    block_cycles[start] = cycles;
+    if (!stop_at[start]) {
+        ctx->chain_table[start] = code;
+        // Link the blocks that were waiting for this one
+        if (auto it = pending_links.find(start); it != pending_links.end()) {
+            for (size_t site : it->second) emitter.patch_rel32(site, entry);
+            pending_links.erase(it);
+        }
+    }
+    set_writable(false);
+    return code;
+}
+
+// Fill the block with the instructions that will be compiled
+void Jit::collect_block(word start) {
+    block.clear();
+    for (word PC = start; block.size() < MAX_BLOCK_INSTRS; PC++) {
+        if (PC == 0xFFFF) break; // Incrementing the PC would cause a trap
+        if (PC != start && stop_at[PC]) break;
+
+        // Only instructions that the interpreter has already decoded (and executed) are compiled
+        const DecodedInstr& d = cpu.rom_cache[PC];
+        if (d.op == DecodedInstr::OP_NONE || !is_compilable(d)) break;
+
+        Instr instr{PC, d, 0, 0, false};
+        bool is_terminator = false;
+        if (d.op < DecodedInstr::OP_SHFT) {
+            // ALU operations. Memory operands with direct addressing never access MMIO
+            if (d.funct != 0b000) instr.flags_written = ALL_FLAGS;
+            if (d.funct >= 0b110) instr.flags_read = FLAG_C; // addc, subb
+            instr.may_exit = (d.op >= DecodedInstr::OP_ALU_M_OP) && (d.mode != 0b00);
+        }
+        else if (d.op < DecodedInstr::OP_MEM) {
+            // Shifts (sll by 0 doesn't modify the flags)
+            if (d.funct == 0b01) instr.flags_written = (d.mode > 0) ? ALL_FLAGS : 0;
+            else instr.flags_written = FLAG_Z | FLAG_S;
+        }
+        else if (d.op < DecodedInstr::OP_JMP) {
+            // Memory operations: all of them except peek can access MMIO or overflow the SP
+            byte operation = d.op - DecodedInstr::OP_MEM;
+            instr.may_exit = (operation != 0b00010 && operation != 0b00011);
+            if (operation == 0b00110) instr.flags_read = ALL_FLAGS;     // pushf
+            if (operation == 0b01000) instr.flags_written = ALL_FLAGS;  // popf
+        }
+        else if (d.op < DecodedInstr::OP_CALL) {
+            if (d.funct != 0b0000) instr.flags_read = ALL_FLAGS;
+            is_terminator = true;
+        }
+        else {
+            // call, ret
+            instr.may_exit = true;
+            is_terminator = true;
+        }
+
+        block.push_back(instr);
+        if (is_terminator) break;
+    }
+}
+
+// Returns true if the JIT can compile an instruction
+bool Jit::is_compilable(const DecodedInstr& d) const {
+    if (d.op < DecodedInstr::OP_ALU_M_OP) return true;
+    if (d.op < DecodedInstr::OP_SHFT) return d.mode != 0b00 || d.argument < MMIO_START;
+    if (d.op < DecodedInstr::OP_MEM) return true;
+    if (d.op == DecodedInstr::OP_MEM) return false; // movb
+    if (d.op < DecodedInstr::OP_JMP) return true;
+    if (d.op < DecodedInstr::OP_CALL) return d.funct <= 0b1110; // Valid jump condition
+    // syscall, enter, sysret and exit switch between ROM and RAM
+    return d.op == DecodedInstr::OP_CALL || d.op == DecodedInstr::OP_RET;
+}
+
+// Find which instructions need to compute their flags (the flags are overwritten before being read)
+void Jit::analyze_flags() {
+    byte live = ALL_FLAGS; // All flags are visible after the block
+    for (size_t i = block.size(); i-- > 0;) {
+        Instr& instr = block[i];
+        instr.needs_flags = (instr.flags_written & live) != 0;
+        live = (live & ~instr.flags_written) | instr.flags_read;
+        // The flags must be up to date when leaving the generated code
+        if (instr.may_exit) live = ALL_FLAGS;
+    }
+}
+
+// Keep the most used registers of the block in host registers
+void Jit::allocate_registers() {
+    int uses[16] = {};
+    for (const Instr& instr : block) {
+        uses[instr.d.rD]++;
+        uses[instr.d.rA]++;
+        uses[instr.d.rB]++;
+        if (instr.may_exit) uses[1]++; // Stack operations
+    }
+    uses[0] = 0; // The zero register is never allocated
+
+    std::fill(std::begin(host_reg), std::end(host_reg), NO_REG);
+    for (x86::Reg host : {EBP, R14D, R15D}) {
+        byte best = 0;
+        for (byte reg = 1; reg < 16; reg++)
+            if (uses[reg] > uses[best]) best = reg;
+        if (uses[best] < 2) break;
+        host_reg[best] = host;
+        uses[best] = 0;
+    }
+}
+
+
+
+// CODE GENERATION
+
+void Jit::load_reg(x86::Reg dst, byte reg) {
+    if (reg == 0) emitter.mov(dst, 0u);
+    else if (host_reg[reg] != NO_REG) emitter.mov(dst, host_reg[reg]);
+    else emitter.load(dst, EBX, CTX(regs) + 4*reg);
+}
+
+void Jit::store_reg(byte reg, x86::Reg src) {
+    if (reg == 0) return; // Writes to the zero register are ignored
+    if (host_reg[reg] != NO_REG) emitter.mov(host_reg[reg], src);
+    else emitter.store(EBX, CTX(regs) + 4*reg, src);
+}
+
+// Write the allocated registers back into the context
+void Jit::store_allocated() {
+    for (byte reg = 1; reg < 16; reg++)
+        if (host_reg[reg] != NO_REG) emitter.store(EBX, CTX(regs) + 4*reg, host_reg[reg]);
+}
+
+// Leave the generated code before executing instruction index (if the condition is met)
+void Jit::side_exit(Cond cc, size_t index) {
+    side_exits.emplace_back(emitter.jcc(cc), index);
+}
+
+// Continue at a known address: jump to its block, or leave the generated code if there is none yet
+void Jit::exit_static(word target) {
+    store_allocated();
+    if (!stop_at[target]) {
+        if (const byte *code = ctx->chain_table[target]) {
+            emitter.jmp_to(size_t(code - code_buffer));
+            return;
+        }
+        // Initially jumps to the next instruction, patched when the target is compiled
+        pending_links[target].push_back(emitter.jmp());
+    }
+    emitter.store(EBX, CTX(PC), uint32_t(target));
+    emitter.jmp_to(trampoline_exit);
+}
+
+// Continue at the address stored in EAX
+void Jit::exit_indirect() {
+    store_allocated();
+    emitter.mov(EAX, EAX); // Clear the upper bits of RAX
+    emitter.store(EBX, CTX(PC), EAX);
+    emitter.load64_index8(ECX, EBX, EAX, CTX(chain_table));
+    emitter.test64(ECX, ECX);
+    emitter.jcc_to(CC_Z, trampoline_exit);
+    emitter.jmp64(ECX);
+}
+
+// Call a helper with the address in ESI, the result is returned in EAX
+void Jit::call_helper(uint32_t (*helper)(CPU*, uint32_t)) {
+    emitter.load64(EDI, EBX, CTX(cpu));
+    emitter.mov64(EAX, reinterpret_cast<uint64_t>(helper));
+    emitter.call64(EAX);
+}
+
+// Write EDX into RAM at the address in ESI
+void Jit::call_write_RAM() {
+    emitter.load64(EDI, EBX, CTX(cpu));
+    emitter.mov64(EAX, reinterpret_cast<uint64_t>(&write_RAM));
+    emitter.call64(EAX);
+}
+
+
+// ALU operation: EDX = EDX op ECX. Uses EAX, ESI and EDI
+void Jit::emit_ALU(byte funct, bool set_flags) {
+    switch (funct) {
+    case 0b000: // mov
+        emitter.mov(EDX, ECX);
+        return;
+
+    case 0b001: // and
+    case 0b010: // or
+    case 0b011: // xor
+        // The overflow flag depends on the operands
+        if (set_flags) {
+            emitter.mov(ESI, EDX);
+            emitter.mov(EDI, EDX);
+            emitter.alu(XOR, EDI, ECX);
+        }
+        emitter.alu16((funct == 0b001) ? AND : (funct == 0b010) ? OR : XOR, EDX, ECX);
+        if (set_flags) emit_logic_flags();
+        return;
+
+    case 0b100: emitter.alu16(ADD, EDX, ECX); break;
+    case 0b101: emitter.alu16(SUB, EDX, ECX); break;
+    case 0b110: // addc
+        emitter.bt(R12D, 1); // CF = C
+        emitter.alu16(ADC, EDX, ECX);
+        break;
+    default: // subb
+        emitter.bt(R12D, 1);
+        emitter.alu16(SBB, EDX, ECX);
+        break;
+    }
+    // For 16-bit operations, the flags of the host match the ones of the CPU (in sub, C is the borrow)
+    if (set_flags) emit_arith_flags();
+}
+
+// Set the flags after add/sub/addc/subb
+void Jit::emit_arith_flags() {
+    emitter.lahf();
+    emitter.setcc(CC_O, EAX);
+    emitter.movzx_ah(ECX);
+    emitter.load_u8(R12D, EBX, ECX, CTX(flag_table));
+    emitter.movzx8(EAX, EAX);
+    emitter.shift(SHL, EAX, 2);
+    emitter.alu(OR, R12D, EAX);
+}
+
+// Set the flags after and/or/xor. A is in ESI and A^B in EDI
+void Jit::emit_logic_flags() {
+    emitter.lahf();
+    emitter.movzx_ah(ECX);
+    emitter.load_u8(R12D, EBX, ECX, CTX(flag_table));
+    emitter.alu(OR, R12D, uint32_t(FLAG_C)); // The carry is always set in logical operations
+    // V = (A and B have the same sign) and (A and the result have different signs)
+    emitter.alu(XOR, ESI, EDX);
+    emitter.bit_not(EDI);
+    emitter.alu(AND, ESI, EDI);
+    emitter.alu(AND, ESI, 0x8000u);
+    emitter.shift(SHR, ESI, 13);
+    emitter.alu(OR, R12D, ESI);
+}
+
+// Set the Z and S flags after srl/sra (C and V are not modified)
+void Jit::emit_shift_flags() {
+    emitter.test16(EDX, EDX);
+    emitter.lahf();
+    emitter.movzx_ah(ECX);
+    emitter.load_u8(EAX, EBX, ECX, CTX(flag_table));
+    emitter.alu(AND, R12D, uint32_t(FLAG_C | FLAG_V));
+    emitter.alu(OR, R12D, EAX);
+}
+
+// Compute the address of a memory operand in ESI, and leave if it's in MMIO
+void Jit::emit_address(const Instr& instr, size_t index) {
+    const DecodedInstr& d = instr.d;
+    switch (d.mode) {
+    case 0b00: // Direct addressing (already checked when compiling)
+        emitter.mov(ESI, uint32_t(d.argument));
+        return;
+    case 0b01: // Indirect addressing: rB for operands, rA for destinations
+        load_reg(ESI, (d.op < DecodedInstr::OP_ALU_M_DEST) ? d.rB : d.rA);
+        break;
+    case 0b10: // Indexed addressing: rA+imm
+        load_reg(ESI, d.rA);
+        emitter.alu(ADD, ESI, uint32_t(d.argument));
+        emitter.movzx16(ESI, ESI);
+        break;
+    default: // Indexed addressing: rA+rB
+        load_reg(ESI, d.rA);
+        load_reg(ECX, d.rB);
+        emitter.alu(ADD, ESI, ECX);
+        emitter.movzx16(ESI, ESI);
+        break;
+    }
+    emitter.alu(CMP, ESI, MMIO_START);
+    side_exit(CC_NC, index);
+}
+
+
+void Jit::emit_instr(size_t index) {
+    const Instr& instr = block[index];
+    auto op = instr.d.op;
+    if (op < DecodedInstr::OP_ALU_M_OP) emit_ALU_reg(instr);
+    else if (op < DecodedInstr::OP_ALU_M_DEST) emit_ALU_m_op(instr, index);
+    else if (op < DecodedInstr::OP_SHFT) emit_ALU_m_dest(instr, index);
+    else if (op < DecodedInstr::OP_MEM) emit_SHFT(instr);
+    else if (op < DecodedInstr::OP_JMP) emit_MEM(instr, index);
+    else if (op < DecodedInstr::OP_CALL) emit_JMP(instr);
+    else if (op == DecodedInstr::OP_CALL) emit_CALL(instr, index);
+    else emit_RET(index);
+}
+
+// ALU operation (operands in registers)
+void Jit::emit_ALU_reg(const Instr& instr) {
+    const DecodedInstr& d = instr.d;
+    if (d.funct == 0b000) {
+        // mov: copy the operand directly
+        if (d.mode) emitter.mov(EDX, uint32_t(d.argument));
+        else load_reg(EDX, d.rB);
+    }
+    else {
+        load_reg(EDX, d.rA);
+        if (d.mode) emitter.mov(ECX, uint32_t(d.argument));
+        else load_reg(ECX, d.rB);
+        emit_ALU(d.funct, instr.needs_flags);
+    }
+    store_reg(d.rD, EDX);
+}
+
+// ALU operation (operand in memory)
+void Jit::emit_ALU_m_op(const Instr& instr, size_t index) {
+    const DecodedInstr& d = instr.d;
+    emit_address(instr, index);
+    call_helper(&read_RAM);
+    emitter.mov(ECX, EAX);
+    // Direct and indirect modes use rA as the first operand, indexed modes use rD
+    load_reg(EDX, (d.mode < 0b10) ? d.rA : d.rD);
+    emit_ALU(d.funct, instr.needs_flags);
+    store_reg(d.rD, EDX);
+}
+
+// ALU operation (destination in memory, with register or immediate operand)
+void Jit::emit_ALU_m_dest(const Instr& instr, size_t index) {
+    const DecodedInstr& d = instr.d;
+    emit_address(instr, index);
+    emitter.store(ESP, 0, ESI);
+    // mov doesn't need the old value
+    if (d.funct != 0b000) {
+        call_helper(&read_RAM);
+        emitter.mov(EDX, EAX);
+    }
+    if (d.op >= DecodedInstr::OP_ALU_MEM_IMM) {
+        // Imm16 in indirect mode, imm4 otherwise
+        emitter.mov(ECX, uint32_t((d.mode == 0b01) ? d.argument : d.rD));
+    }
+    else {
+        byte reg = (d.mode == 0b00) ? d.rA : (d.mode == 0b01) ? d.rB : d.rD;
+        load_reg(ECX, reg);
+    }
+    emit_ALU(d.funct, instr.needs_flags);
+    emitter.load(ESI, ESP, 0);
+    call_write_RAM();
+}
+
+// Bit shift
+void Jit::emit_SHFT(const Instr& instr) {
+    const DecodedInstr& d = instr.d;
+    byte shamt = d.mode;
+    load_reg(EDX, d.rA);
+
+    if (d.funct == 0b01) {
+        // sll: the flags are the ones of the last addition (result + result)
+        if (shamt > 0) {
+            if (shamt > 1) emitter.shift16(SHL, EDX, shamt - 1);
+            emitter.alu16(ADD, EDX, EDX);
+            if (instr.needs_flags) emit_arith_flags();
+        }
+    }
+    else {
+        if (shamt > 0) emitter.shift16((d.funct == 0b10) ? SHR : SAR, EDX, shamt);
+        if (instr.needs_flags) emit_shift_flags();
+    }
+    store_reg(d.rD, EDX);
+}
+
+// Memory operations (except movb)
+void Jit::emit_MEM(const Instr& instr, size_t index) {
+    const DecodedInstr& d = instr.d;
+    switch (d.op - DecodedInstr::OP_MEM) {
+    case 0b00001: // swap
+        load_reg(ESI, d.rA);
+        emitter.alu(ADD, ESI, uint32_t(d.argument));
+        emitter.movzx16(ESI, ESI);
+        emitter.alu(CMP, ESI, MMIO_START);
+        side_exit(CC_NC, index);
+        emitter.store(ESP, 0, ESI);
+        call_helper(&read_RAM);
+        load_reg(EDX, d.rD);
+        store_reg(d.rD, EAX);
+        emitter.load(ESI, ESP, 0);
+        call_write_RAM();
+        break;
+
+    case 0b00010: // peek (LSB/argument)
+    case 0b00011: // peek (MSB/opcode)
+        load_reg(ESI, d.rA);
+        emitter.alu(ADD, ESI, uint32_t(d.argument));
+        emitter.movzx16(ESI, ESI);
+        call_helper((d.op == DecodedInstr::OP_MEM + 0b00010) ? &read_ROM_L : &read_ROM_H);
+        store_reg(d.rD, EAX);
+        break;
+
+    case 0b00100: // push (reg)
+        load_reg(EDX, d.rB);
+        emit_push(index);
+        break;
+    case 0b00101: // push (imm)
+        emitter.mov(EDX, uint32_t(d.argument));
+        emit_push(index);
+        break;
+    case 0b00110: // pushf
+        emitter.mov(EDX, R12D);
+        emit_push(index);
+        break;
+
+    case 0b00111: // pop
+        emit_pop(index, false);
+        store_reg(d.rD, EAX);
+        break;
+    default: // popf
+        emit_pop(index, true);
+        emitter.mov(R12D, EAX);
+        emitter.alu(AND, R12D, uint32_t(ALL_FLAGS));
+        break;
+    }
+}
+
+// Push EDX into the stack
+void Jit::emit_push(size_t index) {
+    load_reg(ESI, 1);
+    emitter.alu(SUB, ESI, 1u);
+    // Also catches SP overflow (0 - 1 = 0xFFFFFFFF)
+    emitter.alu(CMP, ESI, MMIO_START);
+    side_exit(CC_NC, index);
+    store_reg(1, ESI);
+    call_write_RAM();
+}
+
+// Pop from the stack into EAX. For popf, leave if the top bits of the flags are set (assert)
+void Jit::emit_pop(size_t index, bool is_popf) {
+    load_reg(ESI, 1);
+    // Also catches SP overflow (0xFFFF + 1)
+    emitter.alu(CMP, ESI, MMIO_START);
+    side_exit(CC_NC, index);
+    call_helper(&read_RAM);
+    if (is_popf) {
+        emitter.mov(ECX, EAX);
+        emitter.alu(AND, ECX, 0xF0u);
+        side_exit(CC_NZ, index);
+    }
+    load_reg(ECX, 1);
+    emitter.alu(ADD, ECX, 1u);
+    store_reg(1, ECX);
+}
+
+// Jump (ends the block)
+void Jit::emit_JMP(const Instr& instr) {
+    const DecodedInstr& d = instr.d;
+    size_t not_taken = 0;
+    if (d.funct != 0b0000) {
+        // CF = bit of the truth table selected by the flags
+        emitter.mov(EAX, condition_masks[d.funct]);
+        emitter.bt(EAX, R12D);
+        not_taken = emitter.jcc(CC_NC);
+    }
+
+    if (d.mode) exit_static(d.argument);
+    else {
+        load_reg(EAX, d.rA);
+        exit_indirect();
+    }
+
+    if (d.funct != 0b0000) {
+        emitter.patch_rel32(not_taken, emitter.position());
+        exit_static(instr.PC + 1);
+    }
+}
+
+// call (ends the block)
+void Jit::emit_CALL(const Instr& instr, size_t index) {
+    const DecodedInstr& d = instr.d;
+    // The destination register is read before the push
+    if (d.mode == 0) {
+        load_reg(EAX, d.rB);
+        emitter.store(ESP, 4, EAX);
+    }
+    emitter.mov(EDX, uint32_t(instr.PC + 1));
+    emit_push(index);
+
+    if (d.mode) exit_static(d.argument);
+    else {
+        emitter.load(EAX, ESP, 4);
+        exit_indirect();
+    }
+}
+
+// ret (ends the block)
+void Jit::emit_RET(size_t index) {
+    emit_pop(index, false);
+    exit_indirect();
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "../Globals.h"
+#include "../DecodeCache.h"
+#include "X86Emitter.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/*  JIT compiler for x86-64 hosts:
+    Hot basic blocks of ROM code are translated into native code. A block ends at a jump, call or
+    ret, or before an instruction that can't be compiled (which is then run by the interpreter).
+    Inside a block, the flags are kept in R12D and the most used registers in EBP, R14D and R15D.
+    Blocks are linked directly to each other, so loops run without leaving the generated code.
+
+    A block is only entered if it fits in the remaining cycle budget (which is also limited by the
+    next device event, see EventQueue::max_tick), so no interrupt can be triggered in the middle of it. Instructions
+    that access MMIO or cause a trap leave the generated code before doing anything, and are
+    then executed by the interpreter. This way, cycle counts and errors match the other engines.
+*/
+
+class CPU;
+
+class Jit {
+public:
+    // Clock cycles and instructions executed by run()
+    struct Result {
+        int32_t cycles = 0;
+        int32_t instructions = 0;
+    };
+
+    explicit Jit(CPU& cpu);
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // Run the compiled code starting at the current PC (the CPU must be in ROM) for at most
+    // max_cycles. If no block could be run, returns 0 cycles and the CPU is not modified
+    Result run(int32_t max_cycles);
+
+private:
+    // State shared with the generated code, which accesses it relative to RBX
+    struct Context {
+        uint32_t regs[16];          // Register file (zero-extended)
+        uint32_t flags;             // Same format as CPU::FLG
+        int32_t cycles_left;        // Cycles that can still be run
+        int32_t instructions;       // Executed instructions
+        uint32_t PC;                // Address of the next instruction, when leaving the generated code
+        CPU *cpu;                   // Passed to the helper functions
+        byte flag_table[256];       // Converts AH (after LAHF) to the Z, C and S flags
+        const byte *chain_table[0x10000];   // Block that indirect jumps can link to (nullptr if none)
+    };
+
+    // Instruction of the block being compiled
+    struct Instr {
+        word PC;
+        DecodedInstr d;
+        byte flags_read;            // Flags read by the instruction (same bits as CPU::FLG)
+        byte flags_written;         // Flags written by the instruction
+        bool may_exit;              // True if the instruction can leave the generated code
+        bool needs_flags = true;    // True if the written flags are read later (or leave the block)
+    };
+
+    // Function that enters the generated code (ctx in RDI, block in RSI)
+    using EntryFunction = void (*)(Context *ctx, const byte *block);
+
+    CPU& cpu;
+    std::unique_ptr<Context> ctx;
+
+    // Executable memory (only writable while a block is compiled, see set_writable)
+    byte *code_buffer;
+    x86::Emitter emitter;
+    size_t trampoline_exit;     // Position of the code that leaves the generated code
+    size_t blocks_start;        // Position of the first compiled block
+
+    // Compiled blocks, indexed by their first address
+    std::vector<const byte*> blocks;
+    std::vector<int32_t> block_cycles;
+    // How many times each address has been reached without a compiled block
+    std::vector<uint16_t> hit_count;
+    // Addresses where no block can start
+    std::vector<bool> not_compilable;
+    // Breakpoints and exit points: no block can continue past them
+    std::vector<bool> stop_at;
+    // Jumps to blocks that haven't been compiled yet (target address -> positions of rel32 fields)
+    std::unordered_map<word, std::vector<size_t>> pending_links;
+    // Truth table of each jump condition, indexed by the value of the flags
+    uint32_t condition_masks[15];
+
+    // State of the block being compiled
+    std::vector<Instr> block;
+    x86::Reg host_reg[16];      // Host register of each CPU register (NO_REG if kept in ctx)
+    std::vector<std::pair<size_t, size_t>> side_exits; // Position of rel32 field, instruction index
+
+    static constexpr x86::Reg NO_REG = x86::ESP;
+    static constexpr size_t CODE_BUFFER_SZ = 16 << 20;
+    static constexpr size_t MAX_BLOCK_INSTRS = 64;
+    static constexpr size_t MAX_BLOCK_BYTES = 32 << 10;
+    static constexpr uint16_t HOT_THRESHOLD = 32;
+
+    // Helper functions called by the generated code
+    static uint32_t read_RAM(CPU *cpu, uint32_t address);
+    static void write_RAM(CPU *cpu, uint32_t address, uint32_t value);
+    static uint32_t read_ROM_L(CPU *cpu, uint32_t address);
+    static uint32_t read_ROM_H(CPU *cpu, uint32_t address);
+
+    // Generate the code that enters and leaves the compiled blocks
+    void emit_trampoline();
+    // Switch the code buffer between writable and executable
+    void set_writable(bool writable);
+    // Discard all compiled blocks
+    void flush();
+
+    // Compile the block starting at an address. Returns nullptr if it can't be compiled
+    const byte *compile(word start);
+    // Fill the block with the instructions that will be compiled
+    void collect_block(word start);
+    bool is_compilable(const DecodedInstr& d) const;
+    void analyze_flags();
+    void allocate_registers();
+
+    // Code generation
+    void load_reg(x86::Reg dst, byte reg);
+    void store_reg(byte reg, x86::Reg src);
+    void store_allocated();
+    void side_exit(x86::Cond cc, size_t index);
+    void exit_static(word target);
+    void exit_indirect();   // Target in EAX
+    void call_helper(uint32_t (*helper)(CPU*, uint32_t));
+    void call_write_RAM();  // Address in ESI, value in EDX
+
+    void emit_ALU(byte funct, bool set_flags);
+    void emit_arith_flags();
+    void emit_logic_flags();
+    void emit_shift_flags();
+    void emit_address(const Instr& instr, size_t index);
+
+    void emit_instr(size_t index);
+    void emit_ALU_reg(const Instr& instr);
+    void emit_ALU_m_op(const Instr& instr, size_t index);
+    void emit_ALU_m_dest(const Instr& instr, size_t index);
+    void emit_SHFT(const Instr& instr);
+    void emit_MEM(const Instr& instr, size_t index);
+    void emit_push(size_t index);
+    void emit_pop(size_t index, bool is_popf);
+    void emit_JMP(const Instr& instr);
+    void emit_CALL(const Instr& instr, size_t index);
+    void emit_RET(size_t index);
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "../Globals.h"
+
+#include <cstring>
+
+// Minimal x86-64 machine code emitter, with only the instructions used by the JIT compiler.
+// Unless stated otherwise, operations are 32-bit (which zero-extends the result to 64 bits).
+namespace x86 {
+
+enum Reg : byte {
+    EAX = 0, ECX, EDX, EBX, ESP, EBP, ESI, EDI,
+    R8D, R9D, R10D, R11D, R12D, R13D, R14D, R15D
+};
+
+// Extension of the opcode (reg field of ModRM) for the immediate ALU and shift groups
+enum AluExt : byte { ADD = 0, OR = 1, ADC = 2, SBB = 3, AND = 4, SUB = 5, XOR = 6, CMP = 7 };
+enum ShiftExt : byte { SHL = 4, SHR = 5, SAR = 7 };
+
+// Condition codes
+enum Cond : byte {
+    CC_O = 0x0, CC_NO = 0x1, CC_C = 0x2, CC_NC = 0x3, CC_Z = 0x4, CC_NZ = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_S = 0x8, CC_NS = 0x9, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+};
+
+
+class Emitter {
+private:
+    byte *buffer;
+    size_t capacity;
+    size_t pos = 0;
+
+    void rex(bool w, byte reg, byte index, byte base, bool force = false) {
+        byte value = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+        if (value != 0x40 || force) emit8(value);
+    }
+    void modrm(byte mod, byte reg, byte rm) {
+        emit8(byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+    }
+    // [base + disp32] operand (base can't be RIP-relative)
+    void mem_operand(byte reg, Reg base, int32_t disp) {
+        modrm(0b10, reg, base);
+        if ((base & 7) == ESP) emit8(0x24); // SIB: no index
+        emit32(disp);
+    }
+    // [base + index*scale + disp32] operand
+    void sib_operand(byte reg, Reg base, Reg index, byte scale_log2, int32_t disp) {
+        modrm(0b10, reg, 0b100);
+        emit8(byte((scale_log2 << 6) | ((index & 7) << 3) | (base & 7)));
+        emit32(disp);
+    }
+
+public:
+    Emitter(byte *buf, size_t size) : buffer(buf), capacity(size) {}
+
+    size_t position() const { return pos; }
+    void set_position(size_t p) { pos = p; }
+    byte *address(size_t p) const { return buffer + p; }
+    // True if there is room for at least n more bytes
+    bool has_room(size_t n) const { return pos + n <= capacity; }
+
+    void emit8(byte b) { buffer[pos++] = b; }
+    void emit32(uint32_t v) { std::memcpy(buffer + pos, &v, 4); pos += 4; }
+    void emit64(uint64_t v) { std::memcpy(buffer + pos, &v, 8); pos += 8; }
+
+    // Make the rel32 field at position site jump to position target
+    void patch_rel32(size_t site, size_t target) {
+        auto rel = int32_t(int64_t(target) - int64_t(site + 4));
+        std::memcpy(buffer + site, &rel, 4);
+    }
+
+    // MOVES
+
+    void mov(Reg dst, Reg src) { rex(false, src, 0, dst); emit8(0x89); modrm(0b11, src, dst); }
+    void mov(Reg dst, uint32_t imm) { rex(false, 0, 0, dst); emit8(0xB8 + (dst & 7)); emit32(imm); }
+    void load(Reg dst, Reg base, int32_t disp) { rex(false, dst, 0, base); emit8(0x8B); mem_operand(dst, base, disp); }
+    void store(Reg base, int32_t disp, Reg src) { rex(false, src, 0, base); emit8(0x89); mem_operand(src, base, disp); }
+    void store(Reg base, int32_t disp, uint32_t imm) { rex(false, 0, 0, base); emit8(0xC7); mem_operand(0, base, disp); emit32(imm); }
+    // dst = zero-extended byte at [base + index + disp]
+    void load_u8(Reg dst, Reg base, Reg index, int32_t disp) {
+        rex(false, dst, index, base); emit8(0x0F); emit8(0xB6); sib_operand(dst, base, index, 0, disp);
+    }
+    void movzx8(Reg dst, Reg src) { rex(false, dst, 0, src, src >= ESP); emit8(0x0F); emit8(0xB6); modrm(0b11, dst, src); }
+    void movzx16(Reg dst, Reg src) { rex(false, dst, 0, src); emit8(0x0F); emit8(0xB7); modrm(0b11, dst, src); }
+    // dst = AH (dst must be one of the 8 legacy registers)
+    void movzx_ah(Reg dst) { emit8(0x0F); emit8(0xB6); modrm(0b11, dst, 0b100); }
+
+    // 64-bit moves
+    void mov64(Reg dst, Reg src) { rex(true, src, 0, dst); emit8(0x89); modrm(0b11, src, dst); }
+    void mov64(Reg dst, uint64_t imm) { rex(true, 0, 0, dst); emit8(0xB8 + (dst & 7)); emit64(imm); }
+    void load64(Reg dst, Reg base, int32_t disp) { rex(true, dst, 0, base); emit8(0x8B); mem_operand(dst, base, disp); }
+    // dst = [base + index*8 + disp]
+    void load64_index8(Reg dst, Reg base, Reg index, int32_t disp) {
+        rex(true, dst, index, base); emit8(0x8B); sib_operand(dst, base, index, 3, disp);
+    }
+
+    // ARITHMETIC AND LOGIC
+
+    // 16-bit ALU operation: dst = dst OP src (sets the flags of a 16-bit operation)
+    void alu16(AluExt op, Reg dst, Reg src) {
+        emit8(0x66); rex(false, src, 0, dst); emit8(byte(op << 3) | 0x01); modrm(0b11, src, dst);
+    }
+    void alu(AluExt op, Reg dst, Reg src) { rex(false, src, 0, dst); emit8(byte(op << 3) | 0x01); modrm(0b11, src, dst); }
+    void alu(AluExt op, Reg dst, uint32_t imm) { rex(false, 0, 0, dst); emit8(0x81); modrm(0b11, op, dst); emit32(imm); }
+    void alu(AluExt op, Reg base, int32_t disp, uint32_t imm) { rex(false, 0, 0, base); emit8(0x81); mem_operand(op, base, disp); emit32(imm); }
+    void shift16(ShiftExt op, Reg dst, byte amount) {
+        emit8(0x66); rex(false, 0, 0, dst); emit8(0xC1); modrm(0b11, op, dst); emit8(amount);
+    }
+    void shift(ShiftExt op, Reg dst, byte amount) { rex(false, 0, 0, dst); emit8(0xC1); modrm(0b11, op, dst); emit8(amount); }
+    void test16(Reg a, Reg b) { emit8(0x66); rex(false, b, 0, a); emit8(0x85); modrm(0b11, b, a); }
+    void test64(Reg a, Reg b) { rex(true, b, 0, a); emit8(0x85); modrm(0b11, b, a); }
+    void bit_not(Reg dst) { rex(false, 0, 0, dst); emit8(0xF7); modrm(0b11, 2, dst); }
+    // CF = bit of base selected by index (or by an immediate)
+    void bt(Reg base, Reg index) { rex(false, index, 0, base); emit8(0x0F); emit8(0xA3); modrm(0b11, index, base); }
+    void bt(Reg base, byte bit) { rex(false, 0, 0, base); emit8(0x0F); emit8(0xBA); modrm(0b11, 4, base); emit8(bit); }
+    // Load SF, ZF, AF, PF and CF into AH
+    void lahf() { emit8(0x9F); }
+    void setcc(Cond cc, Reg dst) { rex(false, 0, 0, dst, dst >= ESP); emit8(0x0F); emit8(0x90 + cc); modrm(0b11, 0, dst); }
+
+    // CONTROL FLOW
+
+    // Emit a jump with an unknown target, returns the position of its rel32 field
+    size_t jmp() { emit8(0xE9); emit32(0); return pos - 4; }
+    size_t jcc(Cond cc) { emit8(0x0F); emit8(0x80 + cc); emit32(0); return pos - 4; }
+    void jmp_to(size_t target) { patch_rel32(jmp(), target); }
+    void jcc_to(Cond cc, size_t target) { patch_rel32(jcc(cc), target); }
+    void jmp64(Reg target) { rex(false, 0, 0, target); emit8(0xFF); modrm(0b11, 4, target); }
+    void call64(Reg target) { rex(false, 0, 0, target); emit8(0xFF); modrm(0b11, 2, target); }
+    void push64(Reg r) { rex(false, 0, 0, r); emit8(0x50 + (r & 7)); }
+    void pop64(Reg r) { rex(false, 0, 0, r); emit8(0x58 + (r & 7)); }
+    void add_rsp(int8_t amount) { emit8(0x48); emit8(0x83); modrm(0b11, ADD, ESP); emit8(byte(amount)); }
+    void sub_rsp(int8_t amount) { emit8(0x48); emit8(0x83); modrm(0b11, SUB, ESP); emit8(byte(amount)); }
+    void ret() { emit8(0xC3); }
+};
+
+} // namespace x86
@@ -0,0 +1,37 @@
+#include "CpuCore.h"
+#include "Jit/Jit.h"
+
+#include <algorithm>
+
+/*  JIT engine:
+    Hot ROM code is compiled into native code (see Jit/Jit.h), everything else is interpreted like
+    in the default engine. The compiled code only runs when no event can happen in the middle of
+    it: no pending interrupt, no single step, and no device event before the end of the block.
+    While a hooked routine is being measured or validated, it's interpreted until it returns.
+    Then the whole block is accounted at once, which is equivalent to ticking after each instruction.
+*/
+
+// Run CPU for a number of clock cycles, using the JIT engine.
+// Returns how many extra cycles were needed to finish the last instruction.
+int32_t CPU::execute_jit(int32_t cycles) {
+    if (!jit) jit = std::make_unique<Jit>(*this);
+
+    while (cycles > 0) {
+        if (!user_mode && !IRQ && steps_left == 0 && !hook_call.active) {
+            Jit::Result result = jit->run(std::min(cycles, int32_t(events.max_tick())));
+            if (result.cycles > 0) {
+                cycles -= result.cycles;
+                if (end_instruction(result.cycles, result.instructions)) return 0;
+                continue;
+            }
+        }
+
+        int instructions;
+        int used_cycles = user_mode ? exec_next<true>(cycles, instructions) : exec_next<false>(cycles, instructions);
+        cycles -= used_cycles;
+        if (end_instruction(used_cycles, instructions)) return 0;
+    }
+
+    // If finishing an instruction took some extra cycles, return how many
+    return -cycles;
+}
@@ -3,22 +3,20 @@
 #include "Utilities/Assert.h"
 #include "Utilities/ExitHelper.h"
 
-#include <thread>
-
 int Globals::keyboard_delay = 0;
 
-Keyboard::Keyboard() {
+Keyboard::Keyboard(EventQueue& events) : events(events) {
     term = Terminal::get_instance();
 }
 
 // WRITE
 MemCell& Keyboard::operator=(word rhs) {
-    if (busy_flag != 0 && !Globals::strict_flg) {
+    if (busy_flag != 0 && !Globals::strict()) {
         // If strict mode is not enabled, warn when overwriting the controller input register
         throw EmulatorException("Keyboard/Serial: attempting to output while the controller was busy");
     }
     
-    if (rhs > 0x7F && !Globals::strict_flg) {
+    if (rhs > 0x7F && !Globals::strict()) {
         // If strict mode is not enabled, warn when written value is more than 7-bit long
         throw EmulatorException("Keyboard/Serial: Value written is bigger than 7 bit and will be truncated");
     }
@@ -38,15 +36,8 @@ MemCell& Keyboard::operator=(word rhs) {
     
     if (Globals::keyboard_delay > 0) {
         busy_flag = true; // Writing to the input register sets the busy flag
-        // Wait for some time and clear the flag
-        std::thread([this]() {
-            std::this_thread::sleep_for(std::chrono::microseconds(Globals::keyboard_delay));
-            
-            // Acquire exit lock to prevent segfault when the main thread is exiting
-            std::scoped_lock<std::mutex> lock(ExitHelper::get_exit_mutex());
-            
-            busy_flag = false;
-        }).detach();
+        // Clear the flag after some time
+        events.schedule_in(EventQueue::KEYBOARD_READY, EventQueue::us_to_cycles(Globals::keyboard_delay));
     }
     
     return *this;
@@ -54,14 +45,19 @@ MemCell& Keyboard::operator=(word rhs) {
 
 // READ
 Keyboard::operator word() const {    
-    assert(output_reg <= 0x7F);
+    debug_assert(output_reg <= 0x7F);
     return output_reg | word(int(busy_flag) << 7);
 }
 
 
-// Called periodically to check for new inputs. Returns true if an IRQ is triggered
-bool Keyboard::update() {    
-    term->update_input();
+// The controller has processed the last command
+void Keyboard::handle_event() {
+    busy_flag = false;
+}
+
+// Called by the CPU thread after each time slice to check for new inputs (received by the I/O thread).
+// Returns true if an IRQ is triggered
+bool Keyboard::update() {
     // If another char is being presented OR the CPU is in the service routine, don't do anything
     if (output_reg || !can_interrupt) return false;
     
@@ -2,6 +2,8 @@
 #include "Exceptions/EmulatorException.h"
 #include "Utilities/Assert.h"
 
+#include <algorithm>
+
 // BASIC MEMORY CELL
 
 // WRITE
@@ -16,67 +18,56 @@ MemCell::operator word() const {
 
 
 
-// REGISTER
-
-Reg::Reg(bool is_zero) : zero_reg(is_zero) { }
-
-// WRITE to register
-MemCell& Reg::operator=(word rhs) {
-    // Register zero is non-writable
-    if (zero_reg) return *this;
-    // Else, call base class
-    return MemCell::operator=(rhs);
-}
-
-
-
 // REGISTER FILE
 
-// When initializing the register file, set index 0 as the zero register
-Regfile::Regfile() {
-    registers[0] = Reg(true);
-}
-Reg& Regfile::ABI_A0() {
+word Regfile::ABI_A0() const {
     const int ABI_A0_idx = 12;
     assert(ABI_names[ABI_A0_idx] == "a0");
     return registers[ABI_A0_idx];
 }
-Reg& Regfile::operator[](byte addr) {
-    if (addr >= REGFILE_SZ) throw EmulatorException("Invalid regfile access");
-    return registers[addr];
-}
-
-
-// GENERIC MEMORY
-
-MemCell& Mem::operator[](word addr) { 
-    return data[addr];
-}
-
 
 
-// ROM
+// RAM
 
-using Rom = Mem;
+Ram::Ram(DecodeCache& cache, Trap& trap) : decode_cache(&cache), trap(&trap) { }
 
+// Map a device to count consecutive addresses of the MMIO range
+void Ram::map_device(word first, word count, MemCell& device) {
+    assert(count > 0 && first >= MMIO_START && uint32_t(first) + count <= 0x10000);
+    for (uint32_t addr = first; addr < uint32_t(first) + count; addr++) {
+        assert(devices[addr - MMIO_START] == nullptr);
+        devices[addr - MMIO_START] = &device;
+    }
+}
 
+// Copy count words from src to dst (the ranges can't overlap, and must be below MMIO)
+void Ram::copy(word dst, word src, word count) {
+    std::copy_n(data.begin() + src, count, data.begin() + dst);
+    for (uint32_t i = 0; i < count; i++) decode_cache->invalidate(dst + i);
+}
 
-// RAM
+// Write value to count words, starting at dst (the range must be below MMIO)
+void Ram::fill(word dst, word value, word count) {
+    std::fill_n(data.begin() + dst, count, value);
+    for (uint32_t i = 0; i < count; i++) decode_cache->invalidate(dst + i);
+}
 
-Ram::Ram(MemCell& p0, MemCell& p1, MemCell& p2, MemCell& p3) : 
-    port0(&p0), port1(&p1), port2(&p2), port3(&p3) { }
-    
-// Memory mapping of RAM and IO
-MemCell& Ram::operator[](word addr) { 
-    // 0000-FEFF: RAM
-    if (addr < 0xFF00) return Mem::operator[](addr);
+// Accesses to the addresses of the MMIO range without a device
+MemCell& Ram::unmapped() {
+    if (*trap == Trap::NONE) *trap = Trap::INVALID_MEMORY_ACCESS;
+    invalid_cell = 0; // Reads as 0 until the trap is reported
+    return invalid_cell;
+}
 
-    // FF00-FFFF: MMIO
-    switch (addr) {
-        case 0xFF00: return *port0;
-        case 0xFF40: return *port1;
-        case 0xFF80: return *port2;
-        case 0xFFC0: return *port3;
-        default: throw EmulatorException("Invalid memory access");
+// Writes to the MMIO range. A device throws an exception if it rejects the written value, which is
+// recorded as a trap (so that the instructions don't need to catch it)
+void Ram::write_mmio(word addr, word value) {
+    try {
+        mmio(addr) = value;
+    }
+    catch (const EmulatorException& e) {
+        if (*trap != Trap::NONE) return;
+        *trap = Trap::DEVICE_ERROR;
+        device_error = e.what();
     }
 }
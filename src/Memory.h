@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Globals.h"
+#include "DecodeCache.h"
+#include "Trap.h"
 
 #include <string>
 #include <array>
@@ -18,17 +20,6 @@ public:
 };
 
 
-class Reg : public MemCell {
-private:
-    bool zero_reg = false;
-
-public:
-    Reg() = default;
-    explicit Reg(bool is_zero);
-    // WRITE to register
-    MemCell& operator=(word rhs) override;
-};
-
 // Flags / Status register
 struct StatusFlags {
     bool Z : 1; // Zero flag
@@ -39,44 +30,121 @@ struct StatusFlags {
 
 
 
+// Register file: plain 16-bit words. Register zero is written like the others and cleared again
+// right after, so that writes don't need to check the destination
 class Regfile {
 private:
     const static byte REGFILE_SZ = 16;
-    std::array<Reg,REGFILE_SZ> registers;
+    std::array<word,REGFILE_SZ> registers{};
 
 public:
-    const std::array<std::string,REGFILE_SZ> ABI_names = {"zero", "sp", "bp", "s0", "s1", "s2", "s3", "s4",
+    static inline const std::array<std::string,REGFILE_SZ> ABI_names = {"zero", "sp", "bp", "s0", "s1", "s2", "s3", "s4",
         "t0", "t1", "t2", "t3", "a0", "a1", "a2", "a3"};
-    Reg& ABI_A0();
-    
-    Regfile();
-    Reg& operator[](byte addr);
+    word ABI_A0() const;
+
+    // READ. addr must be a 4-bit field of an instruction (not checked)
+    word operator[](byte addr) const {
+        return registers[addr];
+    }
+    // WRITE. Writes to register zero are discarded
+    void write(byte addr, word value) {
+        registers[addr] = value;
+        registers[0] = 0;
+    }
+    // Direct access to SP (never register zero)
+    word& stack_pointer() {
+        return registers[1];
+    }
 };
 
 
-class Mem {
+// ROM: 32-bit instruction words (only written when the ROM file is loaded). The opcode and the
+// argument of an instruction are stored together, so that they are fetched with a single load
+class Rom {
 private:
-    const static uint32_t MEM_SZ = 0x10000;
-    std::array<MemCell,MEM_SZ> data;
+    const static uint32_t ROM_SZ = 0x10000;
+    std::array<uint32_t,ROM_SZ> data{};
 
 public:
-    virtual ~Mem() = default;
-    virtual MemCell& operator[](word addr);
+    uint32_t operator[](word addr) const {
+        return data[addr];
+    }
+    // Upper 16 bits (opcode)
+    word high(word addr) const {
+        return word(data[addr] >> 16);
+    }
+    // Lower 16 bits (argument)
+    word low(word addr) const {
+        return word(data[addr]);
+    }
+    void write(word addr, word high, word low) {
+        data[addr] = (uint32_t(high) << 16) | low;
+    }
 };
 
 
-using Rom = Mem;
-
+// RAM: plain 16-bit words, except for the MMIO range (dispatched to the devices mapped there)
+class Ram {
+public:
+    const static uint32_t MMIO_START = 0xFF00;
 
-class Ram : public Mem {
 private:
-    // Pointers to the 4 memory-mapped GPIO ports
-    MemCell *port0;
-    MemCell *port1;
-    MemCell *port2;
-    MemCell *port3;
+    std::array<word,MMIO_START> data{};
+
+    // Device mapped at each address of the MMIO range (nullptr if none)
+    std::array<MemCell*,0x10000-MMIO_START> devices{};
+    
+    // Instructions decoded from RAM, invalidated when RAM is written
+    DecodeCache *decode_cache;
+
+    // Accesses to invalid addresses are recorded here (if no other trap has been recorded),
+    // and use a dummy cell
+    Trap *trap;
+    MemCell invalid_cell;
+    // Error message of the device write that caused a DEVICE_ERROR trap
+    std::string device_error;
+    
+    MemCell& mmio(word addr) {
+        MemCell *device = devices[addr - MMIO_START];
+        if (device != nullptr) return *device;
+        return unmapped();
+    }
+    MemCell& unmapped();
+    void write_mmio(word addr, word value);
 
 public:
-    Ram(MemCell& p0, MemCell& p1, MemCell& p2, MemCell& p3);
-    MemCell& operator[](word addr) override;
+    Ram(DecodeCache& cache, Trap& trap);
+
+    // Map a device to count consecutive addresses of the MMIO range, which all access the same cell.
+    // The addresses can't be already mapped
+    void map_device(word first, word count, MemCell& device);
+
+    // READ (doesn't invalidate any decoded instruction)
+    word read(word addr) {
+        if (addr < MMIO_START) return data[addr];
+        return mmio(addr);
+    }
+    // READ an address below MMIO_START (not checked), without accessing any device
+    word peek(word addr) const {
+        return data[addr];
+    }
+
+    // WRITE. Invalidates the decoded instructions that contain the address
+    void write(word addr, word value) {
+        if (addr < MMIO_START) {
+            data[addr] = value;
+            decode_cache->invalidate(addr);
+        }
+        else write_mmio(addr, value);
+    }
+
+    const std::string& get_device_error() const {
+        return device_error;
+    }
+
+    // Bulk writes (the words must be below MMIO). Invalidate the decoded instructions that contain them
+    // Copy count words from src to dst (the ranges can't overlap)
+    void copy(word dst, word src, word count);
+    // Write value to count words, starting at dst
+    void fill(word dst, word value, word count);
 };
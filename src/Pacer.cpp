@@ -0,0 +1,141 @@
+#include "Pacer.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+Pacer::Stats Pacer::stats;
+
+Pacer::Pacer(Mode mode) : mode(mode) {
+    stats.mode = mode;
+    if (mode == Mode::LOW_JITTER) set_up_low_jitter();
+    restart();
+}
+
+void Pacer::restart() {
+    origin = speed_start = clock::now();
+    cycles_since_origin = 0;
+    speed_cycles = 0;
+    stats.lag_ms = 0;
+}
+
+// Host time at which the emulated time of the cycles run since the origin is reached
+Pacer::clock::time_point Pacer::emulated_time() const {
+    double ns = double(cycles_since_origin) * 1e9 / double(Globals::CLK_freq);
+    return origin + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double,std::nano>(ns));
+}
+
+void Pacer::pace(uint64_t cycles, clock::duration busy_time) {
+    auto now = clock::now();
+    measure(cycles, busy_time, now);
+    if (mode == Mode::TURBO) return;
+
+    cycles_since_origin += cycles;
+    auto target = emulated_time();
+    if (target > now) {
+        // Ahead of the host: sleep (at low frequencies, only once enough sleep time has accumulated)
+        stats.lag_ms = 0;
+        if (mode == Mode::LOW_JITTER) {
+            wait_precisely(target);
+            record_error(clock::now() - target);
+        }
+        else if (mode == Mode::REALTIME || target - now >= std::chrono::microseconds(MIN_SLEEP_US))
+            std::this_thread::sleep_until(target);
+        return;
+    }
+    // Behind the host: don't sleep until the emulated time has caught up. Give up the lag beyond the budget
+    auto lag = now - target;
+    auto budget = std::chrono::microseconds(DRIFT_BUDGET_US);
+    if (lag > budget) {
+        origin += lag - budget;
+        lag = budget;
+    }
+    stats.lag_ms = std::chrono::duration<double,std::milli>(lag).count();
+    if (mode == Mode::LOW_JITTER) record_error(lag);
+}
+
+// Update the calibration and the measured speed
+void Pacer::measure(uint64_t cycles, clock::duration busy_time, clock::time_point now) {
+    if (!calibrated) {
+        calibration_cycles += cycles;
+        calibration_time += busy_time;
+        if (calibration_time >= std::chrono::microseconds(CALIBRATION_US)) calibrated = true;
+        auto us = std::chrono::duration<double,std::micro>(calibration_time).count();
+        if (us > 0) stats.max_MHz = double(calibration_cycles) / us;
+    }
+
+    speed_cycles += cycles;
+    if (now - speed_start >= std::chrono::seconds(1)) {
+        stats.speed_MHz = double(speed_cycles) / std::chrono::duration<double,std::micro>(now - speed_start).count();
+        speed_start = now;
+        speed_cycles = 0;
+
+        if (error_slices != 0) {
+            stats.error_avg_us = error_sum_us / double(error_slices);
+            stats.error_max_us = error_max_us;
+        }
+        error_slices = 0;
+        error_sum_us = error_max_us = 0;
+    }
+}
+
+// Add the delay of the end of a slice past its deadline to the statistics
+void Pacer::record_error(clock::duration error) {
+    double us = std::max(0.0, std::chrono::duration<double,std::micro>(error).count());
+    error_slices++;
+    error_sum_us += us;
+    error_max_us = std::max(error_max_us, us);
+
+    stats.total_slices.fetch_add(1, std::memory_order_relaxed);
+    stats.total_error_us.store(stats.total_error_us.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+    if (us > stats.worst_error_us.load(std::memory_order_relaxed)) stats.worst_error_us.store(us, std::memory_order_relaxed);
+}
+
+// Set up the calling (CPU) thread for low jitter. Each step is optional, since it may not be permitted
+void Pacer::set_up_low_jitter() {
+    // Pin the thread to the last core it can run on (the first cores usually handle more interrupts)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = CPU_SETSIZE-1; cpu >= 0; cpu--) {
+            if (!CPU_ISSET(cpu, &allowed)) continue;
+            cpu_set_t pinned;
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned) == 0) stats.pinned_cpu = cpu;
+            break;
+        }
+    }
+    // Real-time priority (requires CAP_SYS_NICE or an RLIMIT_RTPRIO)
+    sched_param param{};
+    param.sched_priority = FIFO_PRIORITY;
+    stats.fifo = (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0);
+    // Don't take page faults in the middle of a slice
+    stats.memory_locked = (mlockall(MCL_CURRENT | MCL_FUTURE) == 0);
+    // Wake up from the sleeps as soon as possible (only applies if SCHED_FIFO couldn't be set)
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    std::atexit(report_low_jitter);
+}
+
+// Sleep until shortly before the target (the wake-up can be late), then spin until it's reached
+void Pacer::wait_precisely(clock::time_point target) {
+    auto spin_start = target - std::chrono::microseconds(SPIN_US);
+    if (clock::now() < spin_start) std::this_thread::sleep_until(spin_start);
+    while (clock::now() < target) {}
+}
+
+// Print the deadline error of the whole execution when the emulator exits
+void Pacer::report_low_jitter() {
+    uint64_t slices = stats.total_slices;
+    double avg = (slices != 0) ? stats.total_error_us / double(slices) : 0;
+    fprintf(stderr, "Low jitter: %llu slices, deadline error avg %.1lf us, max %.1lf us (%s, %s, %s)\n",
+        (unsigned long long)slices, avg, stats.worst_error_us.load(),
+        stats.fifo ? "SCHED_FIFO" : "no SCHED_FIFO",
+        (stats.pinned_cpu >= 0) ? "pinned" : "not pinned",
+        stats.memory_locked ? "memory locked" : "memory not locked");
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Globals.h"
+
+#include <atomic>
+#include <chrono>
+
+/*  Pacing of the emulated clock:
+    The CPU runs groups of cycles (a time slice, or a single instruction at low frequencies), and
+    the pacer compares the emulated time with the host time after each one.
+    - Real time: sleep until the host time reaches the emulated time. If the host falls behind
+      (a slow slice, the host was busy...), the next slices are run without sleeping until it has
+      caught up. A lag longer than DRIFT_BUDGET_US is given up, so the emulator never races ahead
+      for long after a stall (or keeps falling behind if the clock is too fast for the host).
+    - Low frequency: the same, but the sleep is only done once it's at least MIN_SLEEP_US, so that
+      the short instructions accumulate their sleep time instead of each one sleeping too long.
+    - Turbo: never sleep, run as fast as the host allows.
+    - Low jitter: like real time (with shorter slices), but the CPU thread is pinned to a core,
+      runs with SCHED_FIFO and locks its memory (when permitted). Each wait sleeps until SPIN_US
+      before the deadline, and then spins until it's reached. The delay of the end of each slice
+      past its deadline is measured.
+    During the first CALIBRATION_US spent running the CPU, the pacer measures how many cycles per
+    second the host can emulate (the maximum sustainable frequency, if the CPU never slept).
+*/
+class Pacer {
+public:
+    using Mode = Globals::Pacing;
+
+    static constexpr int64_t DRIFT_BUDGET_US = 100000;  // 100 ms
+    static constexpr int64_t MIN_SLEEP_US = 1000;       // 1 ms
+    static constexpr int64_t CALIBRATION_US = 500000;   // 500 ms
+    static constexpr int64_t SPIN_US = 200;             // 200 us
+    static constexpr int FIFO_PRIORITY = 10;
+
+    // Pacing metrics, written by the CPU thread and shown by the UI
+    struct Stats {
+        std::atomic<Mode> mode = Mode::REALTIME;
+        std::atomic<double> lag_ms = 0;         // How far the emulated time is behind the host time
+        std::atomic<double> speed_MHz = 0;      // Emulated cycles per microsecond of host time (last second)
+        std::atomic<double> max_MHz = 0;        // Maximum sustainable frequency (0 until it has been calibrated)
+        // Low jitter: what could be set up, and delay of the end of the slices past their deadline
+        std::atomic<int> pinned_cpu = -1;
+        std::atomic<bool> fifo = false;
+        std::atomic<bool> memory_locked = false;
+        std::atomic<double> error_avg_us = 0;   // Last second
+        std::atomic<double> error_max_us = 0;
+        std::atomic<uint64_t> total_slices = 0; // Whole execution
+        std::atomic<double> total_error_us = 0;
+        std::atomic<double> worst_error_us = 0;
+    };
+    static Stats stats;
+
+    explicit Pacer(Mode mode);
+
+    // Start again from the current time and cycle count (the CPU has been paused)
+    void restart();
+    // Called after the CPU has run some cycles, which took busy_time: wait until the host time catches up with them
+    void pace(uint64_t cycles, std::chrono::steady_clock::duration busy_time);
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    const Mode mode;
+    clock::time_point origin;       // Host time at which the emulated time was 0
+    uint64_t cycles_since_origin = 0;
+    // Calibration: cycles run, and host time spent running them
+    uint64_t calibration_cycles = 0;
+    clock::duration calibration_time{0};
+    bool calibrated = false;
+    // Speed measurement: start of the current second and cycles run since then
+    clock::time_point speed_start;
+    uint64_t speed_cycles = 0;
+    // Deadline error of the slices run since the start of the current second
+    uint64_t error_slices = 0;
+    double error_sum_us = 0;
+    double error_max_us = 0;
+
+    clock::time_point emulated_time() const;
+    void measure(uint64_t cycles, clock::duration busy_time, clock::time_point now);
+    void record_error(clock::duration error);
+    static void set_up_low_jitter();
+    static void wait_precisely(clock::time_point target);
+    static void report_low_jitter();
+};
@@ -0,0 +1,263 @@
+#include "CpuCore.h"
+#include "Breakpoints.h"
+#include "Hooks.h"
+
+/*  Superinstructions:
+    Compiled CESC16 code is full of fixed sequences (compare + conditional jump, push/pop runs in
+    function prologues and epilogues, loading an argument + call). When such a sequence is decoded,
+    its first instruction is marked as the start of a group, and the whole group can then be run by
+    a single handler and accounted at once (the cycles are the sum of its instructions).
+    A group is only run at once when no event can be observed in the middle of it: no pending
+    interrupt or single step, no breakpoint or exit point inside it, no end of the time slice and no
+    device event before its last instruction, and no stack access that traps or touches MMIO.
+    Otherwise its first instruction is run alone, like in any other engine.
+*/
+
+// Raw opcode classification (the fields must be valid, so that decoding them can't fail)
+static bool is_jump(word opcode) {
+    return (opcode >> 13) == 0b110 && ((opcode >> 8) & 0xF) <= 0b1110;
+}
+static bool is_call(word opcode) {
+    return (opcode >> 9) == 0b1110000 && (opcode & 0xF) == 0b0001;
+}
+static bool is_push(word opcode) {
+    byte operation = (opcode >> 8) & 0x1F;
+    return (opcode >> 13) == 0b101 && operation >= 0b00100 && operation <= 0b00110 && (opcode & 0xF) == 0b0001;
+}
+// pop sp is excluded, since the following stack accesses couldn't be checked in advance
+static bool is_pop(word opcode) {
+    return (opcode >> 8) == 0b10100111 && (opcode & 0xF) == 0b0001 && ((opcode >> 4) & 0xF) != 0b0001;
+}
+
+// Returns true if an address is a breakpoint, an exit point or a hooked routine (in the given address space)
+static bool is_stop_address(word addr, bool user) {
+    return Globals::breakpoints.flags(addr, user) != 0 || (!user && Globals::hooks.is_hooked(addr));
+}
+
+
+// Look for a group of instructions that starts with the (just decoded) instruction pointed by the PC
+void CPU::fuse_group(DecodedInstr& first, DecodeCache& cache) {
+    // Hooked routines are replaced as a whole (see Hooks.cpp)
+    if (!user_mode && Globals::hooks.is_hooked(PC)) {
+        first.group = DecodedInstr::GROUP_HOOK;
+        return;
+    }
+    // Loops take precedence over the other groups
+    if (!user_mode) {
+        DecodedInstr members[MAX_LOOP_SZ];
+        if (int size = collect_loop(first, members); size > 0) {
+            if (find_bulk_loop(first, members, size) || find_idle_loop(first, members, size)) return;
+        }
+    }
+
+    const word stride = user_mode ? 2 : 1;
+    // Last address where a member can start: the PC can't overflow after the group (ROM), and all
+    // the members must be cached (RAM)
+    const word last_addr = user_mode ? 0xFEFE : 0xFFFE;
+
+    // Returns the opcode of the instruction at addr
+    auto opcode_at = [this](word addr) { return user_mode ? ram.read(addr) : rom.high(addr); };
+    auto argument_at = [this](word addr) { return user_mode ? ram.read(addr+1) : rom.low(addr); };
+    // Returns true if the instruction at addr can be a member of the group
+    auto can_add = [&](word addr) {
+        return addr > PC && addr <= last_addr && !is_stop_address(addr, user_mode);
+    };
+
+    word addr = PC + stride;
+    if (!can_add(addr)) return;
+    word opcode = opcode_at(addr);
+
+    DecodedInstr::Group group = DecodedInstr::NO_GROUP;
+    if (first.op < DecodedInstr::OP_ALU_M_OP) {
+        if (is_jump(opcode)) group = DecodedInstr::GROUP_ALU_JMP;
+        // mov sp is excluded, since the stack access of the call is checked in advance
+        else if (first.funct == 0b000 && first.rD != 0b0001 && is_call(opcode)) group = DecodedInstr::GROUP_MOV_CALL;
+    }
+    else if (first.op >= DecodedInstr::OP_MEM+0b00100 && first.op <= DecodedInstr::OP_MEM+0b00110) {
+        if (is_push(opcode)) group = DecodedInstr::GROUP_PUSH;
+    }
+    else if (first.op == DecodedInstr::OP_MEM+0b00111 && first.rD != 0b0001) {
+        if (is_pop(opcode)) group = DecodedInstr::GROUP_POP;
+    }
+    if (group == DecodedInstr::NO_GROUP) return;
+
+    int size = 1;
+    int cycles = first.cycles();
+    int last_cycles = 0;
+    while (true) {
+        DecodedInstr& member = cache[addr];
+        if (member.op == DecodedInstr::OP_NONE) decode_INSTR(member, opcode, argument_at(addr));
+        last_cycles = member.cycles();
+        cycles += last_cycles;
+        size++;
+
+        // ALU + jump and mov + call are pairs, push and pop sequences can be longer
+        if (group != DecodedInstr::GROUP_PUSH && group != DecodedInstr::GROUP_POP) break;
+        if (size == DecodedInstr::MAX_GROUP_SZ) break;
+        addr += stride;
+        if (!can_add(addr)) break;
+        opcode = opcode_at(addr);
+        if (group == DecodedInstr::GROUP_PUSH ? !is_push(opcode) : !is_pop(opcode)) break;
+    }
+
+    first.group = group;
+    first.group_size = size;
+    first.group_cycles = cycles;
+    first.group_last_cycles = last_cycles;
+}
+
+// In RAM, the other members of a group can be overwritten without invalidating its first instruction.
+// Returns true if they are still decoded and of the expected kind
+bool CPU::is_group_valid(const DecodedInstr& first) const {
+    const DecodedInstr* member = &first;
+    for (int i = 1; i < first.group_size; i++) {
+        member += 2;
+        if (member->op == DecodedInstr::OP_NONE) return false;
+
+        bool valid;
+        switch (first.group) {
+        case DecodedInstr::GROUP_ALU_JMP:
+            valid = member->op >= DecodedInstr::OP_JMP && member->op < DecodedInstr::OP_JMP + 2*15;
+            break;
+        case DecodedInstr::GROUP_PUSH:
+            valid = member->op >= DecodedInstr::OP_MEM+0b00100 && member->op <= DecodedInstr::OP_MEM+0b00110;
+            break;
+        case DecodedInstr::GROUP_POP:
+            valid = member->op == DecodedInstr::OP_MEM+0b00111 && member->rD != 0b0001;
+            break;
+        case DecodedInstr::GROUP_MOV_CALL:
+            valid = member->op == DecodedInstr::OP_CALL;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+        if (!valid) return false;
+    }
+    return true;
+}
+
+// Run a whole group of instructions (can_run_group must have returned true). Returns the used cycles
+int CPU::exec_group(const DecodedInstr& first) {
+    const int stride = user_mode ? 2 : 1;
+    const DecodedInstr* member = &first;
+    // Address of the instruction that follows the group (in RAM, the PC already points to the argument)
+    word next_PC = PC + first.group_size*stride - (stride-1);
+
+    switch (first.group) {
+    case DecodedInstr::GROUP_ALU_JMP:
+        (this->*op_handlers[first.op])(first);
+        member += stride;
+        if (is_condition_met(member->funct)) next_PC = (member->mode == 0) ? regs[member->rA] : member->argument;
+        break;
+
+    case DecodedInstr::GROUP_PUSH:
+        // The stack can't overflow and doesn't reach MMIO (checked by can_run_group)
+        materialize_flags();
+        for (int i = 0; i < first.group_size; i++, member += stride) {
+            word data;
+            if (member->op == DecodedInstr::OP_MEM+0b00100) data = regs[member->rB];    // push (reg)
+            else if (member->op == DecodedInstr::OP_MEM+0b00101) data = member->argument; // push (imm)
+            else data = FLG;                                                            // pushf
+            *SP = *SP - 1;
+            ram.write(*SP, data);
+        }
+        break;
+
+    case DecodedInstr::GROUP_POP:
+        for (int i = 0; i < first.group_size; i++, member += stride) {
+            word data = ram.read(*SP);
+            *SP = *SP + 1;
+            regs.write(member->rD, data);
+        }
+        break;
+
+    case DecodedInstr::GROUP_MOV_CALL: {
+        (this->*op_handlers[first.op])(first);
+        member += stride;
+        word destination = (member->mode == 0) ? regs[member->rB] : member->argument;
+        *SP = *SP - 1;
+        ram.write(*SP, next_PC); // Return address
+        next_PC = destination;
+        break;
+    }
+
+    default:
+        // Unreachable
+        debug_assert(false);
+    }
+
+    PC = next_PC;
+    return first.group_cycles;
+}
+
+
+// Decode the body of a loop that starts at the PC (in ROM): the instructions up to a jump back to the PC.
+// The other jumps must leave the loop, so that every iteration runs all the instructions. The body is
+// stored in members (the cache isn't modified). Returns the number of instructions, or 0 if there is no loop
+int CPU::collect_loop(const DecodedInstr& first, DecodedInstr* members) {
+    if (is_stop_address(PC, false)) return 0;
+
+    for (int size = 1; size <= MAX_LOOP_SZ; size++) {
+        // The PC can't overflow inside the loop
+        word addr = PC + size - 1;
+        if (addr < PC || addr > 0xFFFE) return 0;
+        if (size > 1 && is_stop_address(addr, false)) return 0;
+
+        DecodedInstr& member = members[size-1];
+        if (size == 1) member = first;
+        else decode_INSTR(member, rom.high(addr), rom.low(addr));
+        if (member.op < DecodedInstr::OP_JMP || member.op >= DecodedInstr::OP_JMP + 2*15) continue;
+
+        // Jumps must be to an immediate address
+        if (member.mode != 1) return 0;
+        if (member.argument != PC) continue;
+        for (int i = 0; i < size-1; i++) {
+            const DecodedInstr& other = members[i];
+            bool is_jump = other.op >= DecodedInstr::OP_JMP && other.op < DecodedInstr::OP_JMP + 2*15;
+            if (is_jump && other.argument >= PC && other.argument <= addr) return 0;
+        }
+        return size;
+    }
+    return 0;
+}
+
+// Mark the first instruction of a loop as a group, and store the rest of the body in the cache
+// (unless it has already been decoded)
+void CPU::mark_loop(DecodedInstr& first, const DecodedInstr* members, int size, DecodedInstr::Group group) {
+    int cycles = 0;
+    for (int i = 0; i < size; i++) cycles += members[i].cycles();
+    for (int i = 1; i < size; i++) {
+        if (rom_cache[word(PC+i)].op == DecodedInstr::OP_NONE) rom_cache[word(PC+i)] = members[i];
+    }
+    first.group = group;
+    first.group_size = size;
+    first.group_cycles = cycles;
+    first.group_last_cycles = members[size-1].cycles();
+}
+
+// Run a loop or a hooked routine (can_run_group must have returned true). Returns the used cycles,
+// and sets the number of executed instructions
+int CPU::exec_long_group(const DecodedInstr& first, int32_t cycles_left, int& instructions) {
+    switch (first.group) {
+    case DecodedInstr::GROUP_BULK_LOOP: return exec_bulk_loop(first, cycles_left, instructions);
+    case DecodedInstr::GROUP_HOOK: return exec_hook(first, instructions);
+    default: return exec_idle_loop(first, cycles_left, instructions);
+    }
+}
+
+// Run an iteration of a loop, until it jumps back to its first instruction or leaves the loop.
+// Returns the used cycles, and adds the executed instructions to instructions
+int CPU::exec_loop_iteration(const DecodedInstr& first, int& instructions) {
+    const DecodedInstr* members = &first;
+    int used_cycles = 0;
+    for (int i = 0; i < first.group_size; i++) {
+        word addr = PC;
+        used_cycles += exec_INSTR(members[i]);
+        instructions++;
+        if (trap != Trap::NONE) report_trap(addr, false);
+        // A jump has been taken: either the loop has been left, or this is the last instruction
+        if (PC != word(addr+1)) break;
+    }
+    return used_cycles;
+}
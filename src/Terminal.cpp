@@ -2,6 +2,8 @@
 #include "Utilities/Assert.h"
 #include "Utilities/ExitHelper.h"
 #include "CpuController.h"
+#include "Pacer.h"
+#include "ControlChannel.h"
 
 #include <sys/ioctl.h>
 
@@ -34,7 +36,7 @@ void Terminal::size_check() {
     winsize w;
     ioctl(0, TIOCGWINSZ, &w);
     
-    if (w.ws_row <= ROWS+4) ExitHelper::error("ERROR - Terminal height too small\n");
+    if (w.ws_row <= ROWS+6) ExitHelper::error("ERROR - Terminal height too small\n");
     if (w.ws_col <= COLS+COLS_STATUS+4) ExitHelper::error("ERROR - Terminal width too small\n");
 }
 
@@ -107,7 +109,7 @@ void Terminal::init_ncurses() {
         ExitHelper::error("Error initializing subwindow!\n");
         
     // Initialize subwindow (metrics)
-    perf_screen = newwin(1, COLS+COLS_STATUS+3, ROWS+3, 1);
+    perf_screen = newwin(3, COLS+COLS_STATUS+3, ROWS+3, 1);
     if (perf_screen == nullptr)
         ExitHelper::error("Error initializing subwindow!\n");
 
@@ -151,7 +153,7 @@ void Terminal::draw_frames() const {
     // Draw frames around subwindows
     draw_rectangle(0, 0, ROWS+1, COLS+1, "Terminal output");
     draw_rectangle(0, COLS+3, ROWS+1, COLS+COLS_STATUS+4, "Status");
-    draw_rectangle(ROWS+2, 0, ROWS+4, COLS+COLS_STATUS+4, "Performance");
+    draw_rectangle(ROWS+2, 0, ROWS+6, COLS+COLS_STATUS+4, "Performance");
     refresh();
 }
 
@@ -192,7 +194,7 @@ void Terminal::print(char c, print_mode mode) {
     }
 }
 
-void Terminal::display_status(word PC, bool user_mode, const StatusFlags& flg, Regfile& regs, double CPI) {
+void Terminal::display_status(word PC, bool user_mode, const StatusFlags& flg, const Regfile& regs, const CpiStats::Snapshot& cpi, double host_MHz) {
     wmove(stat_screen, 0, 0); // Set cursor to beginning of window
 
     wprintw(stat_screen, " PC=0x%04X", PC);
@@ -203,11 +205,34 @@ void Terminal::display_status(word PC, bool user_mode, const StatusFlags& flg, R
     for (byte i = 1; i < 16; i++)
         wprintw(stat_screen, " %s = 0x%04X\n", regs.ABI_names[i].c_str(), word(regs[i]));
 
-    if (Globals::is_paused) wprintw(stat_screen, "\n [PAUSED]\n F5: Resume\n F6: Step\n F7: Cycle = 0\n");
+    if (Globals::control.is_paused()) wprintw(stat_screen, "\n [PAUSED]\n F5: Resume\n F6: Step\n F7: Cycle = 0\n");
     else wprintw(stat_screen, "\n\n\n\n\n");
     
     wmove(perf_screen, 0, 0); // Set cursor to beginning of window
-    wprintw(perf_screen, " CPI: %.4lf\tElapsed cycles: %llu\n", CPI, (unsigned long long)Globals::elapsed_cycles);
+    wprintw(perf_screen, " CPI: %.3lf  Cycles: %llu  Host: %.1lf MHz\n",
+        cpi.mean(), (unsigned long long)Globals::elapsed_cycles.load(), host_MHz);
+    // Histogram: percentage of the instructions that took each number of cycles
+    wprintw(perf_screen, " CPI histogram:");
+    for (int i = 0; i < CpiStats::BUCKETS; i++) {
+        if (cpi.histogram[i] == 0) continue;
+        double percent = 100.0 * double(cpi.histogram[i]) / double(cpi.instructions);
+        wprintw(perf_screen, " %d%s=%.0lf%%", i, (i == CpiStats::BUCKETS-1) ? "+" : "", percent);
+    }
+    wclrtoeol(perf_screen);
+    // Pacing: in turbo mode, the speed actually achieved. Otherwise, how far behind the host time the CPU is
+    // In low jitter mode, the delay of the slices past their deadline (last second) and what could be set up
+    if (Pacer::stats.mode == Pacer::Mode::LOW_JITTER) {
+        wprintw(perf_screen, "\n Low jitter: err avg %.0lf max %.0lf us ", Pacer::stats.error_avg_us.load(), Pacer::stats.error_max_us.load());
+        if (Pacer::stats.fifo) wprintw(perf_screen, " FIFO");
+        if (Pacer::stats.pinned_cpu >= 0) wprintw(perf_screen, " CPU%d", Pacer::stats.pinned_cpu.load());
+        if (Pacer::stats.memory_locked) wprintw(perf_screen, " mlock");
+    }
+    else {
+        if (Pacer::stats.mode == Pacer::Mode::TURBO) wprintw(perf_screen, "\n Pacing: turbo  Speed: %.1lf MHz", Pacer::stats.speed_MHz.load());
+        else wprintw(perf_screen, "\n Pacing: %s  Lag: %.1lf ms", (Pacer::stats.mode == Pacer::Mode::REALTIME) ? "real time" : "low freq.", Pacer::stats.lag_ms.load());
+        wprintw(perf_screen, "  Max: %.1lf MHz", Pacer::stats.max_MHz.load());
+    }
+    wclrtoeol(perf_screen);
 }
 
 // Flush the output stream
@@ -218,7 +243,7 @@ void Terminal::flush() {
     // Output file doesn't need to be flushed
 }
 
-// Process ncurses key queue until it's empty (called periodically)
+// Process ncurses key queue until it's empty (called by the I/O thread). If the input queue is full, the keys are dropped
 void Terminal::update_input() {
     int ch;
     // Empty the ncurses buffer and store on local input queue (this way function keys get processed immediately)
@@ -244,19 +269,19 @@ void Terminal::update_input() {
             
             case KEY_F(5):
                 // Pause/unpause emulator
-                Globals::is_paused = !Globals::is_paused;
-                Globals::single_step = false;
+                Globals::control.send({ControlChannel::Command::TOGGLE_PAUSE});
                 break;
             case KEY_F(6):
-                // Execute 1 instruction
-                if (!Globals::is_paused) break;  // F6 only works when paused
-                Globals::single_step = true;
-                Globals::is_paused = false;
+                // Execute 1 instruction (only works when paused)
+                Globals::control.send({ControlChannel::Command::STEP, 1});
+                break;
+            case KEY_F(18):
+                // Shift+F6: Execute 1000 cycles (only works when paused)
+                Globals::control.send({ControlChannel::Command::RUN_CYCLES, 1000});
                 break;
             case KEY_F(7):
-                // Reset cycle counter
-                if (!Globals::is_paused) break;  // F7 only works when paused
-                Globals::elapsed_cycles = 0;
+                // Reset cycle counter (only works when paused)
+                Globals::control.send({ControlChannel::Command::RESET_CYCLES});
                 break;
                 
             case KEY_F(8):  input_buffer.push(0x16); break;
@@ -275,13 +300,9 @@ void Terminal::update_input() {
 
 // Returns the first character in the input queue (and removes it from the queue)
 byte Terminal::get_input() {
-    update_input();
-    
     // If the queue is not empty, remove and return the first element
-    if (input_buffer.empty()) return 0;
-    
-    byte input = input_buffer.front();
-    input_buffer.pop();
+    byte input;
+    if (!input_buffer.pop(input)) return 0;
     return input;
 }
 
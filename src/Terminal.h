@@ -2,11 +2,12 @@
 
 #include "Globals.h"
 #include "Memory.h"
+#include "CpiStats.h"
+#include "Utilities/SpscQueue.h"
 
 #include <curses.h>
 #include <termios.h>
 #include <csignal>
-#include <queue>
 #include <fstream>
 
 
@@ -22,7 +23,7 @@ private:
     sighandler_t ncurses_stop_handler; // Current SIGTSTP handler, implemented by ncurses
     termios shell_settings; // Terminal settings received from shell
     termios curses_settings; // Terminal settings after setting up ncurses windows
-    std::queue<byte> input_buffer; // Buffer for the received keystrokes
+    SpscQueue<byte,256> input_buffer; // Received keystrokes, from the I/O thread to the CPU thread
     std::ofstream output_file;  // If -o is used, all CPU outputs are stored in output_file
     
     static const int COLS_STATUS = 15;
@@ -50,16 +51,17 @@ public:
     
     // Output a char
     void print(char c, print_mode mode = BOTH);
-    // Output status info
-    void display_status(word PC, bool user_mode, const StatusFlags& flg, Regfile& regs, double CPI);
+    // Output status info. host_MHz is the speed at which the host is able to emulate the CPU
+    void display_status(word PC, bool user_mode, const StatusFlags& flg, const Regfile& regs, const CpiStats::Snapshot& cpi, double host_MHz);
     // Flush the output stream
     void flush();
     // Destroy the terminal. This function should be called before exiting the program
     void destroy();
     
-    // Process ncurses key queue until it's empty (called periodically)
+    // Process ncurses key queue until it's empty (called by the I/O thread)
     void update_input();
-    // Returns the first character in the input queue (and removes it from the queue)
+    // Returns the first character in the input queue (and removes it from the queue), or 0 if it's
+    // empty. Only called by the CPU thread
     byte get_input();
     // Gets the current cursor coordinates (leaves them in row and col)
     void get_coords(int& row, int& col) const;
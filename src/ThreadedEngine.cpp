@@ -0,0 +1,166 @@
+#include "CpuCore.h"
+
+#include <iterator>
+
+/*  Threaded execution engine:
+    Every instruction variant (opcode class, funct and addressing mode) has its own block of code,
+    which ends by jumping directly to the block of the next instruction (computed goto, supported
+    by GCC and Clang). Unlike a switch, each block has its own indirect jump, so the branch predictor
+    can learn which instruction usually comes after each one.
+    The cycles are accounted exactly like in the default engine (CPU::execute_switch).
+*/
+
+// Addresses of the blocks
+#define ALU_REG_ADDR(f, m) &&ALU_REG_##f##_##m,
+#define ALU_M_OP_ADDR(f, m) &&ALU_M_OP_##f##_##m,
+#define ALU_M_DEST_ADDR(f, m) &&ALU_M_DEST_##f##_##m,
+#define ALU_MEM_IMM_ADDR(f, m) &&ALU_MEM_IMM_##f##_##m,
+#define JMP_ADDR(c, m) &&JMP_##c##_##m,
+
+// Leave the loop because the execution has been paused
+#define PAUSE() { cycles_left = cycles; return true; }
+
+// Finish the current instruction and jump to the block of the next one. Interrupts, traps and
+// the end of the time slice are handled out of line, in next_instr and fault
+#define DISPATCH() \
+    if (increment_PC) PC_plus_1(); \
+    if (trap != Trap::NONE) goto fault; \
+    cycles -= instr->cycles(); \
+    if (end_instruction(instr->cycles())) PAUSE(); \
+    if (cycles <= 0 || IRQ) goto next_instr; \
+    old_PC = PC; \
+    instr = &fetch_decoded<user>(); \
+    if (user) PC_plus_1(); \
+    if (user && trap != Trap::NONE) goto fault; \
+    increment_PC = true; \
+    if (instr->group != DecodedInstr::NO_GROUP) goto group; \
+    goto *dispatch_table[instr->op]
+
+// Finish an instruction that can change the privilege mode (the loop of the new mode is run by execute_threaded)
+#define DISPATCH_MODE_CHANGE() \
+    if (increment_PC) PC_plus_1(); \
+    if (trap != Trap::NONE) goto fault; \
+    cycles -= instr->cycles(); \
+    if (end_instruction(instr->cycles())) PAUSE(); \
+    goto next_instr
+
+// Blocks of code for each instruction variant
+#define ALU_REG_BLOCK(f, m) ALU_REG_##f##_##m: op_ALU_reg<f,m>(*instr); DISPATCH();
+#define ALU_M_OP_BLOCK(f, m) ALU_M_OP_##f##_##m: op_ALU_m_op<f,m>(*instr); DISPATCH();
+#define ALU_M_DEST_BLOCK(f, m) ALU_M_DEST_##f##_##m: op_ALU_m_dest<f,m>(*instr); DISPATCH();
+#define ALU_MEM_IMM_BLOCK(f, m) ALU_MEM_IMM_##f##_##m: op_ALU_mem_imm<f,m>(*instr); DISPATCH();
+#define JMP_BLOCK(c, m) JMP_##c##_##m: op_JMP<c,m>(*instr); DISPATCH();
+
+
+// Run CPU for a number of clock cycles, using the threaded engine.
+// Returns how many extra cycles were needed to finish the last instruction.
+int32_t CPU::execute_threaded(int32_t cycles) {
+
+    while (cycles > 0) {
+        // Run the loop of the current privilege mode, until the mode changes
+        bool paused = user_mode ? run_threaded<true>(cycles) : run_threaded<false>(cycles);
+        if (paused) return 0;
+    }
+
+    // If finishing an instruction took some extra cycles, return how many
+    return -cycles;
+}
+
+// Loop of the threaded engine, for a given privilege mode. Returns true if the execution has been paused
+template <bool user>
+bool CPU::run_threaded(int32_t& cycles_left) {
+    // Address of the block of each instruction variant, in the order of DecodedInstr::Op
+    static void* const dispatch_table[] = {
+        EACH_FUNCT_IMM(ALU_REG_ADDR)
+        EACH_FUNCT_MODE(ALU_M_OP_ADDR)
+        EACH_FUNCT_MODE(ALU_M_DEST_ADDR)
+        EACH_FUNCT_MODE(ALU_MEM_IMM_ADDR)
+        &&SHFT_SLL, &&SHFT_SRL, &&SHFT_SRA,
+        &&MOVB, &&SWAP, &&PEEK_L, &&PEEK_H, &&PUSH_REG, &&PUSH_IMM, &&PUSHF, &&POP, &&POPF,
+        EACH_COND_IMM(JMP_ADDR)
+        &&JMP_INVALID, &&JMP_INVALID,
+        &&CALL, &&SYSCALL, &&ENTER, &&RET, &&SYSRET, &&EXIT,
+        &&INVALID_SP, &&ILLEGAL,
+    };
+    static_assert(std::size(dispatch_table) == DecodedInstr::OP_COUNT);
+
+    const DecodedInstr* instr;
+    word old_PC = PC;
+    int32_t cycles = cycles_left;
+
+    next_instr:
+    // Return to execute_threaded at the end of the time slice, or if the privilege mode has changed
+    if (cycles <= 0 || user_mode != user) {
+        cycles_left = cycles;
+        return false;
+    }
+
+    old_PC = PC;
+    // CPU INTERRUPT! Jump to interrupt vector
+    if (IRQ && is_OS_ready()) {
+        int used_cycles = exec_IRQ();
+        cycles -= used_cycles;
+        if (end_instruction(used_cycles)) PAUSE();
+        goto next_instr;
+    }
+
+    instr = &fetch_decoded<user>();
+    if (user) PC_plus_1();
+    if (user && trap != Trap::NONE) goto fault;
+    increment_PC = true;
+    if (instr->group != DecodedInstr::NO_GROUP) goto group;
+    goto *dispatch_table[instr->op];
+
+    group:
+    // Run a group of instructions at once (see Superinstructions.cpp), or only its first instruction
+    if (!can_run_group(*instr, cycles)) goto *dispatch_table[instr->op];
+    {
+        int instructions = instr->group_size;
+        int used_cycles = (instr->group >= DecodedInstr::GROUP_IDLE_LOOP) ?
+            exec_long_group(*instr, cycles, instructions) : exec_group(*instr);
+        cycles -= used_cycles;
+        if (end_instruction(used_cycles, instructions)) PAUSE();
+        goto next_instr;
+    }
+
+    // ALU operations
+    EACH_FUNCT_IMM(ALU_REG_BLOCK)
+    EACH_FUNCT_MODE(ALU_M_OP_BLOCK)
+    EACH_FUNCT_MODE(ALU_M_DEST_BLOCK)
+    EACH_FUNCT_MODE(ALU_MEM_IMM_BLOCK)
+
+    // Shifts
+    SHFT_SLL: op_SHFT<0b01>(*instr); DISPATCH();
+    SHFT_SRL: op_SHFT<0b10>(*instr); DISPATCH();
+    SHFT_SRA: op_SHFT<0b11>(*instr); DISPATCH();
+
+    // Memory operations
+    MOVB: exec_MOVB(*instr); DISPATCH();
+    SWAP: exec_SWAP(*instr); DISPATCH();
+    PEEK_L: exec_PEEK_L(*instr); DISPATCH();
+    PEEK_H: exec_PEEK_H(*instr); DISPATCH();
+    PUSH_REG: exec_PUSH_reg(*instr); DISPATCH();
+    PUSH_IMM: exec_PUSH_imm(*instr); DISPATCH();
+    PUSHF: exec_PUSHF(*instr); DISPATCH();
+    POP: exec_POP(*instr); DISPATCH();
+    POPF: exec_POPF(*instr); DISPATCH();
+
+    // Jumps
+    EACH_COND_IMM(JMP_BLOCK)
+    JMP_INVALID: exec_JMP(*instr); DISPATCH();
+
+    // Call/ret operations
+    CALL: exec_CALL(*instr); DISPATCH();
+    SYSCALL: exec_SYSCALL(*instr); DISPATCH_MODE_CHANGE();
+    ENTER: exec_ENTER(*instr); DISPATCH_MODE_CHANGE();
+    RET: exec_RET(*instr); DISPATCH();
+    SYSRET: exec_SYSRET(*instr); DISPATCH_MODE_CHANGE();
+    EXIT: exec_EXIT(*instr); DISPATCH_MODE_CHANGE();
+
+    INVALID_SP: exec_INVALID_SP(*instr); DISPATCH();
+    ILLEGAL: exec_ILLEGAL(*instr); DISPATCH();
+
+    fault:
+    // The instruction at old_PC has caused a trap
+    report_trap(old_PC, user);
+}
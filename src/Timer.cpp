@@ -1,49 +1,51 @@
 #include "Timer.h"
 
-// Tick the timer for a number of clock cycles
-bool Timer::tick(int amount) {
-    // If the timer is disabled, don't do anything
-    if (!timer_active) return false;
-
-    // Memory writes are performed on the rising edge of the last timestep,
-    // the instruction that called Timer::write() does not increment the counter.
-    if (just_updated) {
-        just_updated = false;
-        return false;
-    }
+Timer::Timer(EventQueue& events) : events(events) { }
 
-    // Increment hardware timer
-    timer_count += amount;
+// Current count (with the prescaler bits)
+uint32_t Timer::current_count() const {
+    if (!timer_active) return timer_count;
+    return timer_count + uint32_t(events.now() - start_time);
+}
 
-    // Timer would overflow, trigger interrupt
-    if (timer_count >= (END_COUNT << 4)) {
-        timer_count = (END_COUNT << 4);
-        timer_active = false;
-        return true;
+// Handle the events of the timer. Returns true if an overflow has occurred
+bool Timer::handle_event(EventQueue::Kind kind) {
+    if (kind == EventQueue::TIMER_START) {
+        // Memory writes are performed on the rising edge of the last timestep,
+        // the instruction that called Timer::write() does not increment the counter.
+        timer_active = true;
+        start_time = events.now();
+        // Schedule the overflow (the next instruction always increments the counter)
+        int32_t remaining = (END_COUNT << 4) - int32_t(timer_count);
+        events.schedule_in(EventQueue::TIMER_OVERFLOW, uint64_t(std::max(remaining, 1)));
+        return false;
     }
-    return false;
+    // Timer overflow, trigger interrupt
+    timer_count = (END_COUNT << 4);
+    timer_active = false;
+    return true;
 }
 
 // Reset the timer
 void Timer::reset() {
     timer_count = 0;
     timer_active = false;
-    just_updated = false;
 }
 
 
 // Set the current timer value
 MemCell& Timer::operator=(word rhs) {
-    timer_count &= 0x0000F; // Preserve prescaler bits
+    timer_count = current_count() & 0x0000F; // Preserve prescaler bits
     timer_count |= (rhs << 4); // Add value of the timer
 
-    // Also activate the timer
-    timer_active = true;
-    just_updated = true;
+    // Also activate the timer, once the current instruction has finished
+    timer_active = false;
+    events.cancel(EventQueue::TIMER_OVERFLOW);
+    events.schedule(EventQueue::TIMER_START, events.now());
     return *this;
 }
 
 // Read the current value of the timer
 Timer::operator word() const {
-    return word(timer_count >> 4);
+    return word(current_count() >> 4);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Memory.h"
+#include "EventQueue.h"
 
 class Timer : public MemCell {
 
@@ -10,32 +11,38 @@ class Timer : public MemCell {
     would take. This means that an exact simulation of the timer will never be possible.
     Therefore, the goal of this timer is not to report the exact same readings as the actual CPU, but
     to stay consistent in the long term (avoid drifting away from the correct timer value).
+    The count isn't incremented after every instruction: it's computed from the time at which the
+    timer was started, and the overflow is an event (see EventQueue.h).
 */
 
 private:
     // Value of the timer when the count ends
     static const int END_COUNT = 0xF000;   // This value should be 0x10000. The restricted range is a workaround for a hardware bug 
     
+    EventQueue& events;
+
     /* Bits 0..3  = Ignored, 16x prescaler for the timer
        Bits 4..20 = The 16-bit timer itself
        Bit 21     = Used for overflow detection */
-    uint32_t timer_count = 0;
+    uint32_t timer_count = 0;   // Count when the timer was started (or its final value, if it's not counting)
+    uint64_t start_time = 0;    // Time at which the timer was started
 
-    // If true, the timer gets incremented
+    // True if the timer is counting (the overflow event is scheduled)
     bool timer_active = false;
 
-    // True if the timer has been written in this instruction
-    bool just_updated = false;
+    // Current count (with the prescaler bits)
+    uint32_t current_count() const;
 
 public:
+    explicit Timer(EventQueue& events);
+
     // WRITE: Set the current timer value
     MemCell& operator=(word rhs) override;
     // READ: Read the current value of the timer
     operator word() const override;
 
-    // Tick the timer for a number of clock cycles
-    // Returns true only if an overflow has occurred
-    bool tick(int amount);
+    // Handle the events of the timer. Returns true if an overflow has occurred
+    bool handle_event(EventQueue::Kind kind);
 
     // Reset the timer
     void reset();
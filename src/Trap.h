@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Globals.h"
+
+// Faults caused by an instruction. Instead of throwing an exception, the first fault is recorded
+// and checked at the end of the instruction (see CPU::report_trap)
+enum class Trap : byte {
+    NONE = 0,
+    PC_OVERFLOW,            // PC overflowed
+    SP_OVERFLOW,            // SP overflowed
+    INVALID_MEMORY_ACCESS,  // Access to an unmapped MMIO address
+    ILLEGAL_OPCODE,
+    MOVB,                   // MOVB is deprecated
+    INVALID_JUMP_CONDITION,
+    INVALID_STACK_OPERATION,    // Stack operation that doesn't encode sp in rA
+    INVALID_FLAGS,              // popf with the top bits of the flags set
+    DEVICE_ERROR,               // A device rejected a write (the RAM keeps its error message)
+};
+
+// Error message of each trap (an invalid jump condition is followed by the condition, and a device
+// error by the message of the device)
+inline const char *trap_message(Trap trap) {
+    switch (trap) {
+    case Trap::PC_OVERFLOW: return "PC overflowed";
+    case Trap::SP_OVERFLOW: return "SP overflowed";
+    case Trap::INVALID_MEMORY_ACCESS: return "Invalid memory access";
+    case Trap::ILLEGAL_OPCODE: return "Illegal opcode";
+    case Trap::MOVB: return "MOVB is deprecated and cannot be used";
+    case Trap::INVALID_JUMP_CONDITION: return "Invalid jump condition: ";
+    case Trap::INVALID_STACK_OPERATION: return "Stack operations must use sp";
+    case Trap::INVALID_FLAGS: return "The top bits of the flags must be 0";
+    default: return "";
+    }
+}
@@ -8,6 +8,15 @@
 
 #define assert(cond) Assert::assertCondition(static_cast<bool>(cond), #cond, __FILE__, __LINE__)
 
+// Internal checks of the CPU and the devices, compiled out in builds with -DUNCHECKED (faults
+// caused by the emulated program are reported as traps instead).
+// The condition must not have side effects (it isn't evaluated in those builds)
+#ifdef UNCHECKED
+    #define debug_assert(cond) ((void)sizeof(static_cast<bool>(cond)))
+#else
+    #define debug_assert(cond) assert(cond)
+#endif
+
 namespace Assert
 {
     // Assert that a condition is true
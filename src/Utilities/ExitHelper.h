@@ -3,17 +3,21 @@
 #include <mutex>
 
 #include "../Terminal.h"
+#include "../IoReactor.h"
 
 class ExitHelper {
     
 private:
-    // Lock that prevents other threads from executing if a thread has been killed
-    static std::mutex exit_mutex;
+    // Lock that prevents other threads from executing if a thread has been killed. It's recursive
+    // because the I/O thread holds it while running its handlers, and they can also exit
+    static std::recursive_mutex exit_mutex;
     
     [[noreturn]] inline static void exit_impl(int code, const char *format, va_list args) {
         // Acquire exit lock
-        std::scoped_lock<std::mutex> lock(exit_mutex);
+        std::scoped_lock<std::recursive_mutex> lock(exit_mutex);
         
+        // Complete the pending output of the I/O thread
+        IoReactor::get_instance()->stop();
         Terminal::get_instance()->destroy();
         std::vfprintf(stderr, format, args);
         std::exit(code);
@@ -34,7 +38,7 @@ public:
         va_end(args);
     }
     
-    inline static std::mutex& get_exit_mutex() {
-        return const_cast<std::mutex &>(exit_mutex);
+    inline static std::recursive_mutex& get_exit_mutex() {
+        return const_cast<std::recursive_mutex &>(exit_mutex);
     }
 };
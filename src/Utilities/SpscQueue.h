@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Fixed-size queue between exactly one producer thread and one consumer thread, without locks.
+// Each side only writes its own index, so push() and pop() never wait for the other thread
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N-1)) == 0, "The capacity must be a power of 2");
+
+public:
+    // Add an item at the end (producer). Returns false if the queue is full
+    bool push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        items[t & (N-1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Remove the first item (consumer). Returns false if the queue is empty
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        item = items[h & (N-1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Number of items in the queue (may be outdated as soon as it returns)
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity() {
+        return N;
+    }
+
+private:
+    std::array<T,N> items{};
+    alignas(64) std::atomic<size_t> head{0};    // Next item to pop (only written by the consumer)
+    alignas(64) std::atomic<size_t> tail{0};    // Next free slot (only written by the producer)
+};
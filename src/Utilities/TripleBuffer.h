@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Latest value of a structure, written by one thread and read by another without locks. The writer
+// and the reader each own one of the 3 buffers, and swap it with the shared one when they are done
+template <typename T>
+class TripleBuffer {
+public:
+    // Publish a new value (writer)
+    void write(const T& value) {
+        buffers[back] = value;
+        back = shared.exchange(byte(back | NEW), std::memory_order_acq_rel) & INDEX;
+    }
+
+    // Returns the latest published value, or the previous one if there are no new values (reader)
+    const T& read() {
+        if (shared.load(std::memory_order_relaxed) & NEW)
+            front = shared.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return buffers[front];
+    }
+
+private:
+    using byte = uint8_t;
+    static const byte INDEX = 0b011;
+    static const byte NEW = 0b100;   // The shared buffer hasn't been read yet
+
+    std::array<T,3> buffers{};
+    std::atomic<byte> shared{1};    // Index of the buffer that isn't owned by any thread
+    byte back = 0;                  // Buffer owned by the writer
+    byte front = 2;                 // Buffer owned by the reader
+};
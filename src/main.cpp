@@ -1,17 +1,25 @@
 #include "CpuController.h"
+#include "Breakpoints.h"
+#include "Hooks.h"
 
 #include <unistd.h>
+#include <cstring>
 
 // Initialize global variables
 int64_t Globals::CLK_freq = 2000000;    // Default freq: 2000000 Hz (2 MHz)
 word Globals::OS_critical_instr = 6;    // Don't interrupt the CPU on the first 6 instructions
 
 char *Globals::out_file = nullptr;         // Don't write output to any file
+char *Globals::dump_file = nullptr;     // Don't write the final state to any file
 bool Globals::strict_flg = false;       // By default, strict mode is disabled (add extra protections)
 bool Globals::silent_flg = false;       // By default, strict mode is disabled (add extra protections)
-// Store the addresses of all the breakpoints and exitpoints
-std::vector<word> Globals::breakpoints;
-std::vector<word> Globals::exitpoints;
+Globals::Engine Globals::engine = Globals::Engine::SWITCH; // By default, use the switch-based engine
+char *Globals::aot_file = nullptr;      // No ROM compiled ahead of time
+Globals::Pacing Globals::pacing = Globals::Pacing::REALTIME; // By default, follow the host time
+// Store all the breakpoints and exitpoints
+Breakpoints Globals::breakpoints;
+// Store the routines replaced by native code
+Hooks Globals::hooks;
 
 
 [[noreturn]] void print_help(const char* prog_name) {
@@ -21,52 +29,111 @@ std::vector<word> Globals::exitpoints;
     printf("       %s [OPTION] FILE\n", prog_name);
     printf("       FILE is the path to the binary file to be loaded in ROM\n");
     printf("\nOPTIONS:\n");
+    printf("       -a file.so   Run the ROM code compiled ahead of time (with -c) in file.so\n");
     printf("       -b address   Add breakpoint at an address (pause emulator when PC=addr)\n");
+    printf("                    Format: [rom:|ram:]address[,condition]... (see README.md)\n");
+    printf("       -c file.cpp  Translate the ROM into C++ code for -a, and exit\n");
+    printf("       -D filename  Write the final state (registers, cycles and RAM) to a file at an exit point\n");
+    printf("       -e engine    Execution engine: switch (default), threaded or jit\n");
     printf("       -f freq_hz   Frequency of the emulated CPU clock (in Hertz)\n");
     printf("       -h           Show this help message\n");
-    printf("       -k time_us   Set the delay of the keyboard (per key, in microseconds)\n");
+    printf("       -H address=routine[,cycles[,cycles_per_word]]\n");
+    printf("                    Replace the routine at a ROM address by native code (see README.md)\n");
+    printf("       -k time_us   Set the delay of the keyboard (per key, in microseconds of emulated time)\n");
     printf("       -o filename  Output file (dump all CPU outputs to file)\n");
+    printf("       -p pacing    Pacing of the clock: realtime (default), low, turbo or lowjitter (see README.md)\n");
     printf("       -s           Silent mode (don't display the ncurses interface)\n");
     printf("       -S           Strict mode (disable extra emulator protections)\n");
-    printf("       -t time_us   Set the delay of the terminal (per character, in microseconds)\n");
+    printf("       -t time_us   Set the delay of the terminal (per character, in microseconds of emulated time)\n");
+    printf("       -V           Validate the hooks (-H): also run the routines and compare the results\n");
     printf("       -x address   Add exit point at an address (exit emulator when PC=addr)\n");
     printf("\nEXAMPLES:\n");
     printf("       %s -S -f 1000 my_file.hex     # Run emulator at 1 kHz in strict mode\n", prog_name);
     printf("       %s my_file.hex -o output.txt  # Write all CPU outputs to output.txt\n", prog_name);
     printf("       %s my_file.hex -b 0 -b 50     # Run with 2 breakpoints\n", prog_name);
+    printf("       %s my_file.hex -b 50,a0==3    # Pause at 0x50 when a0 is 3\n", prog_name);
     printf("       %s my_file.hex -t 1000000     # Very slow terminal: 1 char per sec.\n", prog_name);
+    printf("       %s -p turbo my_file.hex       # Run as fast as possible\n", prog_name);
+    printf("       %s -c rom.cpp my_file.hex     # Compile the ROM ahead of time (see README.md)\n", prog_name);
+    printf("       %s my_file.hex -H 1a0=mul,90  # Replace the routine at 0x1A0 by a native multiplication\n", prog_name);
     exit(EXIT_SUCCESS);
 }
 
-void add_breakpoint(const char *addr, std::vector<word>& breakpoints) {
-    char *endptr;
-    long address = strtol(addr, &endptr, 16);
+void set_engine(const char *name) {
+    if (strcmp(name, "switch") == 0) Globals::engine = Globals::Engine::SWITCH;
+    else if (strcmp(name, "threaded") == 0) Globals::engine = Globals::Engine::THREADED;
+    else if (strcmp(name, "jit") == 0) {
+#if defined(__x86_64__)
+        Globals::engine = Globals::Engine::JIT;
+#else
+        fprintf(stderr, "Error: The jit engine is only available on x86-64 hosts\n");
+        exit(EXIT_FAILURE);
+#endif
+    }
+    else {
+        fprintf(stderr, "Error: Unknown execution engine [%s], use switch, threaded or jit\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
 
-    if (*endptr != '\0') {
-        // Not all input could be parsed
-        fprintf(stderr, "Error: Invalid breakpoint [%s], make sure it's a valid hex integer\n", addr);
+void set_pacing(const char *name) {
+    if (strcmp(name, "realtime") == 0) Globals::pacing = Globals::Pacing::REALTIME;
+    else if (strcmp(name, "low") == 0) Globals::pacing = Globals::Pacing::LOW_FREQUENCY;
+    else if (strcmp(name, "turbo") == 0) Globals::pacing = Globals::Pacing::TURBO;
+    else if (strcmp(name, "lowjitter") == 0) Globals::pacing = Globals::Pacing::LOW_JITTER;
+    else {
+        fprintf(stderr, "Error: Unknown pacing mode [%s], use realtime, low, turbo or lowjitter\n", name);
         exit(EXIT_FAILURE);
     }
-    if (address < 0 || address >= 0xFFFF) {
-        fprintf(stderr, "Error: Invalid breakpoint [%s], make sure it's between 0 and 0xFFFF\n", addr);
+}
+
+void add_hook(const char *spec) {
+    std::string error = Globals::hooks.add(spec);
+    if (!error.empty()) {
+        fprintf(stderr, "Error: Invalid hook [%s], %s\n", spec, error.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+void add_breakpoint(const char *spec, Breakpoints::Kind kind) {
+    std::string error = Globals::breakpoints.add(kind, spec);
+    if (!error.empty()) {
+        fprintf(stderr, "Error: Invalid breakpoint [%s], %s\n", spec, error.c_str());
         exit(EXIT_FAILURE);
     }
-    breakpoints.push_back(word(address));
 }
 
 int main (int argc, char **argv) {
     // Variables for getopt
     int c;
     opterr = false; // Disable errors, return '?' instead
+    const char *aot_output = nullptr;
 
     // Parse arguments
     if (argc == 1) print_help(argv[0]);
     
-    // -b, -f, -k, -o, -t, -x take an argument (indicated by ':')
-    while ((c = getopt(argc, argv, "b:f:hk:o:Sst:x:")) != -1) {
+    // -a, -b, -c, -D, -e, -f, -H, -k, -o, -p, -t, -x take an argument (indicated by ':')
+    while ((c = getopt(argc, argv, "a:b:c:D:e:f:hH:k:o:p:Sst:Vx:")) != -1) {
         switch (c) {
+        case 'a':   // Run ROM code compiled ahead of time
+            Globals::aot_file = optarg;
+            Globals::engine = Globals::Engine::AOT;
+            break;
+
         case 'b':
-            add_breakpoint(optarg, Globals::breakpoints);
+            add_breakpoint(optarg, Breakpoints::BREAK);
+            break;
+        
+        case 'c':   // Compile the ROM ahead of time
+            aot_output = optarg;
+            break;
+
+        case 'D':
+            Globals::dump_file = optarg; // Write the final state to a file
+            break;
+
+        case 'e':   // Select execution engine
+            set_engine(optarg);
             break;
         
         case 'f':   // Set clock frequency
@@ -79,6 +146,10 @@ int main (int argc, char **argv) {
 
         case 'h':
             print_help(argv[0]);    // Print help and exit
+
+        case 'H':   // Replace a routine by native code
+            add_hook(optarg);
+            break;
             
         case 'k':   // Set keyboard delay
             Globals::keyboard_delay = atoi(optarg);
@@ -92,7 +163,15 @@ int main (int argc, char **argv) {
             Globals::out_file = optarg; // Output to file
             break;
 
+        case 'p':   // Select pacing mode
+            set_pacing(optarg);
+            break;
+
         case 'S':
+#if defined(STRICT_MODE) && !STRICT_MODE
+            fprintf(stderr, "Error: Strict mode has been disabled in this build (STRICT_MODE=0)\n");
+            exit(EXIT_FAILURE);
+#endif
             Globals::strict_flg = true; // Strict mode
             break;
             
@@ -108,12 +187,16 @@ int main (int argc, char **argv) {
             }
             break;
             
+        case 'V':
+            Globals::hooks.validate = true; // Validate the hooks
+            break;
+
         case 'x':
-            add_breakpoint(optarg, Globals::exitpoints);
+            add_breakpoint(optarg, Breakpoints::EXIT);
             break;
             
         case '?':   // Error
-            if (optopt == 'b' || optopt == 'f' || optopt == 'o' || optopt == 't') {
+            if (optopt == 'a' || optopt == 'b' || optopt == 'c' || optopt == 'D' || optopt == 'e' || optopt == 'f' || optopt == 'H' || optopt == 'o' || optopt == 'p' || optopt == 't') {
                 // Options that take an argument
                 fprintf(stderr, "Error: An argument is required for the option -%c\n", optopt);
             }
@@ -147,5 +230,6 @@ int main (int argc, char **argv) {
 
     CpuController cpu;
     cpu.read_ROM_file(argv[optind]);
+    if (aot_output != nullptr) cpu.compile_ROM(aot_output);
     cpu.execute();
 }